@@ -0,0 +1,72 @@
+#include "AdaptiveLimit.h"
+
+#include <algorithm>
+#include <cmath>
+
+static void lower(std::atomic<uint32_t> &value, uint32_t sample) {
+  uint32_t old = value.load(std::memory_order_relaxed);
+  while (sample < old &&
+         !value.compare_exchange_weak(old, sample, std::memory_order_relaxed)) {
+  }
+}
+
+static void raise(std::atomic<uint32_t> &value, uint32_t sample) {
+  uint32_t old = value.load(std::memory_order_relaxed);
+  while (sample > old &&
+         !value.compare_exchange_weak(old, sample, std::memory_order_relaxed)) {
+  }
+}
+
+void AdaptiveLimit::record(std::chrono::steady_clock::duration rtt,
+                           uint32_t in_flight) {
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+  uint32_t sample = us <= RTT_FLOOR.count() ? RTT_FLOOR.count()
+                    : us > UINT32_MAX       ? UINT32_MAX
+                                            : uint32_t(us);
+  window_sum_us.fetch_add(sample, std::memory_order_relaxed);
+  window_samples.fetch_add(1, std::memory_order_relaxed);
+  raise(window_peak, in_flight);
+  lower(min_rtt_us, sample);
+  lower(next_min_rtt_us, sample);
+
+  int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+  int64_t end = window_end.load(std::memory_order_relaxed);
+  if (now < end) {
+    return;
+  }
+  std::chrono::steady_clock::duration window = SAMPLE_WINDOW;
+  // only one of the threads that get here closes the window
+  if (!window_end.compare_exchange_strong(end, now + window.count(),
+                                          std::memory_order_relaxed)) {
+    return;
+  }
+  update(now, in_flight);
+}
+
+void AdaptiveLimit::update(int64_t now, uint32_t in_flight) {
+  uint64_t sum = window_sum_us.exchange(0, std::memory_order_relaxed);
+  uint32_t samples = window_samples.exchange(0, std::memory_order_relaxed);
+  uint32_t peak = window_peak.exchange(0, std::memory_order_relaxed);
+  if (now >= min_rtt_end.load(std::memory_order_relaxed)) {
+    std::chrono::steady_clock::duration period = MIN_RTT_WINDOW;
+    min_rtt_end.store(now + period.count(), std::memory_order_relaxed);
+    min_rtt_us.store(next_min_rtt_us.exchange(UINT32_MAX,
+                                              std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+  }
+  uint32_t min_rtt = min_rtt_us.load(std::memory_order_relaxed);
+  if (!samples || min_rtt == UINT32_MAX) {
+    return;
+  }
+  double average = double(sum) / samples;
+  double gradient =
+      std::clamp(min_rtt * RTT_TOLERANCE / average, 0.5, 1.0);
+  double old_limit = limit.load(std::memory_order_relaxed);
+  double new_limit = old_limit * gradient + std::sqrt(old_limit);
+  // a limit nobody comes close to says nothing about the origin
+  if (new_limit > old_limit && std::max(peak, in_flight) < old_limit / 2) {
+    return;
+  }
+  limit.store(std::clamp(uint32_t(new_limit), MIN_LIMIT, MAX_LIMIT),
+              std::memory_order_relaxed);
+}
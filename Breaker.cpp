@@ -0,0 +1,81 @@
+#include "Breaker.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+static std::mutex registry_mutex;
+// Never pruned, a breaker's budget has to outlive the connections using it
+static std::map<std::string, std::shared_ptr<CircuitBreaker>> registry;
+
+CircuitBreaker::Slot &CircuitBreaker::Slot::operator=(Slot &&other) noexcept {
+  if (this != &other) {
+    reset();
+    counter = other.counter;
+    other.counter = nullptr;
+  }
+  return *this;
+}
+
+void CircuitBreaker::Slot::reset() {
+  if (counter) {
+    counter->fetch_sub(1, std::memory_order_relaxed);
+    counter = nullptr;
+  }
+}
+
+std::shared_ptr<CircuitBreaker> CircuitBreaker::get(
+    const std::string &upstream) {
+  std::lock_guard<std::mutex> lock{registry_mutex};
+  auto &breaker = registry[upstream];
+  if (!breaker) {
+    breaker = std::make_shared<CircuitBreaker>();
+  }
+  return breaker;
+}
+
+CircuitBreaker::Slot CircuitBreaker::acquire(std::atomic<uint32_t> &counter,
+                                             uint32_t limit) {
+  if (counter.fetch_add(1, std::memory_order_relaxed) >= limit) {
+    counter.fetch_sub(1, std::memory_order_relaxed);
+    return Slot{};
+  }
+  return Slot{&counter};
+}
+
+CircuitBreaker::Slot CircuitBreaker::connection(uint32_t limit) {
+  return acquire(connections, limit);
+}
+
+CircuitBreaker::Slot CircuitBreaker::request(bool first_attempt) {
+  Slot slot = acquire(pending_requests,
+                      std::min(MAX_PENDING_REQUESTS, concurrency.current()));
+  if (slot && first_attempt) {
+    uint32_t tokens = retry_tokens.load(std::memory_order_relaxed);
+    while (tokens < RETRY_BUDGET &&
+           !retry_tokens.compare_exchange_weak(
+               tokens, std::min(tokens + RETRY_DEPOSIT, RETRY_BUDGET),
+               std::memory_order_relaxed)) {
+    }
+  }
+  return slot;
+}
+
+void CircuitBreaker::record_rtt(std::chrono::steady_clock::duration rtt) {
+  concurrency.record(rtt, pending_requests.load(std::memory_order_relaxed));
+}
+
+CircuitBreaker::Slot CircuitBreaker::retry() {
+  Slot slot = acquire(active_retries, MAX_ACTIVE_RETRIES);
+  if (!slot) {
+    return slot;
+  }
+  uint32_t tokens = retry_tokens.load(std::memory_order_relaxed);
+  do {
+    if (tokens < RETRY_COST) {
+      return Slot{};
+    }
+  } while (!retry_tokens.compare_exchange_weak(tokens, tokens - RETRY_COST,
+                                               std::memory_order_relaxed));
+  return slot;
+}
@@ -0,0 +1,155 @@
+#include "Cache.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "utils.h"
+
+namespace {
+
+constexpr size_t SHARDS = 16;
+
+struct Entry {
+  std::string key;
+  std::shared_ptr<const std::string> response;
+  std::chrono::steady_clock::time_point stored_at;
+  std::chrono::steady_clock::time_point expires_at;
+};
+
+struct Shard {
+  std::mutex mutex;
+  // most recently used first
+  std::list<Entry> lru;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  size_t bytes = 0;
+};
+
+// Changes on a config reload, shards shrink as they are stored to
+std::atomic<size_t> shard_capacity{0};
+std::array<Shard, SHARDS> shards;
+
+Shard &shard_for(const std::string &key) {
+  return shards[std::hash<std::string>{}(key) % SHARDS];
+}
+
+size_t entry_size(const Entry &entry) {
+  return entry.key.size() + entry.response->size();
+}
+
+void erase(Shard &shard, std::list<Entry>::iterator it) {
+  shard.bytes -= entry_size(*it);
+  shard.index.erase(it->key);
+  shard.lru.erase(it);
+}
+
+// Seconds from a Cache-Control directive like "max-age=60", -1 without it
+long directive_seconds(const std::string &cache_control, const char *name) {
+  size_t pos = cache_control.find(name);
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  return std::strtol(cache_control.c_str() + pos + std::strlen(name),
+                     nullptr, 10);
+}
+
+// How long the response may be shared, 0 if it may not
+long shared_lifetime(const std::string &header) {
+  // "HTTP/1.1 200 OK"
+  if (std::atoi(header.c_str() + header.find(' ') + 1) != 200 ||
+      !parse_field(header, "set-cookie").empty() ||
+      !parse_field(header, "vary").empty()) {
+    return 0;
+  }
+  std::string cache_control = parse_field(header, "cache-control");
+  to_lowercase(cache_control);
+  if (cache_control.find("no-store") != std::string::npos ||
+      cache_control.find("no-cache") != std::string::npos ||
+      cache_control.find("private") != std::string::npos) {
+    return 0;
+  }
+  long lifetime = directive_seconds(cache_control, "s-maxage=");
+  if (lifetime < 0) {
+    lifetime = directive_seconds(cache_control, "max-age=");
+  }
+  return lifetime > 0 ? lifetime : 0;
+}
+
+}  // namespace
+
+void ResponseCache::set_capacity(size_t bytes) {
+  shard_capacity.store(bytes / SHARDS, std::memory_order_relaxed);
+}
+
+bool ResponseCache::enabled() {
+  return shard_capacity.load(std::memory_order_relaxed) > 0;
+}
+
+bool ResponseCache::lookup(const std::string &key, std::string &response) {
+  if (!enabled()) {
+    return false;
+  }
+  Shard &shard = shard_for(key);
+  auto now = std::chrono::steady_clock::now();
+  std::shared_ptr<const std::string> stored;
+  std::chrono::steady_clock::time_point stored_at;
+  {
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) {
+      return false;
+    }
+    auto it = found->second;
+    if (it->expires_at <= now) {
+      erase(shard, it);
+      return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it);
+    stored = it->response;
+    stored_at = it->stored_at;
+  }
+  // copied outside the lock, the entry can't change under the shared_ptr
+  auto age = std::chrono::duration_cast<std::chrono::seconds>(now - stored_at);
+  size_t status_end = stored->find("\r\n") + 2;
+  response.reserve(stored->size() + 32);
+  response.assign(*stored, 0, status_end);
+  response += "Age: " + std::to_string(age.count()) + "\r\n";
+  response.append(*stored, status_end);
+  return true;
+}
+
+void ResponseCache::store(const std::string &key, const std::string &response) {
+  if (!enabled()) {
+    return;
+  }
+  size_t header_end = response.find("\r\n\r\n");
+  if (header_end == std::string::npos) {
+    return;
+  }
+  long lifetime = shared_lifetime(response.substr(0, header_end + 4));
+  size_t capacity = shard_capacity.load(std::memory_order_relaxed);
+  if (!lifetime || key.size() + response.size() > capacity) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  Entry entry{key, std::make_shared<const std::string>(response), now,
+              now + std::chrono::seconds(lifetime)};
+  Shard &shard = shard_for(key);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  if (auto found = shard.index.find(key); found != shard.index.end()) {
+    erase(shard, found->second);
+  }
+  shard.bytes += entry_size(entry);
+  shard.lru.push_front(std::move(entry));
+  shard.index.emplace(key, shard.lru.begin());
+  while (shard.bytes > capacity) {
+    erase(shard, std::prev(shard.lru.end()));
+  }
+}
@@ -0,0 +1,196 @@
+#include "ClientLimits.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+using namespace boost;
+
+namespace {
+
+constexpr unsigned CONNECTION_BITS = 24;
+constexpr uint64_t CONNECTION_MASK = (uint64_t{1} << CONNECTION_BITS) - 1;
+constexpr uint32_t TOKEN = 1000;
+
+uint32_t max_connections = 0;
+uint32_t requests_per_second = 0;
+uint32_t bytes_per_second = 0;
+uint32_t byte_burst = 0;
+std::unique_ptr<ClientLimits::Entry[]> table;
+
+uint32_t now_ms() {
+  static const auto start = std::chrono::steady_clock::now();
+  return static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+}
+
+// 40 bits of a 64-bit mix of the address, never 0
+uint64_t client_key(const asio::ip::address &address, uint64_t &hash) {
+  hash = 14695981039346656037ULL;
+  auto mix = [&hash](const unsigned char *bytes, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+    }
+  };
+  if (address.is_v4()) {
+    auto bytes = address.to_v4().to_bytes();
+    mix(bytes.data(), bytes.size());
+  } else {
+    auto bytes = address.to_v6().to_bytes();
+    mix(bytes.data(), bytes.size());
+  }
+  uint64_t key = hash >> CONNECTION_BITS;
+  return key ? key : 1;
+}
+
+// A full bucket, topped up now
+uint64_t full_bucket() {
+  return uint64_t{now_ms()} << 32 | uint64_t{requests_per_second} * TOKEN;
+}
+
+uint64_t full_byte_bucket() { return uint64_t{now_ms()} << 32 | byte_burst; }
+
+}  // namespace
+
+void ClientLimits::configure(uint32_t connections, uint32_t rps,
+                             uint32_t bps) {
+  max_connections = std::min<uint32_t>(connections, CONNECTION_MASK);
+  // the bucket holds up to a second of tokens in 32 bits
+  requests_per_second = std::min(rps, UINT32_MAX / TOKEN);
+  bytes_per_second = bps;
+  byte_burst = std::max(bytes_per_second / 10, MIN_BYTE_BURST);
+  if (enabled() && !table) {
+    table.reset(new Entry[SHARDS * SHARD_SLOTS]);
+  }
+}
+
+bool ClientLimits::enabled() {
+  return max_connections || requests_per_second || bytes_per_second;
+}
+
+bool ClientLimits::limits_bandwidth() { return bytes_per_second; }
+
+bool ClientLimits::admit(const asio::ip::address &address, Ticket &ticket) {
+  if (!enabled()) {
+    return true;
+  }
+  uint64_t hash;
+  uint64_t key = client_key(address, hash);
+  Entry *shard = &table[(hash & (SHARDS - 1)) * SHARD_SLOTS];
+  size_t first = (hash >> 6) % SHARD_SLOTS;
+  for (int attempt = 0; attempt < 4; ++attempt) {
+    Entry *mine = nullptr;
+    Entry *idle = nullptr;
+    uint64_t idle_owner = 0;
+    for (size_t probe = 0; probe < PROBES; ++probe) {
+      Entry &entry = shard[(first + probe) % SHARD_SLOTS];
+      uint64_t owner = entry.owner.load(std::memory_order_acquire);
+      if (owner >> CONNECTION_BITS == key) {
+        mine = &entry;
+        break;
+      }
+      // a slot without connections can be taken, a free one preferably
+      if ((owner & CONNECTION_MASK) == 0 &&
+          (!idle || (idle_owner && !owner))) {
+        idle = &entry;
+        idle_owner = owner;
+      }
+    }
+    if (mine) {
+      uint64_t owner = mine->owner.load(std::memory_order_relaxed);
+      while (owner >> CONNECTION_BITS == key) {
+        if (max_connections &&
+            (owner & CONNECTION_MASK) >= max_connections) {
+          return false;
+        }
+        if (mine->owner.compare_exchange_weak(owner, owner + 1,
+                                              std::memory_order_acq_rel)) {
+          ticket = Ticket{mine};
+          return true;
+        }
+      }
+      // taken over in the meantime, look again
+      continue;
+    }
+    if (!idle) {
+      // every slot is busy, let the client through unlimited
+      return true;
+    }
+    if (idle->owner.compare_exchange_strong(idle_owner,
+                                            key << CONNECTION_BITS | 1,
+                                            std::memory_order_acq_rel)) {
+      idle->bucket.store(full_bucket(), std::memory_order_relaxed);
+      idle->bytes.store(full_byte_bucket(), std::memory_order_relaxed);
+      ticket = Ticket{idle};
+      return true;
+    }
+  }
+  return true;
+}
+
+ClientLimits::Ticket &ClientLimits::Ticket::operator=(
+    Ticket &&other) noexcept {
+  if (this != &other) {
+    release();
+    entry = other.entry;
+    other.entry = nullptr;
+  }
+  return *this;
+}
+
+bool ClientLimits::Ticket::take_request() {
+  if (!entry || !requests_per_second) {
+    return true;
+  }
+  uint32_t now = now_ms();
+  uint64_t bucket = entry->bucket.load(std::memory_order_relaxed);
+  uint64_t updated;
+  do {
+    uint32_t last = static_cast<uint32_t>(bucket >> 32);
+    uint64_t tokens = static_cast<uint32_t>(bucket);
+    // requests_per_second thousandths of a token every millisecond,
+    // unsigned so it survives now_ms() wrapping
+    tokens = std::min<uint64_t>(
+        tokens + uint64_t{now - last} * requests_per_second,
+        uint64_t{requests_per_second} * TOKEN);
+    if (tokens < TOKEN) {
+      return false;
+    }
+    updated = uint64_t{now} << 32 | (tokens - TOKEN);
+  } while (!entry->bucket.compare_exchange_weak(bucket, updated,
+                                                std::memory_order_relaxed));
+  return true;
+}
+
+std::chrono::milliseconds ClientLimits::Ticket::take_bytes(size_t n) {
+  if (!entry || !bytes_per_second) {
+    return std::chrono::milliseconds{0};
+  }
+  uint32_t now = now_ms();
+  uint64_t bucket = entry->bytes.load(std::memory_order_relaxed);
+  uint64_t updated;
+  do {
+    uint32_t last = static_cast<uint32_t>(bucket >> 32);
+    uint64_t tokens = std::min<uint64_t>(
+        static_cast<uint32_t>(bucket) +
+            uint64_t{now - last} * bytes_per_second / 1000,
+        byte_burst);
+    if (tokens < n) {
+      return std::chrono::milliseconds{
+          ((n - tokens) * 1000 + bytes_per_second - 1) / bytes_per_second};
+    }
+    updated = uint64_t{now} << 32 | (tokens - n);
+  } while (!entry->bytes.compare_exchange_weak(bucket, updated,
+                                               std::memory_order_relaxed));
+  return std::chrono::milliseconds{0};
+}
+
+void ClientLimits::Ticket::release() {
+  if (entry) {
+    entry->owner.fetch_sub(1, std::memory_order_acq_rel);
+    entry = nullptr;
+  }
+}
@@ -0,0 +1,336 @@
+#include "Cluster.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include "Histogram.h"
+
+// Weight of a new sample in the latency EWMA, as a shift: 1/8
+constexpr unsigned EWMA_SHIFT = 3;
+// What an endpoint without any latency sample yet is assumed to cost, so new
+// endpoints get tried instead of starved
+constexpr uint32_t UNKNOWN_LATENCY_US = 1;
+
+bool parse_lb_policy(const std::string &name, LbPolicy &policy) {
+  if (name == "round_robin") {
+    policy = LbPolicy::ROUND_ROBIN;
+  } else if (name == "least_request") {
+    policy = LbPolicy::LEAST_REQUEST;
+  } else if (name == "p2c") {
+    policy = LbPolicy::P2C;
+  } else if (name == "ewma") {
+    policy = LbPolicy::EWMA;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static size_t random_below(size_t n) {
+  thread_local std::minstd_rand rng{std::random_device{}()};
+  return rng() % n;
+}
+
+static int64_t ticks_now() {
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+Cluster::Cluster(std::string name, LbPolicy policy,
+                 std::vector<boost::asio::ip::tcp::endpoint> endpoints)
+    : cluster_name{std::move(name)},
+      policy{policy},
+      endpoints{std::move(endpoints)},
+      outstanding{new std::atomic<uint32_t>[this->endpoints.size()]()},
+      latency_ewma{new std::atomic<uint32_t>[this->endpoints.size()]()},
+      consecutive_5xx{new std::atomic<uint32_t>[this->endpoints.size()]()},
+      connect_failures{new std::atomic<uint32_t>[this->endpoints.size()]()},
+      probe_failures{new std::atomic<uint32_t>[this->endpoints.size()]()},
+      ejections{new std::atomic<uint32_t>[this->endpoints.size()]()},
+      ejected_until{new std::atomic<int64_t>[this->endpoints.size()]()},
+      ttfb_counts{new std::atomic<uint32_t>[Histogram::BUCKETS]()} {}
+
+void Cluster::set_health_check(std::string path,
+                               std::chrono::milliseconds interval) {
+  health_check_path = std::move(path);
+  health_check_interval = interval;
+}
+
+size_t Cluster::cost(size_t i) const {
+  size_t load = outstanding[i].load(std::memory_order_relaxed);
+  if (policy != LbPolicy::EWMA) {
+    return load;
+  }
+  uint32_t latency = latency_ewma[i].load(std::memory_order_relaxed);
+  return size_t{latency ? latency : UNKNOWN_LATENCY_US} * (load + 1);
+}
+
+bool Cluster::available(size_t i, int64_t now) const {
+  return probe_failures[i].load(std::memory_order_relaxed) <
+             UNHEALTHY_THRESHOLD &&
+         ejected_until[i].load(std::memory_order_relaxed) <= now;
+}
+
+size_t Cluster::random_available(int64_t now, size_t skip) const {
+  size_t n = endpoints.size();
+  size_t first = random_below(n);
+  for (size_t k = 0; k < n; ++k) {
+    size_t i = (first + k) % n;
+    if (i != skip && available(i, now)) {
+      return i;
+    }
+  }
+  return n;
+}
+
+size_t Cluster::pick() {
+  size_t n = endpoints.size();
+  if (n == 1) {
+    return 0;
+  }
+  int64_t now = ticks_now();
+  switch (policy) {
+    case LbPolicy::ROUND_ROBIN: {
+      size_t first = next.fetch_add(1, std::memory_order_relaxed) % n;
+      for (size_t k = 0; k < n; ++k) {
+        if (available((first + k) % n, now)) {
+          return (first + k) % n;
+        }
+      }
+      return first;
+    }
+    case LbPolicy::LEAST_REQUEST: {
+      // start the scan where round robin would be so ties rotate
+      size_t first = next.fetch_add(1, std::memory_order_relaxed) % n;
+      size_t best = n;
+      size_t best_cost = std::numeric_limits<size_t>::max();
+      size_t fallback = first;
+      size_t fallback_cost = std::numeric_limits<size_t>::max();
+      for (size_t k = 0; k < n; ++k) {
+        size_t i = (first + k) % n;
+        size_t c = cost(i);
+        if (c < fallback_cost) {
+          fallback = i;
+          fallback_cost = c;
+        }
+        if (c < best_cost && available(i, now)) {
+          best = i;
+          best_cost = c;
+        }
+      }
+      return best < n ? best : fallback;
+    }
+    case LbPolicy::P2C:
+    case LbPolicy::EWMA:
+    default: {
+      size_t a = random_available(now, n);
+      if (a == n) {
+        // nothing is available, pick among all of them
+        a = random_below(n);
+        size_t b = random_below(n - 1);
+        // two distinct endpoints
+        if (b >= a) {
+          ++b;
+        }
+        return cost(b) < cost(a) ? b : a;
+      }
+      size_t b = random_available(now, a);
+      return b < n && cost(b) < cost(a) ? b : a;
+    }
+  }
+}
+
+size_t Cluster::pick_other(size_t skip) {
+  size_t i = pick();
+  int64_t now = ticks_now();
+  if (i != skip && available(i, now)) {
+    return i;
+  }
+  return random_available(now, skip);
+}
+
+void Cluster::start(size_t i) {
+  outstanding[i].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Cluster::finish(size_t i) {
+  outstanding[i].fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Cluster::record_response(size_t i, int status,
+                              std::chrono::steady_clock::duration latency) {
+  if (status / 100 == 5) {
+    if (consecutive_5xx[i].fetch_add(1, std::memory_order_relaxed) + 1 >=
+        CONSECUTIVE_5XX) {
+      eject(i, "consecutive 5xx");
+    }
+  } else {
+    consecutive_5xx[i].store(0, std::memory_order_relaxed);
+  }
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency)
+                .count();
+  if (hedging) {
+    uint64_t value = us > 0 ? std::min<uint64_t>(us, Histogram::MAX_VALUE) : 0;
+    ttfb_counts[Histogram::bucket_index(value)].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+  uint32_t sample = us <= 0 ? 1
+                    : us > std::numeric_limits<uint32_t>::max()
+                        ? std::numeric_limits<uint32_t>::max()
+                        : uint32_t(us);
+  auto &ewma = latency_ewma[i];
+  uint32_t old = ewma.load(std::memory_order_relaxed);
+  uint32_t updated;
+  do {
+    updated = old ? old - (old >> EWMA_SHIFT) + (sample >> EWMA_SHIFT)
+                  : sample;
+  } while (!ewma.compare_exchange_weak(old, updated,
+                                       std::memory_order_relaxed));
+}
+
+void Cluster::record_connect(size_t i, bool connected) {
+  if (connected) {
+    connect_failures[i].store(0, std::memory_order_relaxed);
+  } else if (connect_failures[i].fetch_add(1, std::memory_order_relaxed) +
+                 1 >=
+             CONSECUTIVE_CONNECT_FAILURES) {
+    eject(i, "connect failures");
+  }
+}
+
+void Cluster::record_probe(size_t i, bool healthy) {
+  if (healthy) {
+    if (probe_failures[i].exchange(0, std::memory_order_relaxed) >=
+        UNHEALTHY_THRESHOLD) {
+      std::cerr << cluster_name << ": " << endpoints[i] << " is healthy again"
+                << std::endl;
+    }
+  } else if (probe_failures[i].fetch_add(1, std::memory_order_relaxed) + 1 ==
+             UNHEALTHY_THRESHOLD) {
+    std::cerr << cluster_name << ": " << endpoints[i]
+              << " failed its health check" << std::endl;
+  }
+}
+
+void Cluster::detect_latency_outliers() {
+  size_t n = endpoints.size();
+  int64_t now = ticks_now();
+  std::vector<uint32_t> latencies;
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t latency = latency_ewma[i].load(std::memory_order_relaxed);
+    if (latency && available(i, now)) {
+      latencies.push_back(latency);
+    }
+  }
+  // an outlier needs at least two others to stand out from
+  if (latencies.size() < 3) {
+    return;
+  }
+  auto median = latencies.begin() + latencies.size() / 2;
+  std::nth_element(latencies.begin(), median, latencies.end());
+  uint64_t limit = uint64_t{*median} * LATENCY_OUTLIER_FACTOR;
+  for (size_t i = 0; i < n; ++i) {
+    if (latency_ewma[i].load(std::memory_order_relaxed) > limit &&
+        available(i, now)) {
+      eject(i, "latency outlier");
+    }
+  }
+}
+
+void Cluster::refresh_hedge_delay() {
+  if (!hedging) {
+    return;
+  }
+  uint64_t total = 0;
+  for (size_t b = 0; b < Histogram::BUCKETS; ++b) {
+    total += ttfb_counts[b].load(std::memory_order_relaxed);
+  }
+  if (total >= MIN_HEDGE_SAMPLES) {
+    auto rank = static_cast<uint64_t>(total * HEDGE_PERCENTILE / 100);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < Histogram::BUCKETS; ++b) {
+      seen += ttfb_counts[b].load(std::memory_order_relaxed);
+      if (seen > rank) {
+        uint64_t bound = Histogram::bucket_upper_bound(b);
+        hedge_delay_us.store(
+            std::min<uint64_t>(bound, std::numeric_limits<uint32_t>::max()),
+            std::memory_order_relaxed);
+        break;
+      }
+    }
+  }
+  // halve every count so the percentile follows the origins as they change
+  for (size_t b = 0; b < Histogram::BUCKETS; ++b) {
+    uint32_t count = ttfb_counts[b].load(std::memory_order_relaxed);
+    if (count) {
+      ttfb_counts[b].fetch_sub(count - count / 2, std::memory_order_relaxed);
+    }
+  }
+}
+
+void Cluster::eject(size_t i, const char *reason) {
+  size_t n = endpoints.size();
+  int64_t now = ticks_now();
+  size_t ejected = 0;
+  for (size_t k = 0; k < n; ++k) {
+    if (ejected_until[k].load(std::memory_order_relaxed) > now) {
+      ++ejected;
+    }
+  }
+  int64_t until = ejected_until[i].load(std::memory_order_relaxed);
+  if (until > now || (ejected + 1) * 2 > n) {
+    return;
+  }
+  std::chrono::steady_clock::duration base = BASE_EJECTION;
+  // an endpoint that has behaved for a while starts over at the base time
+  if (now - until > (base * MAX_EJECTION_MULTIPLIER).count()) {
+    ejections[i].store(0, std::memory_order_relaxed);
+  }
+  uint32_t times = std::min(
+      ejections[i].fetch_add(1, std::memory_order_relaxed) + 1,
+      MAX_EJECTION_MULTIPLIER);
+  ejected_until[i].store(now + (base * times).count(),
+                         std::memory_order_relaxed);
+  // it comes back with a clean slate
+  consecutive_5xx[i].store(0, std::memory_order_relaxed);
+  connect_failures[i].store(0, std::memory_order_relaxed);
+  latency_ewma[i].store(0, std::memory_order_relaxed);
+  std::cerr << cluster_name << ": ejected " << endpoints[i] << " for "
+            << BASE_EJECTION.count() * times << "s, " << reason << std::endl;
+}
+
+EndpointLease::EndpointLease(Cluster *cluster, size_t endpoint)
+    : cluster{cluster}, endpoint{endpoint} {
+  cluster->start(endpoint);
+}
+
+EndpointLease::EndpointLease(EndpointLease &&other) noexcept
+    : cluster{other.cluster}, endpoint{other.endpoint} {
+  other.cluster = nullptr;
+}
+
+EndpointLease &EndpointLease::operator=(EndpointLease &&other) noexcept {
+  if (this != &other) {
+    release();
+    cluster = other.cluster;
+    endpoint = other.endpoint;
+    other.cluster = nullptr;
+  }
+  return *this;
+}
+
+void EndpointLease::finish(int status,
+                           std::chrono::steady_clock::duration latency) {
+  if (cluster) {
+    cluster->record_response(endpoint, status, latency);
+  }
+  release();
+}
+
+void EndpointLease::release() {
+  if (cluster) {
+    cluster->finish(endpoint);
+    cluster = nullptr;
+  }
+}
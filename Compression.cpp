@@ -0,0 +1,286 @@
+#include "Compression.h"
+
+#ifdef PROXY_WITH_COMPRESSION
+#include <brotli/encode.h>
+#include <zlib.h>
+#endif
+#ifdef PROXY_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <string_view>
+
+#include "utils.h"
+
+namespace {
+
+#ifdef PROXY_WITH_COMPRESSION
+// Slice of the body the encoder gets at a time, and its output buffer
+constexpr size_t CHUNK = 16 * 1024;
+// Smaller bodies don't shrink enough to be worth the CPU
+constexpr size_t MIN_SIZE = 1024;
+// 32 KiB window and 128 KiB of hash chains
+constexpr int GZIP_LEVEL = 6;
+constexpr int GZIP_MEM_LEVEL = 8;
+// 256 KiB window, quality 5 is where brotli still keeps up with gzip -6
+constexpr int BROTLI_QUALITY = 5;
+constexpr int BROTLI_WINDOW_LOG = 18;
+#endif
+#ifdef PROXY_WITH_ZSTD
+constexpr int ZSTD_LEVEL = 3;
+constexpr int ZSTD_WINDOW_LOG = 18;
+#endif
+
+#ifdef PROXY_WITH_COMPRESSION
+// q of one coding in an Accept-Encoding value, -1 if it isn't listed
+double quality(const std::string &accept_encoding, std::string_view coding) {
+  size_t pos = 0;
+  while (pos < accept_encoding.size()) {
+    size_t end = std::min(accept_encoding.find(',', pos),
+                          accept_encoding.size());
+    size_t name_beg = accept_encoding.find_first_not_of(" \t", pos);
+    size_t name_end = std::min(accept_encoding.find_first_of(" \t;", name_beg),
+                               end);
+    if (name_beg < end &&
+        std::string_view{accept_encoding}.substr(name_beg,
+                                                 name_end - name_beg) ==
+            coding) {
+      size_t q = accept_encoding.find("q=", name_end);
+      return q < end ? std::strtod(accept_encoding.c_str() + q + 2, nullptr)
+                     : 1;
+    }
+    pos = end + 1;
+  }
+  return -1;
+}
+
+// Media types worth compressing, everything else (images, video, audio,
+// archives, fonts) is compressed already or close to it
+bool compressible(std::string content_type) {
+  content_type = content_type.substr(0, content_type.find(';'));
+  if (content_type.compare(0, 5, "text/") == 0) {
+    return true;
+  }
+  auto ends_with = [&content_type](std::string_view suffix) {
+    return content_type.size() >= suffix.size() &&
+           content_type.compare(content_type.size() - suffix.size(),
+                                suffix.size(), suffix) == 0;
+  };
+  return content_type == "application/json" ||
+         content_type == "application/javascript" ||
+         content_type == "application/xml" ||
+         content_type == "application/wasm" || ends_with("+json") ||
+         ends_with("+xml");
+}
+
+bool gzip(std::string_view body, std::string &out) {
+  z_stream stream{};
+  // 16 + window bits asks for a gzip wrapper instead of zlib's
+  if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 16 + 15, GZIP_MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  char buf[CHUNK];
+  size_t pos = 0;
+  int ret = Z_OK;
+  do {
+    size_t len = std::min(CHUNK, body.size() - pos);
+    stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(body.data() + pos));
+    stream.avail_in = len;
+    pos += len;
+    int flush = pos == body.size() ? Z_FINISH : Z_NO_FLUSH;
+    do {
+      stream.next_out = reinterpret_cast<Bytef *>(buf);
+      stream.avail_out = CHUNK;
+      ret = deflate(&stream, flush);
+      out.append(buf, CHUNK - stream.avail_out);
+    } while (stream.avail_out == 0);
+  } while (pos < body.size());
+  deflateEnd(&stream);
+  return ret == Z_STREAM_END;
+}
+
+bool brotli(std::string_view body, std::string &out) {
+  BrotliEncoderState *state =
+      BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+  if (!state) {
+    return false;
+  }
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, BROTLI_QUALITY);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_LGWIN, BROTLI_WINDOW_LOG);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT, body.size());
+  uint8_t buf[CHUNK];
+  size_t pos = 0;
+  bool ok = true;
+  while (ok && !BrotliEncoderIsFinished(state)) {
+    size_t len = std::min(CHUNK, body.size() - pos);
+    size_t avail_in = len;
+    auto next_in = reinterpret_cast<const uint8_t *>(body.data() + pos);
+    size_t avail_out = CHUNK;
+    uint8_t *next_out = buf;
+    // once finishing, the rest of the body has to be offered every call
+    ok = BrotliEncoderCompressStream(
+        state,
+        pos + len == body.size() ? BROTLI_OPERATION_FINISH
+                                 : BROTLI_OPERATION_PROCESS,
+        &avail_in, &next_in, &avail_out, &next_out, nullptr);
+    out.append(reinterpret_cast<char *>(buf), CHUNK - avail_out);
+    pos += len - avail_in;
+  }
+  BrotliEncoderDestroyInstance(state);
+  return ok;
+}
+#endif
+
+#ifdef PROXY_WITH_ZSTD
+bool zstd(std::string_view body, std::string &out) {
+  ZSTD_CCtx *ctx = ZSTD_createCCtx();
+  if (!ctx) {
+    return false;
+  }
+  ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+  ZSTD_CCtx_setParameter(ctx, ZSTD_c_windowLog, ZSTD_WINDOW_LOG);
+  ZSTD_CCtx_setPledgedSrcSize(ctx, body.size());
+  char buf[CHUNK];
+  ZSTD_inBuffer in{body.data(), 0, 0};
+  ZSTD_EndDirective mode;
+  size_t left;
+  do {
+    in.size = std::min(body.size(), in.pos + CHUNK);
+    mode = in.size == body.size() ? ZSTD_e_end : ZSTD_e_continue;
+    ZSTD_outBuffer output{buf, CHUNK, 0};
+    left = ZSTD_compressStream2(ctx, &output, &in, mode);
+    if (ZSTD_isError(left)) {
+      break;
+    }
+    out.append(buf, output.pos);
+  } while (mode != ZSTD_e_end || left);
+  ZSTD_freeCCtx(ctx);
+  return !ZSTD_isError(left);
+}
+#endif
+
+#ifdef PROXY_WITH_COMPRESSION
+bool encode(Encoding encoding, std::string_view body, std::string &out) {
+  switch (encoding) {
+    case Encoding::GZIP:
+      return gzip(body, out);
+    case Encoding::BROTLI:
+      return brotli(body, out);
+#ifdef PROXY_WITH_ZSTD
+    case Encoding::ZSTD:
+      return zstd(body, out);
+#endif
+    default:
+      return false;
+  }
+}
+#endif
+
+}  // namespace
+
+Encoding negotiate(std::string accept_encoding) {
+#ifdef PROXY_WITH_COMPRESSION
+  to_lowercase(accept_encoding);
+  double any = quality(accept_encoding, "*");
+  auto accepts = [&accept_encoding, any](std::string_view coding) {
+    double q = quality(accept_encoding, coding);
+    return q > 0 || (q < 0 && any > 0);
+  };
+  if (accepts("br")) {
+    return Encoding::BROTLI;
+  }
+#ifdef PROXY_WITH_ZSTD
+  if (accepts("zstd")) {
+    return Encoding::ZSTD;
+  }
+#endif
+  if (accepts("gzip") || quality(accept_encoding, "x-gzip") > 0) {
+    return Encoding::GZIP;
+  }
+#endif
+  (void)accept_encoding;
+  return Encoding::IDENTITY;
+}
+
+const char *encoding_name(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::GZIP:
+      return "gzip";
+    case Encoding::BROTLI:
+      return "br";
+    case Encoding::ZSTD:
+      return "zstd";
+    default:
+      return "identity";
+  }
+}
+
+bool compress_response(std::string &response, Encoding encoding) {
+#ifdef PROXY_WITH_COMPRESSION
+  size_t header_end = response.find("\r\n\r\n");
+  if (encoding == Encoding::IDENTITY || header_end == std::string::npos) {
+    return false;
+  }
+  const std::string header = response.substr(0, header_end + 4);
+  // "HTTP/1.1 200 OK", partial content can't be re-encoded
+  if (std::atoi(header.c_str() + header.find(' ') + 1) != 200 ||
+      !parse_field(header, "content-encoding").empty() ||
+      !compressible(parse_field(header, "content-type")) ||
+      find_ci(parse_field(header, "cache-control"), "no-transform")) {
+    return false;
+  }
+  std::string body = identify_body(header) == Body::CHUNKED
+                         ? unchunk(response, header_end + 4)
+                         : response.substr(header_end + 4);
+  std::string encoded;
+  if (body.size() < MIN_SIZE || !encode(encoding, body, encoded) ||
+      encoded.size() >= body.size()) {
+    return false;
+  }
+  // The status line and every field but the framing ones, which change
+  size_t line = header.find("\r\n") + 2;
+  std::string rewritten = header.substr(0, line);
+  while (line < header_end + 2) {
+    size_t line_end = header.find("\r\n", line) + 2;
+    std::string name = header.substr(line, header.find(':', line) - line);
+    to_lowercase(name);
+    if (name == "etag") {
+      // a strong ETag vouches for the identity bytes
+      size_t value =
+          header.find_first_not_of(" \t", header.find(':', line) + 1);
+      rewritten += "ETag: ";
+      if (header[value] == '"') {
+        rewritten += "W/";
+      }
+      rewritten.append(header, value, line_end - value);
+    } else if (name != "content-length" && name != "transfer-encoding") {
+      rewritten.append(header, line, line_end - line);
+    }
+    line = line_end;
+  }
+  rewritten += "Content-Encoding: ";
+  rewritten += encoding_name(encoding);
+  rewritten += "\r\nContent-Length: " + std::to_string(encoded.size()) +
+               "\r\n\r\n";
+  rewritten += encoded;
+  response = std::move(rewritten);
+  return true;
+#else
+  (void)response;
+  (void)encoding;
+  return false;
+#endif
+}
+
+void add_vary(std::string &response) {
+  response.insert(response.find("\r\n") + 2, "Vary: Accept-Encoding\r\n");
+}
+
+std::string variant_key(const std::string &key, Encoding encoding) {
+  // URLs can't contain spaces
+  return key + " " + encoding_name(encoding);
+}
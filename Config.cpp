@@ -0,0 +1,182 @@
+#include "Config.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include "utils.h"
+
+using namespace boost;
+
+namespace {
+
+struct PendingCluster {
+  std::string name;
+  LbPolicy policy = LbPolicy::ROUND_ROBIN;
+  std::vector<asio::ip::tcp::endpoint> endpoints;
+  std::string health_path;
+  unsigned health_interval_ms = 5000;
+  bool hedge = false;
+};
+
+// Published snapshot, only touched with the shared_ptr atomic functions.
+// `generation` counts publishes so readers know when to fetch it again.
+std::shared_ptr<const Config> published = std::make_shared<Config>();
+std::atomic<uint64_t> generation{0};
+std::mutex publish_mutex;
+
+}  // namespace
+
+Cluster *Config::route(unsigned short port) const {
+  for (const auto &listener : listeners) {
+    if (listener.port == port) {
+      return listener.cluster;
+    }
+  }
+  return nullptr;
+}
+
+Config load_config(const std::string &path) {
+  std::ifstream file{path};
+  if (!file) {
+    throw std::runtime_error{"can't open " + path};
+  }
+  asio::io_context io_context;
+  asio::ip::tcp::resolver resolver{io_context};
+  std::vector<PendingCluster> clusters;
+  std::vector<std::pair<unsigned short, std::string>> listens;
+  Config config;
+
+  std::string line;
+  for (int line_no = 1; std::getline(file, line); ++line_no) {
+    auto error = [&](const std::string &what) {
+      return std::runtime_error{path + ":" + std::to_string(line_no) + ": " +
+                                what};
+    };
+    std::istringstream iss{line.substr(0, line.find('#'))};
+    std::string directive;
+    if (!(iss >> directive)) {
+      continue;
+    }
+    if (directive == "cluster") {
+      PendingCluster cluster;
+      std::string policy;
+      if (!(iss >> cluster.name)) {
+        throw error("cluster needs a name");
+      }
+      if (iss >> policy && !parse_lb_policy(policy, cluster.policy)) {
+        throw error("unknown load balancer " + policy);
+      }
+      clusters.push_back(std::move(cluster));
+    } else if (directive == "endpoint") {
+      std::string host_port;
+      if (clusters.empty() || !(iss >> host_port)) {
+        throw error("endpoint needs HOST:PORT after a cluster");
+      }
+      auto [host, port] = split_host_port(host_port);
+      system::error_code ec;
+      auto results = resolver.resolve(host, port, ec);
+      if (ec || results.empty()) {
+        throw error("can't resolve " + host_port);
+      }
+      clusters.back().endpoints.push_back(results.begin()->endpoint());
+    } else if (directive == "health_check") {
+      if (clusters.empty() || !(iss >> clusters.back().health_path) ||
+          clusters.back().health_path[0] != '/') {
+        throw error("health_check needs a /path after a cluster");
+      }
+      unsigned interval = 0;
+      if (iss >> interval) {
+        if (!interval) {
+          throw error("health_check interval must be positive");
+        }
+        clusters.back().health_interval_ms = interval;
+      }
+    } else if (directive == "hedge") {
+      if (clusters.empty()) {
+        throw error("hedge needs a cluster");
+      }
+      clusters.back().hedge = true;
+    } else if (directive == "listen") {
+      unsigned port = 0;
+      std::string cluster;
+      if (!(iss >> port) || !port || port > 65535) {
+        throw error("listen needs a port");
+      }
+      iss >> cluster;
+      listens.emplace_back(port, cluster);
+    } else if (directive == "timeout") {
+      unsigned seconds = 0;
+      if (!(iss >> seconds) || !seconds) {
+        throw error("timeout needs a number of seconds");
+      }
+      config.timeout = std::chrono::seconds{seconds};
+    } else if (directive == "threads") {
+      if (!(iss >> config.threads) || !config.threads) {
+        throw error("threads needs a number of threads");
+      }
+    } else if (directive == "cache") {
+      size_t megabytes = 0;
+      if (!(iss >> megabytes)) {
+        throw error("cache needs a size in MB");
+      }
+      config.cache_bytes = megabytes << 20;
+    } else if (directive == "upstream_connections") {
+      if (!(iss >> config.upstream_connections) ||
+          !config.upstream_connections) {
+        throw error("upstream_connections needs a number of connections");
+      }
+    } else {
+      throw error("unknown directive " + directive);
+    }
+  }
+
+  for (auto &cluster : clusters) {
+    if (cluster.endpoints.empty()) {
+      throw std::runtime_error{path + ": cluster " + cluster.name +
+                               " has no endpoints"};
+    }
+    config.clusters.push_back(std::make_unique<Cluster>(
+        cluster.name, cluster.policy, std::move(cluster.endpoints)));
+    if (!cluster.health_path.empty()) {
+      config.clusters.back()->set_health_check(
+          cluster.health_path,
+          std::chrono::milliseconds{cluster.health_interval_ms});
+    }
+    config.clusters.back()->set_hedging(cluster.hedge);
+  }
+  for (const auto &[port, name] : listens) {
+    Cluster *target = nullptr;
+    if (!name.empty()) {
+      for (const auto &cluster : config.clusters) {
+        if (cluster->name() == name) {
+          target = cluster.get();
+        }
+      }
+      if (!target) {
+        throw std::runtime_error{path + ": no cluster named " + name};
+      }
+    }
+    config.listeners.push_back({port, target});
+  }
+  return config;
+}
+
+std::shared_ptr<const Config> current_config() {
+  thread_local uint64_t seen = 0;
+  thread_local std::shared_ptr<const Config> snapshot;
+  uint64_t latest = generation.load(std::memory_order_acquire);
+  if (!snapshot || seen != latest) {
+    snapshot = std::atomic_load(&published);
+    seen = latest;
+  }
+  return snapshot;
+}
+
+void publish_config(std::shared_ptr<const Config> config) {
+  std::lock_guard<std::mutex> lock{publish_mutex};
+  std::atomic_store(&published, std::move(config));
+  generation.fetch_add(1, std::memory_order_release);
+}
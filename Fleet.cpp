@@ -0,0 +1,86 @@
+#include "Fleet.h"
+
+#include <vector>
+
+#include "utils.h"
+
+namespace {
+
+std::vector<std::string> peers;
+std::string self_name;
+size_t self_index = 0;
+
+// FNV-1a, stable across builds unlike std::hash, every node has to agree
+uint64_t fnv1a(std::string_view data) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void locate_self() {
+  for (size_t i = 0; i < peers.size(); ++i) {
+    if (peers[i] == self_name) {
+      self_index = i;
+      return;
+    }
+  }
+  self_index = peers.size();
+}
+
+}  // namespace
+
+int32_t jump_hash(uint64_t key, int32_t buckets) {
+  int64_t b = -1;
+  int64_t j = 0;
+  while (j < buckets) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = static_cast<int64_t>((b + 1) * (double(1LL << 31) /
+                                        double((key >> 33) + 1)));
+  }
+  return static_cast<int32_t>(b);
+}
+
+void Fleet::add_peer(const std::string &host_port) {
+  peers.push_back(host_port);
+  locate_self();
+}
+
+void Fleet::set_self(const std::string &host_port) {
+  self_name = host_port;
+  locate_self();
+}
+
+bool Fleet::enabled() {
+  return peers.size() > 1 && self_index < peers.size();
+}
+
+const std::string *Fleet::owner(std::string_view url) {
+  if (!enabled()) {
+    return nullptr;
+  }
+  size_t owner = jump_hash(fnv1a(url), static_cast<int32_t>(peers.size()));
+  return owner == self_index ? nullptr : &peers[owner];
+}
+
+void Fleet::mark_hop(std::string &request) {
+  request.insert(request.find("\r\n") + 2,
+                 std::string{HOP_HEADER} + ": 1\r\n");
+}
+
+bool Fleet::take_hop(std::string &request) {
+  std::string header = request.substr(0, request.find("\r\n\r\n") + 2);
+  to_lowercase(header);
+  std::string name = HOP_HEADER;
+  to_lowercase(name);
+  size_t line = header.find("\r\n" + name + ":");
+  if (line == std::string::npos) {
+    return false;
+  }
+  line += 2;
+  request.erase(line, header.find("\r\n", line) + 2 - line);
+  return true;
+}
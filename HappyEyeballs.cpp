@@ -0,0 +1,110 @@
+#include "HappyEyeballs.h"
+
+using namespace boost;
+
+HappyEyeballs::HappyEyeballs(const asio::any_io_executor &executor)
+    : executor{executor}, timer{executor} {}
+
+std::vector<asio::ip::tcp::endpoint> HappyEyeballs::interleave(
+    const asio::ip::tcp::resolver::results_type &endpoints) {
+  std::vector<asio::ip::tcp::endpoint> first_family, other_family;
+  for (const auto &entry : endpoints) {
+    auto endpoint = entry.endpoint();
+    if (first_family.empty() ||
+        endpoint.protocol() == first_family.front().protocol()) {
+      first_family.push_back(endpoint);
+    } else {
+      other_family.push_back(endpoint);
+    }
+  }
+  std::vector<asio::ip::tcp::endpoint> result;
+  for (size_t i = 0; i < std::max(first_family.size(), other_family.size());
+       ++i) {
+    if (i < first_family.size()) {
+      result.push_back(first_family[i]);
+    }
+    if (i < other_family.size()) {
+      result.push_back(other_family[i]);
+    }
+  }
+  return result;
+}
+
+void HappyEyeballs::start(
+    const asio::ip::tcp::resolver::results_type &endpoints, Handler handler) {
+  start(interleave(endpoints), std::move(handler));
+}
+
+void HappyEyeballs::start(std::vector<asio::ip::tcp::endpoint> endpoints,
+                          Handler handler) {
+  this->endpoints = std::move(endpoints);
+  this->handler = std::move(handler);
+  if (this->endpoints.empty()) {
+    finish(asio::error::host_not_found, asio::ip::tcp::socket{executor});
+    return;
+  }
+  start_next();
+}
+
+void HappyEyeballs::cancel() {
+  finish(asio::error::operation_aborted, asio::ip::tcp::socket{executor});
+}
+
+void HappyEyeballs::start_next() {
+  if (!handler || attempts.size() == endpoints.size()) {
+    return;
+  }
+  auto self(shared_from_this());
+  size_t attempt = attempts.size();
+  attempts.push_back(std::make_unique<asio::ip::tcp::socket>(executor));
+  attempts[attempt]->async_connect(
+      endpoints[attempt], [self, this, attempt](const system::error_code &ec) {
+        on_attempt(attempt, ec);
+      });
+  if (attempts.size() < endpoints.size()) {
+    timer.expires_after(ATTEMPT_DELAY);
+    timer.async_wait([self, this](const system::error_code &ec) {
+      if (!ec) {
+        start_next();
+      }
+    });
+  }
+}
+
+void HappyEyeballs::on_attempt(size_t attempt, const system::error_code &ec) {
+  if (!handler) {
+    return;
+  }
+  if (!ec) {
+    finish(ec, std::move(*attempts[attempt]));
+    return;
+  }
+  last_error = ec;
+  ++failed;
+  if (failed == endpoints.size()) {
+    finish(last_error, asio::ip::tcp::socket{executor});
+    return;
+  }
+  // Don't wait out the delay when the attempt in flight already failed
+  if (failed == attempts.size()) {
+    timer.cancel();
+    start_next();
+  }
+}
+
+void HappyEyeballs::finish(const system::error_code &ec,
+                           asio::ip::tcp::socket &&socket) {
+  if (!handler) {
+    return;
+  }
+  // Take the winner out before the losers get closed
+  asio::ip::tcp::socket winner{std::move(socket)};
+  auto callback = std::move(handler);
+  handler = nullptr;
+  timer.cancel();
+  for (auto &attempt : attempts) {
+    system::error_code ignored;
+    attempt->close(ignored);
+  }
+  callback(ec, std::move(winner));
+}
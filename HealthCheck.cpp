@@ -0,0 +1,116 @@
+#include "HealthCheck.h"
+
+#include <cstdlib>
+#include <sstream>
+
+using namespace boost;
+
+namespace {
+
+// One probe's connection, reports exactly once
+struct Probe : std::enable_shared_from_this<Probe> {
+  Probe(const asio::any_io_executor &strand, Cluster &cluster, size_t i,
+        std::shared_ptr<const Config> config)
+      : socket{strand},
+        timer{strand},
+        cluster{cluster},
+        i{i},
+        config{std::move(config)} {}
+
+  void report(bool healthy) {
+    if (reported) {
+      return;
+    }
+    reported = true;
+    timer.cancel();
+    system::error_code ignored;
+    socket.close(ignored);
+    cluster.record_probe(i, healthy);
+  }
+
+  asio::ip::tcp::socket socket;
+  asio::steady_timer timer;
+  Cluster &cluster;
+  size_t i;
+  // keeps `cluster` alive until the probe reports
+  std::shared_ptr<const Config> config;
+  std::string request;
+  std::string in;
+  bool reported = false;
+};
+
+}  // namespace
+
+HealthChecker::HealthChecker(asio::io_context &io_context, Cluster &cluster,
+                             std::weak_ptr<const Config> config)
+    : strand{asio::make_strand(io_context)},
+      timer{strand},
+      cluster{cluster},
+      config{std::move(config)} {}
+
+void HealthChecker::start() {
+  asio::post(strand, [self = shared_from_this()] { self->sweep(); });
+}
+
+void HealthChecker::sweep() {
+  auto owner = config.lock();
+  if (!owner) {
+    // reloaded and no connection uses the old cluster anymore
+    return;
+  }
+  cluster.detect_latency_outliers();
+  cluster.refresh_hedge_delay();
+  auto interval = OUTLIER_INTERVAL;
+  if (!cluster.health_path().empty()) {
+    interval = cluster.health_interval();
+    for (size_t i = 0; i < cluster.size(); ++i) {
+      probe(i, owner);
+    }
+  }
+  auto self(shared_from_this());
+  timer.expires_after(interval);
+  timer.async_wait([self, this](const system::error_code &ec) {
+    if (!ec) {
+      sweep();
+    }
+  });
+}
+
+void HealthChecker::probe(size_t i, std::shared_ptr<const Config> owner) {
+  auto probe = std::make_shared<Probe>(strand, cluster, i, std::move(owner));
+  const auto &endpoint = cluster.endpoint(i);
+  std::ostringstream host;
+  host << endpoint;
+  probe->request = "GET " + cluster.health_path() + " HTTP/1.1\r\nHost: " +
+                   host.str() + "\r\nConnection: close\r\n\r\n";
+  probe->timer.expires_after(PROBE_TIMEOUT);
+  probe->timer.async_wait([probe](const system::error_code &ec) {
+    if (!ec) {
+      probe->report(false);
+    }
+  });
+  probe->socket.async_connect(endpoint, [probe](const system::error_code &ec) {
+    if (ec) {
+      probe->report(false);
+      return;
+    }
+    asio::async_write(
+        probe->socket, asio::buffer(probe->request),
+        [probe](const system::error_code &ec, size_t) {
+          if (ec) {
+            probe->report(false);
+            return;
+          }
+          asio::async_read_until(
+              probe->socket, asio::dynamic_buffer(probe->in), "\r\n",
+              [probe](const system::error_code &ec, size_t) {
+                // "HTTP/1.1 200 OK"
+                size_t space = probe->in.find(' ');
+                int status = ec || space == std::string::npos
+                                 ? 0
+                                 : std::atoi(probe->in.c_str() + space + 1);
+                probe->report(status / 100 == 2);
+              });
+        });
+  });
+}
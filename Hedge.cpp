@@ -0,0 +1,122 @@
+#include "Hedge.h"
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "utils.h"
+
+using namespace boost;
+
+Hedge::Hedge(const asio::any_io_executor &executor,
+             asio::cancellation_slot slot)
+    : socket{executor}, slot{slot} {}
+
+void Hedge::start(const asio::ip::tcp::endpoint &endpoint,
+                  std::string request, bool head, Callback callback) {
+  this->request = std::move(request);
+  this->head = head;
+  this->callback = std::move(callback);
+  auto self(shared_from_this());
+  socket.async_connect(
+      endpoint, asio::bind_cancellation_slot(
+                    slot, [self, this](const system::error_code &ec) {
+                      if (ec) {
+                        finish(ec);
+                        return;
+                      }
+                      asio::async_write(
+                          socket, asio::buffer(this->request),
+                          asio::bind_cancellation_slot(
+                              slot, [self, this](const system::error_code &ec,
+                                                 size_t) {
+                                if (ec) {
+                                  finish(ec);
+                                } else {
+                                  read_header();
+                                }
+                              }));
+                    }));
+}
+
+void Hedge::read_header() {
+  auto self(shared_from_this());
+  asio::async_read_until(
+      socket, asio::dynamic_buffer(in), "\r\n\r\n",
+      asio::bind_cancellation_slot(
+          slot, [self, this](const system::error_code &ec, size_t header_len) {
+            if (ec) {
+              finish(ec);
+              return;
+            }
+            // "HTTP/1.1 200 OK"
+            int status = std::atoi(in.c_str() + in.find(' ') + 1);
+            if (status / 100 == 1 && status != 101) {
+              // interim response, the final one follows
+              in.erase(0, header_len);
+              read_header();
+              return;
+            }
+            read_body(header_len, status);
+          }));
+}
+
+void Hedge::read_body(size_t header_len, int status) {
+  size_t message_len = header_len;
+  Body body = head || status == 204 || status == 304
+                  ? Body::NONE
+                  : identify_body(in.substr(0, header_len));
+  if (body == Body::INVALID) {
+    finish(asio::error::invalid_argument);
+    return;
+  }
+  if (body == Body::CONTENT_LENGTH) {
+    size_t body_len = 0;
+    content_length(in.substr(0, header_len), body_len);
+    if (body_len > SIZE_MAX - header_len) {
+      finish(asio::error::invalid_argument);
+      return;
+    }
+    message_len += body_len;
+  } else if (body == Body::CHUNKED) {
+    size_t pos = header_len;
+    Chunks walk = skip_chunks(in, pos);
+    if (walk == Chunks::MALFORMED) {
+      finish(asio::error::invalid_argument);
+      return;
+    }
+    if (walk == Chunks::COMPLETE) {
+      message_len = pos;
+    } else {
+      // no telling how much is missing, read whatever comes next
+      message_len = in.size() + 1;
+    }
+  }
+  if (in.size() >= message_len) {
+    in.resize(message_len);
+    finish({});
+    return;
+  }
+  auto self(shared_from_this());
+  asio::async_read(
+      socket, asio::dynamic_buffer(in),
+      asio::transfer_at_least(message_len - in.size()),
+      asio::bind_cancellation_slot(
+          slot, [self, this, header_len, status](const system::error_code &ec,
+                                                 size_t) {
+            if (ec) {
+              finish(ec);
+            } else {
+              read_body(header_len, status);
+            }
+          }));
+}
+
+void Hedge::finish(const system::error_code &ec) {
+  system::error_code ignored;
+  socket.close(ignored);
+  if (callback) {
+    auto done = std::move(callback);
+    callback = nullptr;
+    done(ec, ec ? std::string{} : std::move(in));
+  }
+}
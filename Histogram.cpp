@@ -0,0 +1,113 @@
+#include "Histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Only the owning thread writes, so a relaxed load + store is enough and
+// avoids paying for a locked instruction on every sample.
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t by) {
+  counter.store(counter.load(std::memory_order_relaxed) + by,
+                std::memory_order_relaxed);
+}
+
+Histogram::Histogram(const Histogram &other) { merge(other); }
+
+Histogram &Histogram::operator=(const Histogram &other) {
+  if (this != &other) {
+    reset();
+    merge(other);
+  }
+  return *this;
+}
+
+size_t Histogram::bucket_index(uint64_t value) {
+  constexpr uint64_t sub_buckets = uint64_t{1} << SUB_BUCKET_BITS;
+  if (value < sub_buckets) {
+    return value;
+  }
+  unsigned exponent = 63 - __builtin_clzll(value);
+  unsigned shift = exponent - SUB_BUCKET_BITS + 1;
+  // (value >> shift) lands in [sub_buckets / 2, sub_buckets), so every
+  // magnitude adds sub_buckets / 2 new buckets right after the previous one
+  return shift * (sub_buckets / 2) + (value >> shift);
+}
+
+uint64_t Histogram::bucket_upper_bound(size_t index) {
+  constexpr uint64_t sub_buckets = uint64_t{1} << SUB_BUCKET_BITS;
+  if (index < sub_buckets) {
+    return index;
+  }
+  uint64_t shift = (index - sub_buckets / 2) / (sub_buckets / 2);
+  uint64_t mantissa = index - shift * (sub_buckets / 2);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value) {
+  value = std::min(value, MAX_VALUE);
+  bump(counts[bucket_index(value)], 1);
+  bump(total, 1);
+  bump(total_sum, value);
+  if (value > max_value.load(std::memory_order_relaxed)) {
+    max_value.store(value, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::merge(const Histogram &other) {
+  for (size_t i = 0; i < BUCKETS; ++i) {
+    uint64_t n = other.counts[i].load(std::memory_order_relaxed);
+    if (n) {
+      counts[i].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+  total.fetch_add(other.count(), std::memory_order_relaxed);
+  total_sum.fetch_add(other.sum(), std::memory_order_relaxed);
+  uint64_t other_max = other.max();
+  uint64_t curr_max = max_value.load(std::memory_order_relaxed);
+  while (other_max > curr_max &&
+         !max_value.compare_exchange_weak(curr_max, other_max,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::reset() {
+  for (auto &c : counts) {
+    c.store(0, std::memory_order_relaxed);
+  }
+  total.store(0, std::memory_order_relaxed);
+  total_sum.store(0, std::memory_order_relaxed);
+  max_value.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() const {
+  return total.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum() const {
+  return total_sum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::max() const {
+  return max_value.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(double p) const {
+  // Sum the buckets instead of trusting `total`, a concurrent writer may
+  // have bumped one but not yet the other
+  uint64_t n = 0;
+  for (const auto &c : counts) {
+    n += c.load(std::memory_order_relaxed);
+  }
+  if (!n) {
+    return 0;
+  }
+  p = std::clamp(p, 0.0, 100.0);
+  uint64_t rank = std::max<uint64_t>(1, std::ceil(p / 100.0 * n));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; ++i) {
+    seen += counts[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(bucket_upper_bound(i), max());
+    }
+  }
+  return max();
+}
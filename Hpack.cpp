@@ -0,0 +1,496 @@
+#include "Hpack.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+namespace {
+
+struct StaticEntry {
+  std::string_view name;
+  std::string_view value;
+};
+
+constexpr StaticEntry STATIC_TABLE[HpackTable::STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Code length of every byte value plus EOS. The code is canonical, so the
+// codes themselves follow from the lengths.
+constexpr uint8_t CODE_LENGTHS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+constexpr uint16_t EOS = 256;
+
+// Decodes a nibble at a time with a state machine over the internal nodes of
+// the code tree. The shortest code is 5 bits, so a nibble finishes at most
+// one symbol.
+struct Huffman {
+  enum : uint8_t { EMIT = 1, FAIL = 2 };
+  struct Transition {
+    uint8_t next;
+    uint8_t flags;
+    uint8_t symbol;
+  };
+
+  Huffman();
+
+  uint32_t codes[257];
+  Transition transitions[256][16];
+  // Ending here is fine: the bits since the last symbol are at most 7 ones,
+  // the padding the RFC allows
+  bool accepting[256];
+};
+
+Huffman::Huffman() {
+  uint16_t order[257];
+  std::iota(order, order + 257, 0);
+  std::stable_sort(order, order + 257, [](uint16_t a, uint16_t b) {
+    return CODE_LENGTHS[a] < CODE_LENGTHS[b];
+  });
+  uint32_t code = 0;
+  for (size_t k = 0; k < 257; ++k) {
+    if (k) {
+      code = (code + 1)
+             << (CODE_LENGTHS[order[k]] - CODE_LENGTHS[order[k - 1]]);
+    }
+    codes[order[k]] = code;
+  }
+
+  constexpr uint16_t LEAF = 0x8000;
+  uint16_t children[256][2] = {};
+  uint8_t depth[256] = {};
+  bool all_ones[256] = {true};
+  size_t nodes = 1;
+  for (uint16_t symbol = 0; symbol < 257; ++symbol) {
+    size_t node = 0;
+    for (int bit = CODE_LENGTHS[symbol] - 1; bit > 0; --bit) {
+      int b = (codes[symbol] >> bit) & 1;
+      if (!children[node][b]) {
+        children[node][b] = nodes;
+        depth[nodes] = depth[node] + 1;
+        all_ones[nodes] = all_ones[node] && b;
+        ++nodes;
+      }
+      node = children[node][b];
+    }
+    children[node][codes[symbol] & 1] = LEAF | symbol;
+  }
+
+  for (size_t node = 0; node < 256; ++node) {
+    accepting[node] = all_ones[node] && depth[node] < 8;
+    for (uint8_t nibble = 0; nibble < 16; ++nibble) {
+      Transition &t = transitions[node][nibble];
+      t = {};
+      size_t cur = node;
+      for (int bit = 3; bit >= 0; --bit) {
+        uint16_t child = children[cur][(nibble >> bit) & 1];
+        if (!(child & LEAF)) {
+          cur = child;
+          continue;
+        }
+        if ((child & ~LEAF) == EOS) {
+          t.flags |= FAIL;
+          break;
+        }
+        t.flags |= EMIT;
+        t.symbol = child & ~LEAF;
+        cur = 0;
+      }
+      t.next = cur;
+    }
+  }
+}
+
+const Huffman &huffman() {
+  static const Huffman table;
+  return table;
+}
+
+bool read_int(const uint8_t *&p, const uint8_t *end, int prefix_bits,
+              size_t &value) {
+  if (p == end) {
+    return false;
+  }
+  size_t mask = (1u << prefix_bits) - 1;
+  value = *p++ & mask;
+  if (value < mask) {
+    return true;
+  }
+  for (unsigned shift = 0; p != end && shift <= 28; shift += 7) {
+    uint8_t b = *p++;
+    value += size_t{b & 0x7fu} << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void write_int(std::string &out, uint8_t first, int prefix_bits,
+               size_t value) {
+  size_t mask = (1u << prefix_bits) - 1;
+  if (value < mask) {
+    out += char(first | value);
+    return;
+  }
+  out += char(first | mask);
+  value -= mask;
+  while (value >= 128) {
+    out += char(value % 128 + 128);
+    value /= 128;
+  }
+  out += char(value);
+}
+
+void write_string(std::string &out, std::string_view str) {
+  size_t huffman_len = huffman_encoded_length(str);
+  if (huffman_len < str.size()) {
+    write_int(out, 0x80, 7, huffman_len);
+    huffman_encode(str, out);
+  } else {
+    write_int(out, 0, 7, str.size());
+    out.append(str);
+  }
+}
+
+}  // namespace
+
+size_t huffman_encoded_length(std::string_view in) {
+  size_t bits = 0;
+  for (unsigned char c : in) {
+    bits += CODE_LENGTHS[c];
+  }
+  return (bits + 7) / 8;
+}
+
+void huffman_encode(std::string_view in, std::string &out) {
+  const auto &h = huffman();
+  uint64_t acc = 0;
+  unsigned bits = 0;
+  for (unsigned char c : in) {
+    acc = (acc << CODE_LENGTHS[c]) | h.codes[c];
+    bits += CODE_LENGTHS[c];
+    while (bits >= 8) {
+      bits -= 8;
+      out += char(acc >> bits);
+    }
+  }
+  if (bits) {
+    // pad with the most significant bits of EOS, which are all ones
+    out += char((acc << (8 - bits)) | (0xff >> bits));
+  }
+}
+
+bool huffman_decode(const uint8_t *data, size_t len, std::string &out) {
+  const auto &h = huffman();
+  uint8_t state = 0;
+  for (size_t i = 0; i < len; ++i) {
+    for (uint8_t nibble : {uint8_t(data[i] >> 4), uint8_t(data[i] & 0xf)}) {
+      const auto &t = h.transitions[state][nibble];
+      if (t.flags & Huffman::FAIL) {
+        return false;
+      }
+      if (t.flags & Huffman::EMIT) {
+        out += char(t.symbol);
+      }
+      state = t.next;
+    }
+  }
+  return h.accepting[state];
+}
+
+HpackTable::HpackTable(size_t capacity)
+    : storage(2 * capacity),
+      entries(capacity / ENTRY_OVERHEAD + 1),
+      max{capacity},
+      limit{capacity} {}
+
+const HpackTable::Entry &HpackTable::dynamic(size_t i) const {
+  return entries[(first + count - 1 - i) % entries.size()];
+}
+
+bool HpackTable::get(size_t index, std::string_view &name,
+                     std::string_view &value) const {
+  if (!index) {
+    return false;
+  }
+  if (index <= STATIC_ENTRIES) {
+    name = STATIC_TABLE[index - 1].name;
+    value = STATIC_TABLE[index - 1].value;
+    return true;
+  }
+  if (index - STATIC_ENTRIES > count) {
+    return false;
+  }
+  const Entry &entry = dynamic(index - STATIC_ENTRIES - 1);
+  name = {storage.data() + entry.offset, entry.name_len};
+  value = {storage.data() + entry.offset + entry.name_len, entry.value_len};
+  return true;
+}
+
+void HpackTable::evict_to(size_t target) {
+  while (size > target && count) {
+    const Entry &oldest = entries[first];
+    size -= oldest.name_len + oldest.value_len + ENTRY_OVERHEAD;
+    first = (first + 1) % entries.size();
+    --count;
+  }
+  if (!count) {
+    storage_end = 0;
+  }
+}
+
+void HpackTable::add(std::string_view name, std::string_view value) {
+  size_t entry_size = name.size() + value.size() + ENTRY_OVERHEAD;
+  if (entry_size > max) {
+    // not an error, it just empties the table
+    evict_to(0);
+    return;
+  }
+  evict_to(max - entry_size);
+  size_t len = name.size() + value.size();
+  if (storage_end + len > storage.size()) {
+    // Live bytes never exceed `max`, so half the storage is free afterwards
+    size_t live_begin = count ? entries[first].offset : storage_end;
+    memmove(storage.data(), storage.data() + live_begin,
+            storage_end - live_begin);
+    for (size_t i = 0; i < count; ++i) {
+      entries[(first + i) % entries.size()].offset -= live_begin;
+    }
+    storage_end -= live_begin;
+  }
+  memcpy(storage.data() + storage_end, name.data(), name.size());
+  memcpy(storage.data() + storage_end + name.size(), value.data(),
+         value.size());
+  entries[(first + count) % entries.size()] = {
+      storage_end, uint32_t(name.size()), uint32_t(value.size())};
+  storage_end += len;
+  ++count;
+  size += entry_size;
+}
+
+void HpackTable::set_max_size(size_t size) {
+  max = std::min(size, limit);
+  evict_to(max);
+}
+
+size_t HpackTable::find(std::string_view name, std::string_view value,
+                        bool &name_only) const {
+  size_t name_match = 0;
+  for (size_t i = 0; i < STATIC_ENTRIES; ++i) {
+    if (STATIC_TABLE[i].name == name) {
+      if (STATIC_TABLE[i].value == value) {
+        name_only = false;
+        return i + 1;
+      }
+      if (!name_match) {
+        name_match = i + 1;
+      }
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    const Entry &entry = dynamic(i);
+    if (std::string_view{storage.data() + entry.offset, entry.name_len} !=
+        name) {
+      continue;
+    }
+    if (std::string_view{storage.data() + entry.offset + entry.name_len,
+                         entry.value_len} == value) {
+      name_only = false;
+      return STATIC_ENTRIES + 1 + i;
+    }
+    if (!name_match) {
+      name_match = STATIC_ENTRIES + 1 + i;
+    }
+  }
+  name_only = true;
+  return name_match;
+}
+
+HpackDecoder::HpackDecoder(size_t max_table_size) : table{max_table_size} {}
+
+bool HpackDecoder::read_string(const uint8_t *&p, const uint8_t *end,
+                               std::string &scratch, std::string_view &out) {
+  if (p == end) {
+    return false;
+  }
+  bool huffman_coded = *p & 0x80;
+  size_t len;
+  if (!read_int(p, end, 7, len) || len > size_t(end - p)) {
+    return false;
+  }
+  if (huffman_coded) {
+    scratch.clear();
+    if (!huffman_decode(p, len, scratch)) {
+      return false;
+    }
+    out = scratch;
+  } else {
+    out = {reinterpret_cast<const char *>(p), len};
+  }
+  p += len;
+  return true;
+}
+
+bool HpackDecoder::decode(const uint8_t *data, size_t len, const Emit &emit) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  while (p < end) {
+    uint8_t first = *p;
+    size_t index;
+    std::string_view name, value;
+    if (first & 0x80) {
+      if (!read_int(p, end, 7, index) || !table.get(index, name, value)) {
+        return false;
+      }
+      emit(name, value);
+      continue;
+    }
+    if ((first & 0xe0) == 0x20) {
+      if (!read_int(p, end, 5, index) || index > table.capacity()) {
+        return false;
+      }
+      table.set_max_size(index);
+      continue;
+    }
+    // literal, with incremental indexing, without indexing or never indexed
+    bool indexing = first & 0x40;
+    if (!read_int(p, end, indexing ? 6 : 4, index)) {
+      return false;
+    }
+    if (index) {
+      std::string_view ignored;
+      if (!table.get(index, name, ignored)) {
+        return false;
+      }
+      // adding the entry may evict the one the name points into
+      if (indexing) {
+        name_scratch.assign(name);
+        name = name_scratch;
+      }
+    } else if (!read_string(p, end, name_scratch, name)) {
+      return false;
+    }
+    if (!read_string(p, end, value_scratch, value)) {
+      return false;
+    }
+    if (indexing) {
+      table.add(name, value);
+    }
+    emit(name, value);
+  }
+  return true;
+}
+
+void HpackEncoder::set_max_table_size(size_t size) {
+  table.set_max_size(size);
+  size_update_pending = true;
+}
+
+void HpackEncoder::encode(std::string_view name, std::string_view value,
+                          std::string &out) {
+  if (size_update_pending) {
+    write_int(out, 0x20, 5, table.max_size());
+    size_update_pending = false;
+  }
+  bool name_only;
+  size_t index = table.find(name, value, name_only);
+  if (index && !name_only) {
+    write_int(out, 0x80, 7, index);
+    return;
+  }
+  // Credentials are never indexed, and values that change on every request
+  // would only push useful entries out of the table
+  bool sensitive = name == "authorization" || name == "proxy-authorization";
+  bool indexing = !sensitive && name != ":path" && name != "content-length" &&
+                  name != "date" && name != "etag" && name != "last-modified";
+  if (indexing) {
+    write_int(out, 0x40, 6, index);
+  } else {
+    write_int(out, sensitive ? 0x10 : 0x00, 4, index);
+  }
+  if (!index) {
+    write_string(out, name);
+  }
+  write_string(out, value);
+  if (indexing) {
+    table.add(name, value);
+  }
+}
@@ -0,0 +1,316 @@
+#include "Http2.h"
+
+#include <algorithm>
+#include <functional>
+#include <sstream>
+
+#include "utils.h"
+
+FrameHeader parse_frame_header(const uint8_t *p) {
+  return {uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2],
+          static_cast<FrameType>(p[3]), p[4], read_u32(p + 5) & MAX_STREAM_ID};
+}
+
+uint32_t read_u32(const uint8_t *p) {
+  return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 |
+         p[3];
+}
+
+static void append_u32(std::string &out, uint32_t value) {
+  out += char(value >> 24);
+  out += char(value >> 16);
+  out += char(value >> 8);
+  out += char(value);
+}
+
+void append_frame_header(std::string &out, uint32_t length, FrameType type,
+                         uint8_t flags, uint32_t stream_id) {
+  out += char(length >> 16);
+  out += char(length >> 8);
+  out += char(length);
+  out += char(type);
+  out += char(flags);
+  append_u32(out, stream_id);
+}
+
+void append_settings(
+    std::string &out,
+    std::initializer_list<std::pair<Setting, uint32_t>> settings) {
+  append_frame_header(out, settings.size() * 6, FrameType::SETTINGS, 0, 0);
+  for (const auto &[id, value] : settings) {
+    out += char(uint16_t(id) >> 8);
+    out += char(uint16_t(id));
+    append_u32(out, value);
+  }
+}
+
+void append_window_update(std::string &out, uint32_t stream_id,
+                          uint32_t increment) {
+  append_frame_header(out, 4, FrameType::WINDOW_UPDATE, 0, stream_id);
+  append_u32(out, increment);
+}
+
+void append_rst_stream(std::string &out, uint32_t stream_id, H2Error error) {
+  append_frame_header(out, 4, FrameType::RST_STREAM, 0, stream_id);
+  append_u32(out, uint32_t(error));
+}
+
+void append_goaway(std::string &out, uint32_t last_stream_id, H2Error error) {
+  append_frame_header(out, 8, FrameType::GOAWAY, 0, 0);
+  append_u32(out, last_stream_id);
+  append_u32(out, uint32_t(error));
+}
+
+void append_headers(std::string &out, uint32_t stream_id,
+                    const std::string &block, bool end_stream,
+                    uint32_t max_frame_size) {
+  size_t pos = 0;
+  FrameType type = FrameType::HEADERS;
+  do {
+    size_t len = std::min<size_t>(block.size() - pos, max_frame_size);
+    uint8_t flags = pos + len == block.size() ? FLAG_END_HEADERS : 0;
+    if (type == FrameType::HEADERS && end_stream) {
+      flags |= FLAG_END_STREAM;
+    }
+    append_frame_header(out, len, type, flags, stream_id);
+    out.append(block, pos, len);
+    pos += len;
+    type = FrameType::CONTINUATION;
+  } while (pos < block.size());
+}
+
+void append_data(std::string &out, uint32_t stream_id, std::string_view data,
+                 bool end_stream, uint32_t max_frame_size) {
+  size_t pos = 0;
+  do {
+    size_t len = std::min<size_t>(data.size() - pos, max_frame_size);
+    bool last = pos + len == data.size();
+    append_frame_header(out, len, FrameType::DATA,
+                        last && end_stream ? FLAG_END_STREAM : 0, stream_id);
+    out.append(data.substr(pos, len));
+    pos += len;
+  } while (pos < data.size());
+}
+
+H2Error check_setting(Setting id, uint32_t value) {
+  switch (id) {
+    case Setting::ENABLE_PUSH:
+      return value > 1 ? H2Error::PROTOCOL_ERROR : H2Error::NO_ERROR;
+    case Setting::INITIAL_WINDOW_SIZE:
+      return value > MAX_WINDOW ? H2Error::FLOW_CONTROL_ERROR
+                                : H2Error::NO_ERROR;
+    case Setting::MAX_FRAME_SIZE:
+      // anything smaller would never let a frame make progress
+      return value < DEFAULT_MAX_FRAME_SIZE || value > MAX_FRAME_SIZE_LIMIT
+                 ? H2Error::PROTOCOL_ERROR
+                 : H2Error::NO_ERROR;
+    default:
+      return H2Error::NO_ERROR;
+  }
+}
+
+bool strip_padding(const FrameHeader &header, const uint8_t *&payload,
+                   size_t &len) {
+  size_t padding = 0;
+  if (header.flags & FLAG_PADDED) {
+    if (!len) {
+      return false;
+    }
+    padding = payload[0];
+    ++payload;
+    --len;
+  }
+  if (header.type == FrameType::HEADERS && header.flags & FLAG_PRIORITY) {
+    // stream dependency and weight
+    if (len < 5) {
+      return false;
+    }
+    payload += 5;
+    len -= 5;
+  }
+  if (padding > len) {
+    return false;
+  }
+  len -= padding;
+  return true;
+}
+
+// Fields that only mean something for one HTTP/1.1 connection
+static bool connection_specific(const std::string &name) {
+  return name == "connection" || name == "keep-alive" ||
+         name == "proxy-connection" || name == "transfer-encoding" ||
+         name == "upgrade" || name == "host";
+}
+
+// Calls `field` with the lowercased name and trimmed value of every header
+// line after the start line
+static void for_each_field(
+    const std::string &header,
+    const std::function<void(const std::string &, std::string_view)> &field) {
+  size_t header_end = header.find("\r\n\r\n");
+  size_t line_beg = header.find("\r\n") + 2;
+  while (line_beg < header_end) {
+    size_t line_end = header.find("\r\n", line_beg);
+    size_t colon = header.find(':', line_beg);
+    if (colon < line_end) {
+      std::string name = header.substr(line_beg, colon - line_beg);
+      to_lowercase(name);
+      size_t value_beg = header.find_first_not_of(" \t", colon + 1);
+      size_t value_end = header.find_last_not_of(" \t", line_end - 1);
+      std::string_view value;
+      if (value_beg < line_end) {
+        value = std::string_view{header}.substr(value_beg,
+                                                value_end - value_beg + 1);
+      }
+      field(name, value);
+    }
+    line_beg = line_end + 2;
+  }
+}
+
+bool encode_request(const std::string &request, HpackEncoder &encoder,
+                    std::string &block, std::string &body, bool &head) {
+  auto header_end = request.find("\r\n\r\n");
+  if (header_end == std::string::npos) {
+    return false;
+  }
+  const std::string header = request.substr(0, header_end + 4);
+  std::istringstream iss{header.substr(0, header.find("\r\n"))};
+  std::string method, url;
+  iss >> method >> url;
+  if (method.empty() || url.empty() || method == "CONNECT") {
+    return false;
+  }
+  head = method == "HEAD";
+
+  // absolute-form "http://host:port/path" or origin-form "/path"
+  std::string authority = parse_field(header, "host");
+  std::string path = url;
+  auto scheme_end = url.find("://");
+  if (scheme_end != std::string::npos) {
+    auto path_beg = url.find('/', scheme_end + 3);
+    if (authority.empty()) {
+      authority = url.substr(scheme_end + 3, path_beg - scheme_end - 3);
+    }
+    path = path_beg == std::string::npos ? "/" : url.substr(path_beg);
+  }
+  encoder.encode(":method", method, block);
+  encoder.encode(":scheme", "http", block);
+  encoder.encode(":authority", authority, block);
+  encoder.encode(":path", path, block);
+
+  // Fields named in Connection are hop-by-hop as well
+  std::string connection = "," + parse_field(header, "connection") + ",";
+  to_lowercase(connection);
+  connection.erase(std::remove_if(connection.begin(), connection.end(),
+                                  [](char c) { return c == ' ' || c == '\t'; }),
+                   connection.end());
+  for_each_field(header, [&](const std::string &name, std::string_view value) {
+    bool listed = connection.find("," + name + ",") != std::string::npos;
+    bool te = name == "te" && value != "trailers";
+    if (!connection_specific(name) && !listed && !te) {
+      encoder.encode(name, value, block);
+    }
+  });
+
+  Body body_type = identify_body(header);
+  if (body_type == Body::CONTENT_LENGTH) {
+    body = request.substr(header_end + 4);
+  } else if (body_type == Body::CHUNKED) {
+    body = unchunk(request, header_end + 4);
+    encoder.encode("content-length", std::to_string(body.size()), block);
+  }
+  return true;
+}
+
+bool encode_response(const std::string &response, HpackEncoder &encoder,
+                     std::string &block, std::string &body) {
+  size_t start = 0;
+  size_t header_end;
+  size_t space;
+  std::string header;
+  do {
+    header_end = response.find("\r\n\r\n", start);
+    if (header_end == std::string::npos) {
+      return false;
+    }
+    header = response.substr(start, header_end + 4 - start);
+    start = header_end + 4;
+    // "HTTP/1.1 200 OK"
+    space = header.find(' ');
+    if (space == std::string::npos || space + 4 > header.size()) {
+      return false;
+    }
+    // interim (1xx) responses the origin sent first aren't passed on
+  } while (header[space + 1] == '1');
+  encoder.encode(":status", header.substr(space + 1, 3), block);
+  for_each_field(header, [&](const std::string &name, std::string_view value) {
+    if (!connection_specific(name)) {
+      encoder.encode(name, value, block);
+    }
+  });
+  if (identify_body(header) == Body::CHUNKED) {
+    body = unchunk(response, header_end + 4);
+    encoder.encode("content-length", std::to_string(body.size()), block);
+  } else {
+    body = response.substr(header_end + 4);
+  }
+  return true;
+}
+
+const char *reason_phrase(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 202:
+      return "Accepted";
+    case 204:
+      return "No Content";
+    case 206:
+      return "Partial Content";
+    case 301:
+      return "Moved Permanently";
+    case 302:
+      return "Found";
+    case 303:
+      return "See Other";
+    case 304:
+      return "Not Modified";
+    case 307:
+      return "Temporary Redirect";
+    case 308:
+      return "Permanent Redirect";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 408:
+      return "Request Timeout";
+    case 409:
+      return "Conflict";
+    case 413:
+      return "Content Too Large";
+    case 429:
+      return "Too Many Requests";
+    case 500:
+      return "Internal Server Error";
+    case 501:
+      return "Not Implemented";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
+    case 504:
+      return "Gateway Timeout";
+    default:
+      return "";
+  }
+}
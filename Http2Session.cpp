@@ -0,0 +1,391 @@
+#include "Http2Session.h"
+
+#include <algorithm>
+
+Http2Session::Http2Session(RequestHandler on_request)
+    : on_request{std::move(on_request)} {
+  append_settings(out, {{Setting::MAX_CONCURRENT_STREAMS, MAX_STREAMS},
+                        {Setting::INITIAL_WINDOW_SIZE, WINDOW},
+                        {Setting::MAX_HEADER_LIST_SIZE, MAX_HEADER_LIST}});
+  append_window_update(out, 0, CONNECTION_WINDOW - DEFAULT_WINDOW);
+}
+
+bool Http2Session::receive(std::string &in) {
+  size_t pos = 0;
+  if (!preface_received) {
+    size_t len = std::min(in.size(), CONNECTION_PREFACE.size());
+    if (in.compare(0, len, CONNECTION_PREFACE.substr(0, len))) {
+      return connection_error(H2Error::PROTOCOL_ERROR);
+    }
+    if (len < CONNECTION_PREFACE.size()) {
+      return true;
+    }
+    preface_received = true;
+    pos = len;
+  }
+  const auto *data = reinterpret_cast<const uint8_t *>(in.data());
+  while (in.size() - pos >= FRAME_HEADER_SIZE) {
+    FrameHeader header = parse_frame_header(data + pos);
+    if (header.length > DEFAULT_MAX_FRAME_SIZE) {
+      return connection_error(H2Error::FRAME_SIZE_ERROR);
+    }
+    if (in.size() - pos < FRAME_HEADER_SIZE + header.length) {
+      break;
+    }
+    if (!handle_frame(header, data + pos + FRAME_HEADER_SIZE)) {
+      return connection_error(failure);
+    }
+    pos += FRAME_HEADER_SIZE + header.length;
+  }
+  in.erase(0, pos);
+  send_data();
+  return true;
+}
+
+bool Http2Session::handle_frame(const FrameHeader &header,
+                                const uint8_t *payload) {
+  size_t len = header.length;
+  if (header_block_stream && header.type != FrameType::CONTINUATION) {
+    return false;
+  }
+  switch (header.type) {
+    case FrameType::DATA: {
+      if (!header.stream_id || !strip_padding(header, payload, len)) {
+        return false;
+      }
+      if (header.length > recv_window) {
+        return fail(H2Error::FLOW_CONTROL_ERROR);
+      }
+      recv_window -= header.length;
+      auto it = streams.find(header.stream_id);
+      if (it == streams.end() || it->second.request_done) {
+        release(header.length);
+        return true;
+      }
+      auto &stream = it->second;
+      if (header.length > stream.recv_window) {
+        return fail(H2Error::FLOW_CONTROL_ERROR);
+      }
+      stream.recv_window -= header.length;
+      // the padding isn't kept
+      release(header.length - len);
+      stream.body.append(reinterpret_cast<const char *>(payload), len);
+      bool end_stream = header.flags & FLAG_END_STREAM;
+      if (stream.body.size() > MAX_REQUEST_BODY ||
+          (!recv_window && !end_stream)) {
+        reset_stream(it, H2Error::CANCEL);
+        return true;
+      }
+      if (end_stream) {
+        finish_request(header.stream_id, stream);
+        return true;
+      }
+      stream.recv_unacked += header.length;
+      if (stream.recv_unacked >= WINDOW / 2) {
+        append_window_update(out, header.stream_id, stream.recv_unacked);
+        stream.recv_window += stream.recv_unacked;
+        stream.recv_unacked = 0;
+      }
+      return true;
+    }
+    case FrameType::HEADERS:
+      // client streams are odd
+      if (!(header.stream_id & 1) || !strip_padding(header, payload, len)) {
+        return false;
+      }
+      header_block.assign(reinterpret_cast<const char *>(payload), len);
+      header_block_end_stream = header.flags & FLAG_END_STREAM;
+      if (header.flags & FLAG_END_HEADERS) {
+        return finish_header_block(header.stream_id, header_block_end_stream);
+      }
+      header_block_stream = header.stream_id;
+      return true;
+    case FrameType::CONTINUATION:
+      if (header.stream_id != header_block_stream) {
+        return false;
+      }
+      if (header_block.size() + len > MAX_HEADER_LIST) {
+        // CONTINUATIONs that never end would pile up forever
+        return fail(H2Error::ENHANCE_YOUR_CALM);
+      }
+      header_block.append(reinterpret_cast<const char *>(payload), len);
+      if (header.flags & FLAG_END_HEADERS) {
+        header_block_stream = 0;
+        return finish_header_block(header.stream_id, header_block_end_stream);
+      }
+      return true;
+    case FrameType::RST_STREAM:
+      if (len != 4) {
+        return false;
+      }
+      if (auto it = streams.find(header.stream_id); it != streams.end()) {
+        release(it->second.body.size());
+        streams.erase(it);
+      }
+      return true;
+    case FrameType::SETTINGS:
+      if (header.flags & FLAG_ACK) {
+        return true;
+      }
+      if (len % 6) {
+        return false;
+      }
+      for (size_t i = 0; i < len; i += 6) {
+        auto id = static_cast<Setting>(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = read_u32(payload + i + 2);
+        if (H2Error error = check_setting(id, value);
+            error != H2Error::NO_ERROR) {
+          return fail(error);
+        }
+        if (id == Setting::HEADER_TABLE_SIZE) {
+          encoder.set_max_table_size(value);
+        } else if (id == Setting::INITIAL_WINDOW_SIZE) {
+          for (auto &entry : streams) {
+            entry.second.send_window += int64_t{value} - initial_window;
+            if (entry.second.send_window > MAX_WINDOW) {
+              return fail(H2Error::FLOW_CONTROL_ERROR);
+            }
+          }
+          initial_window = value;
+        } else if (id == Setting::MAX_FRAME_SIZE) {
+          max_frame_size = value;
+        }
+      }
+      append_frame_header(out, 0, FrameType::SETTINGS, FLAG_ACK, 0);
+      return true;
+    case FrameType::PING:
+      if (len != 8) {
+        return false;
+      }
+      if (!(header.flags & FLAG_ACK)) {
+        append_frame_header(out, 8, FrameType::PING, FLAG_ACK, 0);
+        out.append(reinterpret_cast<const char *>(payload), 8);
+      }
+      return true;
+    case FrameType::GOAWAY:
+      goaway_received = true;
+      return true;
+    case FrameType::WINDOW_UPDATE: {
+      if (len != 4) {
+        return false;
+      }
+      uint32_t increment = read_u32(payload) & MAX_STREAM_ID;
+      if (!header.stream_id) {
+        if (!increment) {
+          return false;
+        }
+        send_window += increment;
+        if (send_window > MAX_WINDOW) {
+          return fail(H2Error::FLOW_CONTROL_ERROR);
+        }
+      } else if (auto it = streams.find(header.stream_id);
+                 it != streams.end()) {
+        it->second.send_window += increment;
+        if (!increment) {
+          reset_stream(it, H2Error::PROTOCOL_ERROR);
+        } else if (it->second.send_window > MAX_WINDOW) {
+          reset_stream(it, H2Error::FLOW_CONTROL_ERROR);
+        }
+      }
+      return true;
+    }
+    case FrameType::PUSH_PROMISE:
+      // clients can't push
+      return false;
+    default:
+      return true;
+  }
+}
+
+bool Http2Session::finish_header_block(uint32_t stream_id, bool end_stream) {
+  H2Stream *stream = nullptr;
+  bool trailers = false;
+  bool refused = false;
+  auto it = streams.find(stream_id);
+  if (it != streams.end()) {
+    stream = &it->second;
+    trailers = true;
+  } else if (stream_id <= last_stream_id) {
+    // a stream that was answered or reset can't be opened again
+    return fail(H2Error::STREAM_CLOSED);
+  } else {
+    last_stream_id = stream_id;
+    if (streams.size() >= MAX_STREAMS) {
+      refused = true;
+    } else {
+      stream = &streams[stream_id];
+      stream->send_window = initial_window;
+    }
+  }
+  // Every block is decoded, even for streams we drop, to keep the dynamic
+  // table in sync
+  size_t list_size = 0;
+  bool ok = decoder.decode(
+      reinterpret_cast<const uint8_t *>(header_block.data()),
+      header_block.size(),
+      [&](std::string_view name, std::string_view value) {
+        // indexed fields decode to far more than they take in the block
+        list_size += name.size() + value.size() + 32;
+        if (!stream || trailers || list_size > MAX_HEADER_LIST) {
+          return;
+        }
+        if (name == ":method") {
+          stream->method = value;
+        } else if (name == ":scheme") {
+          stream->scheme = value;
+        } else if (name == ":authority") {
+          stream->authority = value;
+        } else if (name == ":path") {
+          stream->path = value;
+        } else if (name == "cookie") {
+          // HTTP/1.1 wants the crumbs back in a single field
+          if (!stream->cookie.empty()) {
+            stream->cookie += "; ";
+          }
+          stream->cookie += value;
+        } else if (!name.empty() && name[0] != ':') {
+          stream->has_content_length |= name == "content-length";
+          stream->fields.append(name).append(": ").append(value).append(
+              "\r\n");
+        }
+      });
+  if (!ok) {
+    return fail(H2Error::COMPRESSION_ERROR);
+  }
+  if (list_size > MAX_HEADER_LIST) {
+    return fail(H2Error::ENHANCE_YOUR_CALM);
+  }
+  if (refused) {
+    append_rst_stream(out, stream_id, H2Error::REFUSED_STREAM);
+    return true;
+  }
+  if (!stream) {
+    return true;
+  }
+  if (trailers && (stream->request_done || !end_stream)) {
+    // the request is already on its way, or the trailers don't end it
+    reset_stream(it, stream->request_done ? H2Error::STREAM_CLOSED
+                                          : H2Error::PROTOCOL_ERROR);
+    return true;
+  }
+  if (!trailers && (stream->method.empty() || stream->path.empty() ||
+                    stream->method == "CONNECT")) {
+    append_rst_stream(out, stream_id, H2Error::PROTOCOL_ERROR);
+    streams.erase(stream_id);
+    return true;
+  }
+  if (end_stream) {
+    finish_request(stream_id, *stream);
+  }
+  return true;
+}
+
+void Http2Session::finish_request(uint32_t stream_id, H2Stream &stream) {
+  stream.request_done = true;
+  // absolute-form, like the requests HTTP/1.1 clients send to a proxy
+  std::string request = stream.method + " ";
+  if (!stream.authority.empty()) {
+    request += (stream.scheme.empty() ? "http" : stream.scheme) + "://" +
+               stream.authority;
+  }
+  request += stream.path + " HTTP/1.1\r\n";
+  if (!stream.authority.empty()) {
+    request += "host: " + stream.authority + "\r\n";
+  }
+  request += stream.fields;
+  if (!stream.cookie.empty()) {
+    request += "cookie: " + stream.cookie + "\r\n";
+  }
+  if (!stream.has_content_length && !stream.body.empty()) {
+    request += "content-length: " + std::to_string(stream.body.size()) + "\r\n";
+  }
+  request += "\r\n";
+  request += stream.body;
+  release(stream.body.size());
+  // only the response is needed from here on
+  std::string{}.swap(stream.body);
+  std::string{}.swap(stream.fields);
+  on_request(stream_id, std::move(request));
+}
+
+void Http2Session::reset_stream(std::map<uint32_t, H2Stream>::iterator it,
+                                H2Error error) {
+  append_rst_stream(out, it->first, error);
+  release(it->second.body.size());
+  streams.erase(it);
+}
+
+void Http2Session::release(size_t len) {
+  recv_unacked += len;
+  // batched, unless what's buffered has the client nearly stalled
+  if (recv_unacked >= CONNECTION_WINDOW / 2 ||
+      (recv_unacked && recv_window < WINDOW)) {
+    append_window_update(out, 0, recv_unacked);
+    recv_window += recv_unacked;
+    recv_unacked = 0;
+  }
+}
+
+void Http2Session::respond(uint32_t stream_id, const std::string &response) {
+  auto it = streams.find(stream_id);
+  if (it == streams.end()) {
+    return;
+  }
+  std::string block;
+  std::string body;
+  if (!encode_response(response, encoder, block, body)) {
+    append_rst_stream(out, stream_id, H2Error::INTERNAL_ERROR);
+    streams.erase(it);
+    return;
+  }
+  append_headers(out, stream_id, block, body.empty(), max_frame_size);
+  if (body.empty()) {
+    streams.erase(it);
+    return;
+  }
+  it->second.response_body = std::move(body);
+  it->second.responding = true;
+  send_data();
+}
+
+void Http2Session::send_data() {
+  bool progress = true;
+  while (progress && send_window > 0) {
+    progress = false;
+    // a frame per stream per round so one big response can't hog the window
+    for (auto it = streams.begin(); it != streams.end();) {
+      auto &stream = it->second;
+      size_t left = stream.response_body.size() - stream.body_sent;
+      if (!stream.responding || stream.send_window <= 0 || send_window <= 0) {
+        ++it;
+        continue;
+      }
+      size_t len = std::min<size_t>({left, size_t(stream.send_window),
+                                     size_t(send_window), max_frame_size});
+      append_data(out, it->first,
+                  std::string_view{stream.response_body}.substr(
+                      stream.body_sent, len),
+                  len == left, max_frame_size);
+      stream.body_sent += len;
+      stream.send_window -= len;
+      send_window -= len;
+      progress = true;
+      it = len == left ? streams.erase(it) : std::next(it);
+    }
+  }
+}
+
+void Http2Session::go_away() {
+  goaway_sent = true;
+  append_goaway(out, last_stream_id, H2Error::NO_ERROR);
+}
+
+bool Http2Session::connection_error(H2Error error) {
+  append_goaway(out, last_stream_id, error);
+  return false;
+}
+
+bool Http2Session::fail(H2Error error) {
+  failure = error;
+  return false;
+}
@@ -0,0 +1,515 @@
+#include "Http2Upstream.h"
+
+#include <iostream>
+#include <mutex>
+#include <set>
+
+#include "utils.h"
+
+using namespace boost;
+
+static std::set<std::string> h2c_origins;
+static std::mutex registry_mutex;
+static std::map<std::string, std::weak_ptr<Http2Upstream>> registry;
+
+void Http2Upstream::add_h2c_origin(const std::string &host) {
+  std::string lower = host;
+  to_lowercase(lower);
+  h2c_origins.insert(lower);
+}
+
+bool Http2Upstream::speaks_h2c(const std::string &host) {
+  if (h2c_origins.empty()) {
+    return false;
+  }
+  std::string lower = host;
+  to_lowercase(lower);
+  return h2c_origins.count(lower);
+}
+
+std::shared_ptr<Http2Upstream> Http2Upstream::get(
+    asio::io_context &io_context, const std::string &host) {
+  std::lock_guard<std::mutex> lock{registry_mutex};
+  auto &slot = registry[host];
+  auto upstream = slot.lock();
+  if (!upstream) {
+    upstream = std::make_shared<Http2Upstream>(io_context, host);
+    slot = upstream;
+    asio::post(upstream->strand, [upstream] { upstream->connect(); });
+  }
+  return upstream;
+}
+
+Http2Upstream::Http2Upstream(asio::io_context &io_context,
+                             const std::string &host)
+    : io_context{io_context},
+      strand{asio::make_strand(io_context)},
+      host{host},
+      resolver{strand},
+      socket{strand} {}
+
+void Http2Upstream::submit(std::string request,
+                           const asio::any_io_executor &executor,
+                           Callback callback) {
+  enqueue(Pending{std::move(request), executor, std::move(callback)});
+}
+
+void Http2Upstream::enqueue(Pending &&pending) {
+  auto self(shared_from_this());
+  asio::post(strand, [self, this, pending = std::move(pending)]() mutable {
+    if (going_away || closed) {
+      resubmit(std::move(pending));
+      return;
+    }
+    waiting.push_back(std::move(pending));
+    if (connected) {
+      start_streams();
+    }
+  });
+}
+
+void Http2Upstream::connect() {
+  auto self(shared_from_this());
+  auto [name, port] = split_host_port(host);
+  resolver.async_resolve(
+      name, port,
+      [self, this](const system::error_code &ec,
+                   asio::ip::tcp::resolver::results_type endpoints) {
+        if (ec) {
+          fail(ec);
+          return;
+        }
+        connecting = std::make_shared<HappyEyeballs>(strand);
+        connecting->start(endpoints, [self, this](
+                                         const system::error_code &ec,
+                                         asio::ip::tcp::socket &&upstream) {
+          connecting.reset();
+          if (ec) {
+            fail(ec);
+            return;
+          }
+          socket = std::move(upstream);
+          socket.set_option(asio::ip::tcp::no_delay{true});
+          connected = true;
+          out.append(CONNECTION_PREFACE);
+          append_settings(out, {{Setting::ENABLE_PUSH, 0},
+                                {Setting::INITIAL_WINDOW_SIZE, WINDOW}});
+          append_window_update(out, 0, WINDOW - DEFAULT_WINDOW);
+          start_streams();
+          flush();
+          read();
+        });
+      });
+}
+
+void Http2Upstream::start_streams() {
+  while (!waiting.empty() && streams.size() < max_streams && !going_away) {
+    if (next_stream_id > MAX_STREAM_ID) {
+      // out of stream ids, carry on with a new connection
+      go_away();
+      break;
+    }
+    Pending pending = std::move(waiting.front());
+    waiting.pop_front();
+    open_stream(std::move(pending));
+  }
+  send_data();
+  flush();
+}
+
+void Http2Upstream::open_stream(Pending &&pending) {
+  H2Stream stream;
+  std::string block;
+  if (!encode_request(pending.request, encoder, block, stream.body,
+                      stream.head)) {
+    asio::post(pending.executor,
+               [callback = std::move(pending.callback)]() mutable {
+                 callback(asio::error::invalid_argument, "");
+               });
+    return;
+  }
+  uint32_t id = next_stream_id;
+  next_stream_id += 2;
+  append_headers(out, id, block, stream.body.empty(), max_frame_size);
+  stream.send_window = initial_window;
+  stream.pending = std::move(pending);
+  streams.emplace(id, std::move(stream));
+}
+
+void Http2Upstream::send_data() {
+  bool progress = true;
+  while (progress && send_window > 0) {
+    progress = false;
+    // a frame per stream per round so a big upload can't starve the others
+    for (auto &[id, stream] : streams) {
+      size_t left = stream.body.size() - stream.body_sent;
+      if (!left || stream.send_window <= 0 || send_window <= 0) {
+        continue;
+      }
+      size_t len = std::min<size_t>(
+          {left, size_t(stream.send_window), size_t(send_window),
+           max_frame_size});
+      append_data(out, id,
+                  std::string_view{stream.body}.substr(stream.body_sent, len),
+                  len == left, max_frame_size);
+      stream.body_sent += len;
+      stream.send_window -= len;
+      send_window -= len;
+      progress = true;
+    }
+  }
+}
+
+void Http2Upstream::flush() {
+  if (writing || out.empty() || !connected || closed) {
+    return;
+  }
+  auto self(shared_from_this());
+  writing = true;
+  std::swap(out, writing_buffer);
+  asio::async_write(socket, asio::buffer(writing_buffer),
+                    [self, this](const system::error_code &ec, std::size_t) {
+                      writing = false;
+                      writing_buffer.clear();
+                      if (ec) {
+                        fail(ec);
+                        return;
+                      }
+                      flush();
+                    });
+}
+
+void Http2Upstream::read() {
+  auto self(shared_from_this());
+  asio::async_read(
+      socket, asio::dynamic_buffer(in), asio::transfer_at_least(1),
+      [self, this](const system::error_code &ec, std::size_t) {
+        if (closed) {
+          return;
+        }
+        if (ec) {
+          fail(ec);
+          return;
+        }
+        const auto *data = reinterpret_cast<const uint8_t *>(in.data());
+        size_t pos = 0;
+        while (in.size() - pos >= FRAME_HEADER_SIZE) {
+          FrameHeader header = parse_frame_header(data + pos);
+          if (header.length > DEFAULT_MAX_FRAME_SIZE) {
+            fail(asio::error::message_size);
+            return;
+          }
+          if (in.size() - pos < FRAME_HEADER_SIZE + header.length) {
+            break;
+          }
+          if (!handle_frame(header, data + pos + FRAME_HEADER_SIZE)) {
+            fail(asio::error::invalid_argument);
+            return;
+          }
+          if (closed) {
+            return;
+          }
+          pos += FRAME_HEADER_SIZE + header.length;
+        }
+        in.erase(0, pos);
+        send_data();
+        flush();
+        read();
+      });
+}
+
+bool Http2Upstream::handle_frame(const FrameHeader &header,
+                                 const uint8_t *payload) {
+  size_t len = header.length;
+  if (header_block_stream && header.type != FrameType::CONTINUATION) {
+    return false;
+  }
+  switch (header.type) {
+    case FrameType::DATA: {
+      if (!strip_padding(header, payload, len)) {
+        return false;
+      }
+      // padding counts against the window too
+      recv_unacked += header.length;
+      if (recv_unacked >= WINDOW / 2) {
+        append_window_update(out, 0, recv_unacked);
+        recv_unacked = 0;
+      }
+      auto it = streams.find(header.stream_id);
+      if (it == streams.end()) {
+        return true;
+      }
+      auto &stream = it->second;
+      stream.response_body.append(reinterpret_cast<const char *>(payload),
+                                  len);
+      if (header.flags & FLAG_END_STREAM) {
+        complete(header.stream_id);
+        return true;
+      }
+      stream.recv_unacked += header.length;
+      if (stream.recv_unacked >= WINDOW / 2) {
+        append_window_update(out, header.stream_id, stream.recv_unacked);
+        stream.recv_unacked = 0;
+      }
+      return true;
+    }
+    case FrameType::HEADERS:
+      if (!strip_padding(header, payload, len)) {
+        return false;
+      }
+      header_block.assign(reinterpret_cast<const char *>(payload), len);
+      header_block_end_stream = header.flags & FLAG_END_STREAM;
+      if (header.flags & FLAG_END_HEADERS) {
+        return finish_header_block(header.stream_id, header_block_end_stream);
+      }
+      header_block_stream = header.stream_id;
+      return true;
+    case FrameType::CONTINUATION:
+      if (header.stream_id != header_block_stream) {
+        return false;
+      }
+      header_block.append(reinterpret_cast<const char *>(payload), len);
+      if (header.flags & FLAG_END_HEADERS) {
+        header_block_stream = 0;
+        return finish_header_block(header.stream_id, header_block_end_stream);
+      }
+      return true;
+    case FrameType::RST_STREAM: {
+      auto it = streams.find(header.stream_id);
+      if (len != 4 || it == streams.end()) {
+        return len == 4;
+      }
+      Pending pending = std::move(it->second.pending);
+      streams.erase(it);
+      if (static_cast<H2Error>(read_u32(payload)) == H2Error::REFUSED_STREAM) {
+        // refused streams were never processed, they're safe to retry
+        resubmit(std::move(pending));
+      } else {
+        asio::post(pending.executor,
+                   [callback = std::move(pending.callback)]() mutable {
+                     callback(asio::error::connection_reset, "");
+                   });
+      }
+      start_streams();
+      return true;
+    }
+    case FrameType::SETTINGS:
+      if (header.flags & FLAG_ACK) {
+        return true;
+      }
+      if (len % 6) {
+        return false;
+      }
+      for (size_t i = 0; i < len; i += 6) {
+        auto id = static_cast<Setting>(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = read_u32(payload + i + 2);
+        if (check_setting(id, value) != H2Error::NO_ERROR) {
+          return false;
+        }
+        if (id == Setting::HEADER_TABLE_SIZE) {
+          encoder.set_max_table_size(value);
+        } else if (id == Setting::MAX_CONCURRENT_STREAMS) {
+          max_streams = value;
+        } else if (id == Setting::INITIAL_WINDOW_SIZE) {
+          // applies retroactively to every open stream
+          for (auto &entry : streams) {
+            entry.second.send_window += int64_t{value} - initial_window;
+            if (entry.second.send_window > MAX_WINDOW) {
+              return false;
+            }
+          }
+          initial_window = value;
+        } else if (id == Setting::MAX_FRAME_SIZE) {
+          max_frame_size = value;
+        }
+      }
+      append_frame_header(out, 0, FrameType::SETTINGS, FLAG_ACK, 0);
+      start_streams();
+      return true;
+    case FrameType::PING:
+      if (len != 8) {
+        return false;
+      }
+      if (!(header.flags & FLAG_ACK)) {
+        append_frame_header(out, 8, FrameType::PING, FLAG_ACK, 0);
+        out.append(reinterpret_cast<const char *>(payload), 8);
+      }
+      return true;
+    case FrameType::GOAWAY: {
+      if (len < 8) {
+        return false;
+      }
+      uint32_t last_stream_id = read_u32(payload) & MAX_STREAM_ID;
+      // streams past the last one were never looked at
+      for (auto it = streams.upper_bound(last_stream_id);
+           it != streams.end();) {
+        resubmit(std::move(it->second.pending));
+        it = streams.erase(it);
+      }
+      go_away();
+      return true;
+    }
+    case FrameType::WINDOW_UPDATE: {
+      if (len != 4) {
+        return false;
+      }
+      uint32_t increment = read_u32(payload) & MAX_STREAM_ID;
+      if (!increment) {
+        return false;
+      }
+      if (!header.stream_id) {
+        send_window += increment;
+        return send_window <= MAX_WINDOW;
+      }
+      if (auto it = streams.find(header.stream_id); it != streams.end()) {
+        it->second.send_window += increment;
+        return it->second.send_window <= MAX_WINDOW;
+      }
+      return true;
+    }
+    case FrameType::PUSH_PROMISE:
+      // we said ENABLE_PUSH 0
+      return false;
+    default:
+      return true;
+  }
+}
+
+bool Http2Upstream::finish_header_block(uint32_t stream_id, bool end_stream) {
+  auto it = streams.find(stream_id);
+  // Blocks of streams we no longer care about still have to be decoded,
+  // they update the dynamic table
+  H2Stream *stream = it == streams.end() ? nullptr : &it->second;
+  // a second block after the final response header carries trailers
+  bool trailers = stream && stream->status >= 200;
+  int status = 0;
+  std::string header;
+  std::string content_length;
+  bool ok = decoder.decode(
+      reinterpret_cast<const uint8_t *>(header_block.data()),
+      header_block.size(),
+      [&](std::string_view name, std::string_view value) {
+        if (!stream || trailers) {
+          return;
+        }
+        if (name == ":status") {
+          status = std::atoi(std::string{value}.c_str());
+        } else if (name == "content-length") {
+          content_length = value;
+        } else if (name.empty() || name[0] != ':') {
+          header.append(name).append(": ").append(value).append("\r\n");
+        }
+      });
+  if (!ok || !stream) {
+    return ok;
+  }
+  if (!trailers && status >= 200) {
+    stream->status = status;
+    stream->header = std::move(header);
+    stream->content_length = std::move(content_length);
+  }
+  // interim (1xx) responses aren't passed on
+  if (end_stream) {
+    complete(stream_id);
+  }
+  return true;
+}
+
+void Http2Upstream::complete(uint32_t stream_id) {
+  auto it = streams.find(stream_id);
+  auto &stream = it->second;
+  if (stream.body_sent < stream.body.size()) {
+    // the origin answered before taking the whole body
+    append_rst_stream(out, stream_id, H2Error::NO_ERROR);
+  }
+  std::string response = "HTTP/1.1 " + std::to_string(stream.status) + " " +
+                         reason_phrase(stream.status) + "\r\n" +
+                         stream.header;
+  bool bodyless = stream.status / 100 == 1 || stream.status == 204 ||
+                  stream.status == 304;
+  if (stream.head) {
+    if (!stream.content_length.empty()) {
+      response += "content-length: " + stream.content_length + "\r\n";
+    }
+  } else if (!bodyless) {
+    response +=
+        "content-length: " + std::to_string(stream.response_body.size()) +
+        "\r\n";
+  }
+  response += "\r\n";
+  response += stream.response_body;
+  asio::post(stream.pending.executor,
+             [callback = std::move(stream.pending.callback),
+              response = std::move(response)]() mutable {
+               callback({}, std::move(response));
+             });
+  streams.erase(it);
+  if (going_away && streams.empty()) {
+    fail(asio::error::shut_down);
+    return;
+  }
+  start_streams();
+}
+
+void Http2Upstream::resubmit(Pending &&pending) {
+  if (++pending.resubmits > MAX_RESUBMITS) {
+    // an origin that keeps refusing it won't take it on the next try either
+    asio::post(pending.executor,
+               [callback = std::move(pending.callback)]() mutable {
+                 callback({},
+                          "HTTP/1.1 502 Bad Gateway\r\n"
+                          "content-length: 0\r\n\r\n");
+               });
+    return;
+  }
+  get(io_context, host)->enqueue(std::move(pending));
+}
+
+void Http2Upstream::go_away() {
+  going_away = true;
+  unregister();
+  while (!waiting.empty()) {
+    resubmit(std::move(waiting.front()));
+    waiting.pop_front();
+  }
+  if (streams.empty()) {
+    fail(asio::error::shut_down);
+  }
+}
+
+void Http2Upstream::fail(const system::error_code &ec) {
+  if (closed) {
+    return;
+  }
+  closed = true;
+  unregister();
+  // an origin closing an idle connection isn't worth a word
+  if (ec != asio::error::shut_down && (!streams.empty() || !waiting.empty())) {
+    std::cerr << RED << "HTTP/2 connection to " << host
+              << " failed: " << ec.message() << RESET << std::endl;
+  }
+  system::error_code ignored;
+  socket.close(ignored);
+  if (connecting) {
+    connecting->cancel();
+  }
+  for (auto &[id, stream] : streams) {
+    waiting.push_back(std::move(stream.pending));
+  }
+  streams.clear();
+  for (auto &pending : waiting) {
+    asio::post(pending.executor,
+               [callback = std::move(pending.callback), ec]() mutable {
+                 callback(ec, "");
+               });
+  }
+  waiting.clear();
+}
+
+void Http2Upstream::unregister() {
+  std::lock_guard<std::mutex> lock{registry_mutex};
+  auto it = registry.find(host);
+  if (it != registry.end() && it->second.lock().get() == this) {
+    registry.erase(it);
+  }
+}
@@ -0,0 +1,278 @@
+#include "Metrics.h"
+
+#include <cxxabi.h>
+
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "Histogram.h"
+
+using namespace boost;
+
+namespace {
+
+constexpr size_t PHASES = static_cast<size_t>(Phase::COUNT);
+constexpr double QUANTILES[] = {50, 90, 99, 99.9};
+
+struct ThreadHistograms {
+  std::array<Histogram, PHASES> phases;
+  Histogram loop_lag;
+  // Allocated the first time the thread runs a handler from that site
+  std::array<std::atomic<Histogram *>, MAX_HANDLER_SITES> handlers{};
+};
+
+// Every thread records into its own histograms. They are owned by the
+// registry, not the thread, so samples survive threads that exit.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<ThreadHistograms>> registry;
+
+std::mutex sites_mutex;
+std::vector<std::string> site_names;
+std::map<std::string, size_t> site_index;
+
+ThreadHistograms &local_histograms() {
+  thread_local ThreadHistograms *mine = [] {
+    auto histograms = std::make_unique<ThreadHistograms>();
+    auto *ptr = histograms.get();
+    std::lock_guard<std::mutex> lock{registry_mutex};
+    registry.push_back(std::move(histograms));
+    return ptr;
+  }();
+  return *mine;
+}
+
+void record_us(Histogram &histogram,
+               std::chrono::steady_clock::duration elapsed) {
+  auto us =
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  histogram.record(us > 0 ? us : 0);
+}
+
+// The handler an operation completes, named after the lambda in it:
+// "Socket::pump()::{lambda()#1}" out of a demangled type like
+// "reactive_socket_recv_op<..., Socket::pump()::{lambda(...)#1}, ...>".
+// Handlers that aren't lambdas get the operation's name.
+std::string call_site(std::string type) {
+  const std::string anonymous = "(anonymous namespace)::";
+  for (size_t pos; (pos = type.find(anonymous)) != std::string::npos;) {
+    type.erase(pos, anonymous.size());
+  }
+  size_t lambda = type.find("::{lambda(");
+  if (lambda == std::string::npos) {
+    std::string name = type.substr(0, type.find('<'));
+    size_t scope = name.rfind("::");
+    return scope == std::string::npos ? name : name.substr(scope + 2);
+  }
+  // back to the start of the enclosing function's qualified name
+  size_t begin = lambda;
+  int depth = 0;
+  for (; begin > 0; --begin) {
+    char c = type[begin - 1];
+    if (c == ')' || c == '>') {
+      ++depth;
+    } else if (c == '(' || c == '<') {
+      if (!depth) {
+        break;
+      }
+      --depth;
+    } else if ((c == ',' || c == ' ') && !depth) {
+      break;
+    }
+  }
+  // and forward past the lambdas nested in it
+  size_t end = lambda;
+  depth = 0;
+  for (; end < type.size(); ++end) {
+    char c = type[end];
+    if (c == '(' || c == '<' || c == '{') {
+      ++depth;
+    } else if (c == ')' || c == '>' || c == '}') {
+      if (!depth) {
+        break;
+      }
+      --depth;
+    } else if (c == ',' && !depth) {
+      break;
+    }
+  }
+  // without parameter lists or the operator() between nested lambdas
+  std::string site;
+  depth = 0;
+  for (size_t i = begin; i < end; ++i) {
+    if (type[i] == '(') {
+      if (!depth++) {
+        site += "()";
+      }
+    } else if (type[i] == ')') {
+      --depth;
+    } else if (!depth) {
+      site += type[i];
+    }
+  }
+  for (const char *hop : {"::operator()() const", "::operator()()"}) {
+    for (size_t pos; (pos = site.find(hop)) != std::string::npos;) {
+      site.erase(pos, std::strlen(hop));
+    }
+  }
+  return site;
+}
+
+// Label values are quoted, only quotes and backslashes need escaping
+std::string escape(const std::string &value) {
+  std::string escaped;
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+void render_summary(std::ostringstream &out, const char *metric,
+                    const std::string &labels, const Histogram &histogram) {
+  for (double q : QUANTILES) {
+    out << metric << "{" << labels << ",quantile=\"" << q / 100 << "\"} "
+        << histogram.percentile(q) << "\n";
+  }
+  out << metric << "_max{" << labels << "} " << histogram.max() << "\n";
+  out << metric << "_sum{" << labels << "} " << histogram.sum() << "\n";
+  out << metric << "_count{" << labels << "} " << histogram.count() << "\n";
+}
+
+void probe(std::shared_ptr<asio::steady_timer> timer) {
+  timer->expires_after(LOOP_PROBE_INTERVAL);
+  timer->async_wait([timer](const system::error_code &ec) {
+    if (ec) {
+      return;
+    }
+    record_us(local_histograms().loop_lag,
+              std::chrono::steady_clock::now() - timer->expiry());
+    probe(timer);
+  });
+}
+
+}  // namespace
+
+const char *phase_name(Phase phase) {
+  switch (phase) {
+    case Phase::HANDSHAKE:
+      return "handshake";
+    case Phase::DNS:
+      return "dns";
+    case Phase::CONNECT:
+      return "connect";
+    case Phase::TTFB:
+      return "ttfb";
+    case Phase::TRANSFER:
+      return "transfer";
+    default:
+      return "unknown";
+  }
+}
+
+void record_phase(Phase phase, std::chrono::steady_clock::duration elapsed) {
+  record_us(local_histograms().phases[static_cast<size_t>(phase)], elapsed);
+}
+
+void start_loop_probe(asio::io_context &io_context, size_t probes) {
+  for (size_t i = 0; i < probes; ++i) {
+    probe(std::make_shared<asio::steady_timer>(asio::make_strand(io_context)));
+  }
+}
+
+size_t handler_site(const char *mangled_type) {
+  int status = 0;
+  char *demangled =
+      abi::__cxa_demangle(mangled_type, nullptr, nullptr, &status);
+  std::string site = call_site(status == 0 ? demangled : mangled_type);
+  std::free(demangled);
+  std::lock_guard<std::mutex> lock{sites_mutex};
+  auto [it, added] = site_index.emplace(site, site_names.size());
+  if (added) {
+    if (site_names.size() == MAX_HANDLER_SITES) {
+      // out of room, not recorded
+      it->second = MAX_HANDLER_SITES;
+    } else {
+      site_names.push_back(site);
+    }
+  }
+  return it->second;
+}
+
+void record_handler(size_t site, std::chrono::steady_clock::duration elapsed) {
+  if (site >= MAX_HANDLER_SITES) {
+    return;
+  }
+  auto &slot = local_histograms().handlers[site];
+  Histogram *histogram = slot.load(std::memory_order_relaxed);
+  if (!histogram) {
+    // only this thread stores to its slots, readers just need the release
+    histogram = new Histogram;
+    slot.store(histogram, std::memory_order_release);
+  }
+  record_us(*histogram, elapsed);
+}
+
+std::string render_metrics() {
+  std::array<Histogram, PHASES> merged;
+  std::vector<std::pair<size_t, Histogram>> loop_lag;
+  std::vector<Histogram> handlers;
+  std::vector<std::string> sites;
+  {
+    std::lock_guard<std::mutex> lock{sites_mutex};
+    sites = site_names;
+  }
+  handlers.resize(sites.size());
+  {
+    std::lock_guard<std::mutex> lock{registry_mutex};
+    for (size_t t = 0; t < registry.size(); ++t) {
+      const auto &thread = registry[t];
+      for (size_t i = 0; i < PHASES; ++i) {
+        merged[i].merge(thread->phases[i]);
+      }
+      if (thread->loop_lag.count()) {
+        loop_lag.emplace_back(t, thread->loop_lag);
+      }
+      for (size_t i = 0; i < handlers.size(); ++i) {
+        if (auto *histogram =
+                thread->handlers[i].load(std::memory_order_acquire)) {
+          handlers[i].merge(*histogram);
+        }
+      }
+    }
+  }
+  std::ostringstream out;
+  out << "# TYPE proxy_phase_latency_us summary\n";
+  for (size_t i = 0; i < PHASES; ++i) {
+    render_summary(out, "proxy_phase_latency_us",
+                   std::string{"phase=\""} +
+                       phase_name(static_cast<Phase>(i)) + "\"",
+                   merged[i]);
+  }
+  if (!loop_lag.empty()) {
+    out << "# TYPE proxy_loop_lag_us summary\n";
+    for (const auto &[thread, histogram] : loop_lag) {
+      render_summary(out, "proxy_loop_lag_us",
+                     "thread=\"" + std::to_string(thread) + "\"", histogram);
+    }
+  }
+  if (!sites.empty()) {
+    out << "# TYPE proxy_handler_duration_us summary\n";
+    for (size_t i = 0; i < sites.size(); ++i) {
+      if (handlers[i].count()) {
+        render_summary(out, "proxy_handler_duration_us",
+                       "site=\"" + escape(sites[i]) + "\"", handlers[i]);
+      }
+    }
+  }
+  return out.str();
+}
@@ -0,0 +1,99 @@
+#include "Overload.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <memory>
+
+using namespace boost;
+
+namespace {
+
+size_t max_connections = 0;
+size_t max_rss = 0;
+std::atomic<size_t> connections{0};
+// Decays by a quarter every sample, so one late timer counts for a while
+std::atomic<int64_t> lag_us{0};
+std::atomic<size_t> rss{0};
+std::unique_ptr<asio::steady_timer> monitor;
+
+size_t resident_bytes() {
+  // "size resident shared ..." in pages
+  std::ifstream statm{"/proc/self/statm"};
+  size_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+void sample() {
+  monitor->expires_after(Overload::SAMPLE_INTERVAL);
+  monitor->async_wait([](const system::error_code &ec) {
+    if (ec) {
+      return;
+    }
+    auto late = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - monitor->expiry())
+                    .count();
+    int64_t decayed = lag_us.load(std::memory_order_relaxed) * 3 / 4;
+    lag_us.store(std::max(late, decayed), std::memory_order_relaxed);
+    if (max_rss) {
+      rss.store(resident_bytes(), std::memory_order_relaxed);
+    }
+    sample();
+  });
+}
+
+}  // namespace
+
+void Overload::configure(size_t connections_limit, size_t rss_limit) {
+  max_connections = connections_limit;
+  if (!max_connections) {
+    rlimit files{};
+    getrlimit(RLIMIT_NOFILE, &files);
+    // a few left for listeners, the resolver and logs
+    max_connections = files.rlim_cur > 128 ? (files.rlim_cur - 64) / 2 : 32;
+  }
+  max_rss = rss_limit;
+}
+
+void Overload::start_monitor(asio::io_context &io_context) {
+  monitor = std::make_unique<asio::steady_timer>(asio::make_strand(io_context));
+  sample();
+}
+
+Overload::Level Overload::level() {
+  std::chrono::microseconds lag{lag_us.load(std::memory_order_relaxed)};
+  if (connections.load(std::memory_order_relaxed) >= max_connections ||
+      lag >= PAUSE_LAG) {
+    return Level::PAUSE;
+  }
+  if (lag >= SHED_LAG ||
+      (max_rss && rss.load(std::memory_order_relaxed) > max_rss)) {
+    return Level::SHED;
+  }
+  return Level::NORMAL;
+}
+
+void Overload::connection_opened() {
+  connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Overload::connection_closed() {
+  connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+size_t Overload::open_connections() {
+  return connections.load(std::memory_order_relaxed);
+}
+
+void Overload::reject(int fd) {
+  static constexpr char RESPONSE[] =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n"
+      "Retry-After: 1\r\n\r\n";
+  // a fresh connection's send buffer is empty, this never has to wait
+  (void)::send(fd, RESPONSE, sizeof(RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
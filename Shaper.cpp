@@ -0,0 +1,129 @@
+#include "Shaper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace boost;
+
+namespace {
+
+struct Waiter {
+  double start;
+  double finish;
+  // first come first served between equal tags
+  uint64_t order;
+  size_t bytes;
+  std::function<void()> grant;
+};
+
+// Heap order, the earliest finish ends up on top
+struct Later {
+  bool operator()(const Waiter &a, const Waiter &b) const {
+    return a.finish != b.finish ? a.finish > b.finish : a.order > b.order;
+  }
+};
+
+double rate = 0;
+// A tenth of a second of tokens, at least a slice
+double capacity = 0;
+
+std::mutex mutex;
+double tokens = 0;
+std::chrono::steady_clock::time_point refilled;
+// Start tag of the slice granted last
+double virtual_time = 0;
+uint64_t next_order = 0;
+std::vector<Waiter> waiting;
+std::unique_ptr<asio::steady_timer> timer;
+bool timer_armed = false;
+
+void refill() {
+  auto now = std::chrono::steady_clock::now();
+  tokens = std::min(
+      capacity,
+      tokens + rate * std::chrono::duration<double>(now - refilled).count());
+  refilled = now;
+}
+
+void drain();
+
+// Wakes up once the bucket can pay for the first waiter, mutex held
+void arm() {
+  if (timer_armed || waiting.empty()) {
+    return;
+  }
+  double missing = std::max(waiting.front().bytes - tokens, 0.0);
+  timer->expires_after(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(missing / rate)));
+  timer_armed = true;
+  timer->async_wait([](const system::error_code &ec) {
+    if (!ec) {
+      drain();
+    }
+  });
+}
+
+void drain() {
+  std::vector<std::function<void()>> granted;
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    timer_armed = false;
+    refill();
+    while (!waiting.empty() && tokens >= waiting.front().bytes) {
+      std::pop_heap(waiting.begin(), waiting.end(), Later{});
+      Waiter &next = waiting.back();
+      tokens -= next.bytes;
+      virtual_time = next.start;
+      granted.push_back(std::move(next.grant));
+      waiting.pop_back();
+    }
+    arm();
+  }
+  for (const auto &grant : granted) {
+    grant();
+  }
+}
+
+}  // namespace
+
+void Shaper::configure(size_t bytes_per_second) {
+  rate = static_cast<double>(bytes_per_second);
+  capacity = std::max(rate / 10, static_cast<double>(QUANTUM));
+  tokens = capacity;
+  refilled = std::chrono::steady_clock::now();
+}
+
+bool Shaper::enabled() { return rate > 0; }
+
+void Shaper::start(asio::io_context &io_context) {
+  if (enabled()) {
+    timer = std::make_unique<asio::steady_timer>(io_context);
+  }
+}
+
+void Shaper::request(Flow &flow, size_t bytes, std::function<void()> grant) {
+  if (!enabled()) {
+    grant();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    double start = std::max(virtual_time, flow.finish);
+    flow.finish = start + bytes;
+    refill();
+    if (!waiting.empty() || tokens < bytes) {
+      waiting.push_back(
+          {start, flow.finish, next_order++, bytes, std::move(grant)});
+      std::push_heap(waiting.begin(), waiting.end(), Later{});
+      arm();
+      return;
+    }
+    tokens -= bytes;
+    virtual_time = start;
+  }
+  grant();
+}
@@ -1,26 +1,74 @@
 #include <boost/asio.hpp>
 #include <chrono>
+#include <cstdint>
 #include <iostream>
 
 using namespace boost;
 
+// Requests read ahead of the one being answered
+constexpr size_t MAX_PIPELINE = 16;
+// Times one request is sent again after its upstream connection failed
+constexpr unsigned MAX_RETRIES = 2;
+// How long a request may wait for the upstream's circuit breaker to let it
+// through before it's answered with a 503, and how often it asks again
+constexpr std::chrono::milliseconds MAX_BREAKER_WAIT{100};
+constexpr std::chrono::milliseconds BREAKER_RECHECK{1};
+
+#include "Cache.h"
+#include "Compression.h"
+#include "Fleet.h"
+#include "Hedge.h"
+#include "Metrics.h"
+#include "Overload.h"
+#include "Shaper.h"
 #include "Socket.h"
+#include "Trace.h"
+#include "Upgrade.h"
+#include "Usdt.h"
 #include "utils.h"
 
-Socket::Socket(asio::io_context &io_context, asio::ip::tcp::socket &&socket)
-    : strand{asio::make_strand(io_context)},
+// "GET /index.html HTTP/1.1", as trace spans name the exchange
+static std::string_view request_line(const Exchange &exchange) {
+  return std::string_view{exchange.request}.substr(
+      0, exchange.request.find("\r\n"));
+}
+
+Socket::Socket(asio::io_context &io_context, Stream &&socket,
+               std::shared_ptr<const Config> config, Cluster *cluster,
+               ClientLimits::Ticket client)
+    : io_context{io_context},
+      strand{socket.get_executor()},
       resolver{strand},
+      config{std::move(config)},
+      cluster{cluster},
+      client{std::move(client)},
       client_socket{std::move(socket)},
       server_socket{strand},
-      timeout{std::chrono::seconds(15)},
+      timeout{this->config->timeout},
       timer{strand, timeout},
-      stopped{false} {}
+      hedge_timer{strand},
+      breaker_timer{strand},
+      shape_timer{strand},
+      trace_id{Trace::sample()},
+      created_at{std::chrono::steady_clock::now()},
+      stopped{false} {
+  Overload::connection_opened();
+}
+
+Socket::~Socket() {
+  trace("connection", created_at);
+  PROXY_PROBE2(close, this,
+               std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - created_at)
+                   .count());
+  Overload::connection_closed();
+}
 
 void Socket::start() {
   auto self(shared_from_this());
   timer.async_wait(
       std::bind(&Socket::handle_wait, this, asio::placeholders::error, self));
-  get_message_from_client();
+  pump();
 }
 
 void Socket::handle_wait(const system::error_code &ec,
@@ -39,6 +87,7 @@ void Socket::handle_wait(const system::error_code &ec,
     }
   } else if (ec.value() == asio::error::operation_aborted) {
     // If cancelled, restart the timeout duration
+    timer.expires_after(timeout);
     timer.async_wait(
         std::bind(&Socket::handle_wait, this, asio::placeholders::error, self));
   } else {
@@ -46,18 +95,86 @@ void Socket::handle_wait(const system::error_code &ec,
   }
 }
 
+void Socket::pump() {
+  if (stopped) {
+    return;
+  }
+  using Stage = Exchange::Stage;
+  for (const auto &exchange : exchanges) {
+    if (exchange->stage == Stage::QUEUED && exchange->multiplexed) {
+      send_message_multiplexed(exchange);
+    } else if (exchange->stage == Stage::DONE &&
+               exchange->encoding != Encoding::IDENTITY) {
+      compress(*exchange);
+    }
+  }
+  if (session) {
+    for (auto it = exchanges.begin(); it != exchanges.end();) {
+      if ((*it)->stage == Stage::DONE) {
+        session->respond((*it)->stream_id, (*it)->response);
+        it = exchanges.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (Upgrade::draining() && !session->going_away()) {
+      // the streams open are answered, new ones go to the new process
+      session->go_away();
+    }
+    if (!writing_client && !session->output().empty()) {
+      send_frames_to_client();
+    }
+  } else if (!writing_client && !exchanges.empty() &&
+             exchanges.front()->stage == Stage::DONE) {
+    send_message_to_client();
+  }
+  auto next = find_exchange(Stage::QUEUED);
+  if (next && !writing_server && !dialing) {
+    if (server_socket.is_open() && curr_host == next->host) {
+      send_message_to_server();
+    } else if (!find_exchange(Stage::SENT)) {
+      // Another host, switch once the current one has answered everything
+      if (cluster) {
+        connect_to_cluster();
+      } else {
+        resolve_server(next->host);
+      }
+    }
+  }
+  // the responses can be read while the requests are still being written
+  if (!reading_server && find_exchange(Stage::SENT)) {
+    get_message_from_server();
+  }
+  if (!reading_client) {
+    if (client_eof || (session && session->going_away())) {
+      if (exchanges.empty() && !writing_client &&
+          (!session || session->output().empty())) {
+        close();
+      }
+    } else if (session) {
+      // flow control is what limits an HTTP/2 client
+      get_frames_from_client();
+    } else if (exchanges.size() < MAX_PIPELINE) {
+      get_message_from_client();
+    }
+  }
+}
+
+std::shared_ptr<Exchange> Socket::find_exchange(Exchange::Stage stage) const {
+  for (const auto &exchange : exchanges) {
+    if (exchange->stage == stage && !exchange->multiplexed) {
+      return exchange;
+    }
+  }
+  return nullptr;
+}
+
 void Socket::get_message_from_client() {
   auto self(shared_from_this());
-  mutex.lock();
-  messages.emplace_back(std::make_pair("", ""));
-  size_t msg_id = messages.size() - 1;
-  mutex.unlock();
-  std::string &request = messages[msg_id].first;
-  // timer.expires_after(timeout);
+  reading_client = true;
   asio::async_read_until(
-      client_socket, asio::dynamic_buffer(request), "\r\n\r\n",
-      [this, self, &request, msg_id](const system::error_code &ec,
-                                     std::size_t header_len) {
+      client_socket, asio::dynamic_buffer(client_in), "\r\n\r\n",
+      [this, self](const system::error_code &ec, std::size_t header_len) {
         timer.cancel();
         if (stopped) {
           return;
@@ -67,114 +184,215 @@ void Socket::get_message_from_client() {
             puts("kansol client");
             return;
           }
-          if (ec.value() == asio::error::eof && !header_len) {
+          if (ec.value() == asio::error::eof) {
             puts("connection closed by client");
-            close();
+            // still answer what was already asked
+            reading_client = false;
+            client_eof = true;
+            pump();
             return;
           }
           puts("OOPS CLIENT");
-          throw system::system_error{ec};
+          close();
+          return;
         }
-        std::string first_line = request.substr(0, request.find("\r\n"));
+        std::string first_line = client_in.substr(0, client_in.find("\r\n"));
         std::istringstream iss{first_line};
         std::string method, url, http_version;
         iss >> method >> url >> http_version;
+        if (method == "PRI" && url == "*" && http_version == "HTTP/2.0" &&
+            exchanges.empty()) {
+          start_http2();
+          return;
+        }
         // http_version looks like "HTTP/1.1"
         if (stod(http_version.substr(http_version.find("/") + 1)) > 1.1) {
           std::cerr << RED << "HTTP Version Not Supported" << RESET
                     << std::endl;
           return;
         }
-        const std::string header{request.substr(0, header_len)};
+        auto exchange = std::make_shared<Exchange>();
+        exchange->method = method;
+        if (!cluster && method == "GET" &&
+            (url == "/metrics" || url == "/trace")) {
+          client_in.erase(0, header_len);
+          if (url == "/metrics") {
+            serve_metrics(*exchange);
+          } else {
+            serve_trace(*exchange);
+          }
+          exchanges.push_back(exchange);
+          reading_client = false;
+          pump();
+          return;
+        }
+        const std::string header{client_in.substr(0, header_len)};
         std::cout << YELLOW << client_socket.remote_endpoint().port() << "\n"
                   << header << RESET << std::endl;
-        curr_host = parse_field(request, "host");
-        read_body(client_socket, request, header,
-                  [self, this, msg_id] { resolve_server(msg_id); });
+        if (cluster) {
+          exchange->host = cluster->name();
+        } else {
+          exchange->host = parse_field(header, "host");
+          exchange->multiplexed = Http2Upstream::speaks_h2c(exchange->host);
+        }
+        if (exchange->method != "HEAD") {
+          exchange->encoding =
+              negotiate(parse_field(header, "accept-encoding"));
+        }
+        auto header_at = std::chrono::steady_clock::now();
+        read_body(client_socket, client_in, header_len, identify_body(header),
+                  [self, this, exchange, header_at](size_t message_len) {
+                    exchange->request = client_in.substr(0, message_len);
+                    client_in.erase(0, message_len);
+                    trace("request", header_at, request_line(*exchange));
+                    PROXY_PROBE3(request__parsed, this,
+                                 exchange->method.c_str(),
+                                 exchange->host.c_str());
+                    if (client.take_request()) {
+                      route(*exchange);
+                    } else {
+                      throttle(*exchange);
+                    }
+                    exchanges.push_back(exchange);
+                    reading_client = false;
+                    pump();
+                  });
       });
 }
 
-void Socket::read_body(asio::ip::tcp::socket &socket,
-                       std::string &http_header_plus,
-                       const std::string &http_header,
-                       std::function<void()> callback) {
-  auto self(shared_from_this());
-  // I need to make an empty buffer because the
-  // header might have something like "Age: 0/r/n/r/n"
-  // causing read_until to unluckily read 0 bits
-  std::shared_ptr<std::string> http_body{std::make_shared<std::string>("")};
-  if (stopped) {
-    return;
-  }
-  Body body_type = identify_body(http_header);
+void Socket::read_body(Stream &socket, std::string &in, size_t header_len,
+                       Body body_type, std::function<void(size_t)> callback) {
   if (body_type == Body::NONE) {
-    callback();
-    return;
-  }
-  auto shared_handler = [self, callback, http_body, &http_header_plus](
-                            const system::error_code &ec, std::size_t bytes) {
-    http_header_plus.append(*http_body);
-    if (!ec) {
-      callback();
-    } else if (ec.value() == asio::error::eof) {
-      // puts("body EOF");
-    } else if (ec.value() == asio::error::operation_aborted) {
-      // puts("body ABORRR");
+    callback(header_len);
+  } else if (body_type == Body::CONTENT_LENGTH) {
+    size_t body_len = 0;
+    content_length(in.substr(0, header_len), body_len);
+    if (body_len > SIZE_MAX - header_len) {
+      body_type = Body::INVALID;
     } else {
-      throw system::system_error{ec};
+      size_t message_len = header_len + body_len;
+      fill(socket, in, message_len,
+           [callback, message_len] { callback(message_len); });
     }
-  };
-  if (body_type == Body::CONTENT_LENGTH) {
-    auto content_length = stoul(parse_field(http_header, "content-length"));
-    size_t header_plus_len = http_header_plus.size();
-    size_t header_len = http_header.size();
-    asio::async_read(
-        socket,
-        asio::dynamic_buffer(*http_body,
-                             content_length - (header_plus_len - header_len)),
-        shared_handler);
   } else if (body_type == Body::CHUNKED) {
-    // might have already read the whole body
-    if (http_header_plus.find("0\r\n\r\n", http_header.size()) !=
-        std::string::npos) {
-      callback();
+    read_chunks(socket, in, header_len, callback);
+  }
+  if (body_type == Body::INVALID) {
+    std::cerr << RED << "Ambiguous message length" << RESET << std::endl;
+    if (&socket == &client_socket) {
+      bad_request();
     } else {
-      asio::async_read_until(socket, asio::dynamic_buffer(*http_body),
-                             "0\r\n\r\n", shared_handler);
+      close();
     }
   }
 }
 
-void Socket::resolve_server(size_t msg_id) {
+void Socket::read_chunks(Stream &socket, std::string &in, size_t pos,
+                         std::function<void(size_t)> callback) {
+  Chunks walk = skip_chunks(in, pos);
+  if (walk == Chunks::COMPLETE) {
+    callback(pos);
+    return;
+  }
+  if (walk == Chunks::MALFORMED) {
+    std::cerr << RED << "Malformed chunk size" << RESET << std::endl;
+    if (&socket == &client_socket) {
+      bad_request();
+    } else {
+      close();
+    }
+    return;
+  }
   auto self(shared_from_this());
-  if (server_socket.is_open() && prev_host == curr_host) {
-    send_message_to_server(msg_id);
+  fill(socket, in, in.size() + 1, [self, this, &socket, &in, pos, callback] {
+    read_chunks(socket, in, pos, callback);
+  });
+}
+
+void Socket::fill(Stream &socket, std::string &in, size_t n,
+                  std::function<void()> callback) {
+  if (in.size() >= n) {
+    callback();
     return;
   }
+  auto self(shared_from_this());
+  asio::async_read(socket, asio::dynamic_buffer(in),
+                   asio::transfer_at_least(n - in.size()),
+                   [self, this, callback](const system::error_code &ec,
+                                          std::size_t) {
+                     if (stopped) {
+                       return;
+                     }
+                     if (ec) {
+                       // eof or reset halfway through a body
+                       close();
+                       return;
+                     }
+                     callback();
+                   });
+}
+
+void Socket::resolve_server(const std::string &host_field) {
+  auto self(shared_from_this());
+  dialing = true;
+  curr_host = host_field;
+  server_in.clear();
+  phase_start = std::chrono::steady_clock::now();
+  auto [host, port] = split_host_port(curr_host);
   resolver.async_resolve(
-      curr_host, "http",
-      [self, this, msg_id](const system::error_code &ec,
-                           asio::ip::tcp::resolver::results_type endpoints) {
+      host, port,
+      [self, this](const system::error_code &ec,
+                   asio::ip::tcp::resolver::results_type endpoints) {
         if (stopped) {
           return;
         }
+        record_phase(Phase::DNS,
+                     std::chrono::steady_clock::now() - phase_start);
+        trace("dns", phase_start, curr_host);
         if (ec) {
           std::cout << RED << ec.message() << ". "
                     << "Host: [" << curr_host << "] " << RESET << std::endl;
           close();
         } else {
-          connect_to_endpoints(msg_id, endpoints);
+          connect_to_endpoints(endpoints);
         }
       });
 }
 
+void Socket::connect_to_cluster() {
+  dialing = true;
+  curr_host = cluster->name();
+  server_in.clear();
+  upstream_endpoint = cluster->pick();
+  dial({cluster->endpoint(upstream_endpoint)});
+}
+
 void Socket::connect_to_endpoints(
-    size_t msg_id, asio::ip::tcp::resolver::results_type &endpoints) {
+    asio::ip::tcp::resolver::results_type &endpoints) {
+  dial(HappyEyeballs::interleave(endpoints));
+}
+
+void Socket::dial(std::vector<asio::ip::tcp::endpoint> endpoints) {
   auto self(shared_from_this());
-  asio::async_connect(
-      server_socket, endpoints,
-      [self, this, msg_id](const system::error_code &ec,
-                           const asio::ip::tcp::endpoint &endpoint) {
+  upstream_connection.reset();
+  breaker = CircuitBreaker::get(curr_host);
+  upstream_connection = breaker->connection(config->upstream_connections);
+  if (!upstream_connection) {
+    dialing = false;
+    reject_queued();
+    asio::post(strand, [self, this] {
+      if (!stopped) {
+        pump();
+      }
+    });
+    return;
+  }
+  phase_start = std::chrono::steady_clock::now();
+  connecting = std::make_shared<HappyEyeballs>(strand);
+  connecting->start(
+      std::move(endpoints), [self, this](const system::error_code &ec,
+                                         asio::ip::tcp::socket &&upstream) {
+        connecting.reset();
         if (stopped) {
           return;
         }
@@ -182,82 +400,746 @@ void Socket::connect_to_endpoints(
           // std::cout << RED << ec.message() << " "
           // << client_socket.remote_endpoint().port() << RESET
           // << std::endl;
+          if (cluster) {
+            cluster->record_connect(upstream_endpoint, false);
+            // another endpoint may well be up
+            if (++connect_attempts < cluster->size()) {
+              connect_to_cluster();
+              return;
+            }
+          }
           close();
         } else {
-          send_message_to_server(msg_id);
+          record_phase(Phase::CONNECT,
+                       std::chrono::steady_clock::now() - phase_start);
+          trace("connect", phase_start, curr_host);
+          PROXY_PROBE2(upstream__connected, this, curr_host.c_str());
+          if (cluster) {
+            cluster->record_connect(upstream_endpoint, true);
+            connect_attempts = 0;
+          }
+          adopt(server_socket, std::move(upstream));
+          dialing = false;
+          pump();
         }
       });
 }
 
-void Socket::send_message_to_server(size_t msg_id) {
+void Socket::send_message_to_server() {
   auto self(shared_from_this());
-  std::string &msg = messages[msg_id].first;
-  asio::async_write(server_socket, asio::buffer(msg),
-                    [self, this, msg_id](const system::error_code ec,
-                                         const std::size_t bytes) {
+  // Everything queued for this host goes out in one write. The batch keeps
+  // the requests alive in case a response overtakes its own request.
+  std::vector<std::shared_ptr<Exchange>> batch;
+  std::vector<asio::const_buffer> buffers;
+  auto now = std::chrono::steady_clock::now();
+  for (const auto &exchange : exchanges) {
+    if (exchange->stage != Exchange::Stage::QUEUED || exchange->multiplexed) {
+      continue;
+    }
+    if (exchange->host != curr_host) {
+      break;
+    }
+    exchange->pending = breaker->request(exchange->retries == 0);
+    if (!exchange->pending) {
+      if (exchange->held_since == std::chrono::steady_clock::time_point{}) {
+        exchange->held_since = now;
+      }
+      if (now - exchange->held_since < MAX_BREAKER_WAIT) {
+        // the rest waits its turn behind this one
+        wait_for_breaker();
+        break;
+      }
+      reject(*exchange);
+      continue;
+    }
+    exchange->stage = Exchange::Stage::SENT;
+    exchange->sent_at = now;
+    if (cluster) {
+      exchange->lease = EndpointLease{cluster, upstream_endpoint};
+    }
+    batch.push_back(exchange);
+    buffers.push_back(asio::buffer(exchange->request));
+  }
+  if (batch.empty()) {
+    if (!waiting_for_breaker) {
+      // all of them were turned away
+      pump();
+    }
+    return;
+  }
+  writing_server = true;
+  asio::async_write(server_socket, buffers,
+                    [self, this, batch, now](const system::error_code ec,
+                                             const std::size_t) {
                       if (stopped) {
                         puts("Server:LET ME GOO");
                         return;
                       }
+                      if (ec == asio::error::operation_aborted) {
+                        // server_socket was closed to start over on a new
+                        // connection, the batch is queued again
+                        writing_server = false;
+                        pump();
+                        return;
+                      }
+                      writing_server = false;
                       if (ec) {
                         puts("BLA");
-                        throw boost::system::system_error{ec};
+                        if (!retry_sent()) {
+                          close();
+                        }
+                        return;
                       }
-                      get_message_from_server(msg_id);
+                      trace("write_request", now);
+                      pump();
                     });
 }
 
-void Socket::get_message_from_server(size_t msg_id) {
+void Socket::send_message_multiplexed(std::shared_ptr<Exchange> exchange) {
   auto self(shared_from_this());
-  std::string &reply = messages[msg_id].second;
+  exchange->stage = Exchange::Stage::SENT;
+  exchange->sent_at = std::chrono::steady_clock::now();
+  Http2Upstream::get(io_context, exchange->host)
+      ->submit(exchange->request, strand,
+               [self, this, exchange](const system::error_code &ec,
+                                      std::string &&response) {
+                 if (stopped) {
+                   return;
+                 }
+                 if (ec) {
+                   std::cerr << RED << ec.message() << ". "
+                             << "Host: [" << exchange->host << "] " << RESET
+                             << std::endl;
+                   close();
+                   return;
+                 }
+                 // the response arrives whole, TTFB covers all of it
+                 exchange->header_at = std::chrono::steady_clock::now();
+                 record_phase(Phase::TTFB,
+                              exchange->header_at - exchange->sent_at);
+                 trace("ttfb", exchange->sent_at, request_line(*exchange));
+                 // the client may have hung up while the origin answered
+                 system::error_code ignored;
+                 std::cout << GREEN
+                           << client_socket.remote_endpoint(ignored).port()
+                           << "\n"
+                           << response.substr(0, response.find("\r\n\r\n"))
+                           << RESET << std::endl;
+                 PROXY_PROBE3(
+                     response__headers, this,
+                     std::atoi(response.c_str() + response.find(' ') + 1),
+                     exchange->host.c_str());
+                 exchange->response = std::move(response);
+                 exchange->stage = Exchange::Stage::DONE;
+                 if (!exchange->cache_key.empty()) {
+                   ResponseCache::store(exchange->cache_key,
+                                        exchange->response);
+                 }
+                 pump();
+               });
+}
+
+void Socket::get_message_from_server() {
+  auto self(shared_from_this());
+  auto exchange = find_exchange(Exchange::Stage::SENT);
+  reading_server = true;
+  arm_hedge(exchange);
   asio::async_read_until(
-      server_socket, asio::dynamic_buffer(reply), "\r\n\r\n",
-      [self, this, msg_id, &reply](system::error_code ec,
-                                   std::size_t header_len) {
+      server_socket, asio::dynamic_buffer(server_in), "\r\n\r\n",
+      asio::bind_cancellation_slot(
+          server_cancel.slot(),
+          [self, this, exchange](system::error_code ec,
+                                 std::size_t header_len) {
+            if (stopped) {
+              return;
+            }
+            if (!ec && exchange->stage != Exchange::Stage::SENT) {
+              // the hedge answered first and this connection is being dropped
+              ec = asio::error::operation_aborted;
+            }
+            if (hedged == exchange) {
+              // first come first served, the hedge is abandoned
+              hedged.reset();
+              hedge_timer.cancel();
+              hedge_cancel.emit(asio::cancellation_type::terminal);
+            }
+            if (ec) {
+              reading_server = false;
+              if (ec.value() == asio::error::operation_aborted) {
+                // server_socket was closed to start over, see retry_sent()
+                puts("kansol server");
+                pump();
+                return;
+              }
+              if (ec.value() == asio::error::eof) {
+                puts("connection closed by server");
+              } else {
+                std::cerr << ec.message() << std::endl;
+              }
+              if (!retry_sent()) {
+                close();
+              }
+              return;
+            }
+            timer.cancel();
+            if (exchange->response.empty()) {
+              exchange->header_at = std::chrono::steady_clock::now();
+              record_phase(Phase::TTFB,
+                           exchange->header_at - exchange->sent_at);
+              trace("ttfb", exchange->sent_at, request_line(*exchange));
+            }
+            const std::string header{server_in.substr(0, header_len)};
+            std::cout << GREEN << client_socket.remote_endpoint().port()
+                      << "\n"
+                      << header << RESET << std::endl;
+            // "HTTP/1.1 200 OK"
+            int status = std::atoi(header.c_str() + header.find(' ') + 1);
+            PROXY_PROBE3(response__headers, this, status,
+                         exchange->host.c_str());
+            bool bodyless = exchange->method == "HEAD" || status / 100 == 1 ||
+                            status == 204 || status == 304;
+            read_body(
+                server_socket, server_in, header_len,
+                bodyless ? Body::NONE : identify_body(header),
+                [self, this, exchange, status, header](size_t message_len) {
+                  exchange->response.append(server_in, 0, message_len);
+                  server_in.erase(0, message_len);
+                  if (status / 100 == 1 && status != 101) {
+                    // interim response, the final one follows
+                    get_message_from_server();
+                    return;
+                  }
+                  exchange->stage = Exchange::Stage::DONE;
+                  trace("body", exchange->header_at, request_line(*exchange));
+                  exchange->lease.finish(
+                      status, exchange->header_at - exchange->sent_at);
+                  breaker->record_rtt(exchange->header_at -
+                                      exchange->sent_at);
+                  exchange->pending.reset();
+                  exchange->retry.reset();
+                  if (!exchange->cache_key.empty()) {
+                    ResponseCache::store(exchange->cache_key,
+                                         exchange->response);
+                  }
+                  if (find_ci(parse_field(header, "connection"), "close")) {
+                    // The server won't answer the rest of the pipeline, send
+                    // it again on a new connection
+                    for (const auto &pending : exchanges) {
+                      if (pending->stage == Exchange::Stage::SENT &&
+                          !pending->multiplexed) {
+                        pending->stage = Exchange::Stage::QUEUED;
+                        pending->response.clear();
+                        pending->lease.release();
+                        pending->pending.reset();
+                      }
+                    }
+                    server_socket.close();
+                  }
+                  reading_server = false;
+                  pump();
+                });
+          }));
+}
+
+void Socket::send_message_to_client() {
+  auto self(shared_from_this());
+  // every finished response at the front goes out in one write
+  std::vector<std::shared_ptr<Exchange>> batch;
+  std::vector<asio::const_buffer> buffers;
+  for (const auto &exchange : exchanges) {
+    if (exchange->stage != Exchange::Stage::DONE) {
+      break;
+    }
+    batch.push_back(exchange);
+  }
+  // After an upgrade the client should reconnect to the new process, once
+  // it has every answer it asked for
+  bool last = Upgrade::draining() && batch.size() == exchanges.size();
+  if (last) {
+    auto &response = batch.back()->response;
+    std::string header = response.substr(0, response.find("\r\n\r\n") + 4);
+    if (!find_ci(parse_field(header, "connection"), "close")) {
+      response.insert(response.find("\r\n") + 2, "Connection: close\r\n");
+    }
+  }
+  for (const auto &exchange : batch) {
+    buffers.push_back(asio::buffer(exchange->response));
+  }
+  writing_client = true;
+  write_to_client(std::move(buffers), [self, this, batch, last] {
+    auto now = std::chrono::steady_clock::now();
+    for (const auto &exchange : batch) {
+      // answered by the proxy itself
+      if (exchange->host.empty()) {
+        continue;
+      }
+      record_phase(Phase::TRANSFER, now - exchange->header_at);
+    }
+    exchanges.erase(exchanges.begin(), exchanges.begin() + batch.size());
+    writing_client = false;
+    if (last) {
+      close();
+      return;
+    }
+    pump();
+  });
+}
+
+void Socket::write_to_client(std::vector<asio::const_buffer> buffers,
+                             std::function<void()> written) {
+  auto self(shared_from_this());
+  if (trace_id) {
+    written = [this, written, begin = std::chrono::steady_clock::now()] {
+      trace("write_response", begin);
+      written();
+    };
+  }
+  if (!Shaper::enabled() && !ClientLimits::limits_bandwidth()) {
+    asio::async_write(client_socket, buffers,
+                      [self, this, written](const system::error_code &ec,
+                                            std::size_t) {
+                        if (stopped) {
+                          return;
+                        }
+                        if (ec) {
+                          close();
+                          return;
+                        }
+                        written();
+                      });
+    return;
+  }
+  write_slice(
+      std::make_shared<std::vector<asio::const_buffer>>(std::move(buffers)),
+      std::move(written));
+}
+
+void Socket::write_slice(
+    std::shared_ptr<std::vector<asio::const_buffer>> buffers,
+    std::function<void()> written) {
+  auto self(shared_from_this());
+  if (stopped) {
+    return;
+  }
+  if (buffers->empty()) {
+    written();
+    return;
+  }
+  std::vector<asio::const_buffer> slice;
+  size_t bytes = 0;
+  for (const auto &buffer : *buffers) {
+    if (bytes == Shaper::QUANTUM) {
+      break;
+    }
+    slice.push_back(asio::buffer(buffer, Shaper::QUANTUM - bytes));
+    bytes += slice.back().size();
+  }
+  if (auto wait = client.take_bytes(bytes); wait.count()) {
+    // the client is over its own rate, no use queueing for the global one
+    shape_timer.expires_after(wait);
+    shape_timer.async_wait(
+        [self, this, buffers, written](const system::error_code &ec) {
+          if (!ec) {
+            write_slice(buffers, written);
+          }
+        });
+    return;
+  }
+  Shaper::request(flow, bytes, [self, this, buffers, written, slice] {
+    asio::dispatch(strand, [self, this, buffers, written, slice] {
+      if (stopped) {
+        return;
+      }
+      asio::async_write(
+          client_socket, slice,
+          [self, this, buffers, written](const system::error_code &ec,
+                                         std::size_t bytes) {
+            if (stopped) {
+              return;
+            }
+            if (ec) {
+              close();
+              return;
+            }
+            auto done = buffers->begin();
+            for (; done != buffers->end() && done->size() <= bytes; ++done) {
+              bytes -= done->size();
+            }
+            buffers->erase(buffers->begin(), done);
+            if (bytes) {
+              buffers->front() += bytes;
+            }
+            // a download held back by shaping isn't an idle connection
+            timer.cancel();
+            write_slice(buffers, written);
+          });
+    });
+  });
+}
+
+void Socket::start_http2() {
+  system::error_code ignored;
+  std::cout << BLU << "HTTP/2 on port "
+            << client_socket.remote_endpoint(ignored).port() << RESET
+            << std::endl;
+  // the session consumes the preface itself
+  session = std::make_unique<Http2Session>(
+      [this](uint32_t stream_id, std::string &&request) {
+        queue_stream(stream_id, std::move(request));
+      });
+  if (!session->receive(client_in)) {
+    client_eof = true;
+  }
+  reading_client = false;
+  pump();
+}
+
+void Socket::queue_stream(uint32_t stream_id, std::string &&request) {
+  auto exchange = std::make_shared<Exchange>();
+  exchange->stream_id = stream_id;
+  exchange->method = request.substr(0, request.find(' '));
+  const std::string header{request.substr(0, request.find("\r\n\r\n") + 4)};
+  // origin-form only when the client left out :authority
+  if (!cluster && request.compare(0, 13, "GET /metrics ") == 0) {
+    serve_metrics(*exchange);
+    exchanges.push_back(exchange);
+    return;
+  }
+  if (!cluster && request.compare(0, 11, "GET /trace ") == 0) {
+    serve_trace(*exchange);
+    exchanges.push_back(exchange);
+    return;
+  }
+  // streams keep coming in from a buffer after the client has hung up
+  system::error_code ignored;
+  std::cout << YELLOW << client_socket.remote_endpoint(ignored).port()
+            << " stream " << stream_id << "\n"
+            << header << RESET << std::endl;
+  if (cluster) {
+    exchange->host = cluster->name();
+  } else {
+    exchange->host = parse_field(header, "host");
+    exchange->multiplexed = Http2Upstream::speaks_h2c(exchange->host);
+  }
+  if (exchange->method != "HEAD") {
+    exchange->encoding = negotiate(parse_field(header, "accept-encoding"));
+  }
+  exchange->request = std::move(request);
+  PROXY_PROBE3(request__parsed, this, exchange->method.c_str(),
+               exchange->host.c_str());
+  if (client.take_request()) {
+    route(*exchange);
+  } else {
+    throttle(*exchange);
+  }
+  exchanges.push_back(exchange);
+}
+
+void Socket::route(Exchange &exchange) {
+  if (cluster || exchange.method != "GET" ||
+      (!ResponseCache::enabled() && !Fleet::enabled())) {
+    return;
+  }
+  size_t url_beg = exchange.request.find(' ') + 1;
+  std::string url = exchange.request.substr(
+      url_beg, exchange.request.find(' ', url_beg) - url_beg);
+  if (!url.empty() && url[0] == '/') {
+    url = "http://" + exchange.host + url;
+  }
+  if (!Fleet::take_hop(exchange.request)) {
+    if (const std::string *owner = Fleet::owner(url)) {
+      // The owner is a proxy as well, the request goes to it unchanged
+      Fleet::mark_hop(exchange.request);
+      exchange.host = *owner;
+      exchange.multiplexed = false;
+      return;
+    }
+  }
+  if (exchange.encoding != Encoding::IDENTITY &&
+      ResponseCache::lookup(variant_key(url, exchange.encoding),
+                            exchange.response)) {
+    add_vary(exchange.response);
+    exchange.encoding = Encoding::IDENTITY;
+    exchange.host.clear();
+    exchange.stage = Exchange::Stage::DONE;
+    return;
+  }
+  if (ResponseCache::lookup(url, exchange.response)) {
+    // answered by the proxy itself, like /metrics
+    exchange.host.clear();
+    exchange.stage = Exchange::Stage::DONE;
+    return;
+  }
+  const std::string header{
+      exchange.request.substr(0, exchange.request.find("\r\n\r\n") + 4)};
+  if (parse_field(header, "authorization").empty()) {
+    exchange.cache_key = url;
+  }
+}
+
+void Socket::get_frames_from_client() {
+  auto self(shared_from_this());
+  reading_client = true;
+  asio::async_read(
+      client_socket, asio::dynamic_buffer(client_in),
+      asio::transfer_at_least(1),
+      [self, this](const system::error_code &ec, std::size_t) {
+        timer.cancel();
         if (stopped) {
           return;
         }
         if (ec) {
           if (ec.value() == asio::error::operation_aborted) {
-            puts("kansol server");
-            return;
-          }
-          if (ec.value() == asio::error::eof && !header_len) {
-            puts("connection closed by server");
             return;
           }
-          if (ec.value() == asio::error::connection_reset) {
-            std::cerr << ec.message() << std::endl;
-            close();
+          if (ec.value() == asio::error::eof) {
+            puts("connection closed by client");
+            reading_client = false;
+            client_eof = true;
+            pump();
             return;
           }
-          puts("OOPS SERVER");
-          throw system::system_error{ec};
+          close();
+          return;
         }
-        const std::string header{reply.substr(0, header_len)};
-        std::cout << GREEN << client_socket.remote_endpoint().port() << "\n"
-                  << header << RESET << std::endl;
-        read_body(server_socket, reply, header,
-                  [self, this, msg_id] { send_message_to_client(msg_id); });
+        // new streams only become exchanges here, pump() picks them up below
+        if (!session->receive(client_in)) {
+          // a GOAWAY is waiting in the output, leave once it's written
+          std::cerr << RED << "HTTP/2 protocol error" << RESET << std::endl;
+          client_eof = true;
+          exchanges.clear();
+        }
+        reading_client = false;
+        pump();
       });
 }
 
-void Socket::send_message_to_client(size_t msg_id) {
+void Socket::send_frames_to_client() {
   auto self(shared_from_this());
-  std::string &msg = messages[msg_id].second;
-  asio::async_write(client_socket, asio::buffer(msg),
-                    [self, this, msg_id, &msg](const system::error_code &ec,
-                                               std::size_t bytes) {
-                      if (stopped) {
-                        return;
-                      }
-                      if (ec) {
-                        puts("BLE");
-                        throw boost::system::system_error{ec};
-                      }
-                      prev_host = curr_host;
-                      get_message_from_client();
-                    });
+  auto frames = std::make_shared<std::string>();
+  frames->swap(session->output());
+  writing_client = true;
+  write_to_client({asio::buffer(*frames)}, [self, this, frames] {
+    writing_client = false;
+    pump();
+  });
+}
+
+void Socket::wait_for_breaker() {
+  if (waiting_for_breaker) {
+    return;
+  }
+  auto self(shared_from_this());
+  waiting_for_breaker = true;
+  breaker_timer.expires_after(BREAKER_RECHECK);
+  breaker_timer.async_wait([self, this](const system::error_code &ec) {
+    waiting_for_breaker = false;
+    if (stopped || ec) {
+      return;
+    }
+    pump();
+  });
+}
+
+void Socket::arm_hedge(const std::shared_ptr<Exchange> &exchange) {
+  if (!cluster || cluster->size() < 2 || hedged || exchange->retries ||
+      !exchange->response.empty() ||
+      (exchange->method != "GET" && exchange->method != "HEAD")) {
+    return;
+  }
+  auto delay = cluster->hedge_delay();
+  if (delay.count() == 0) {
+    return;
+  }
+  auto self(shared_from_this());
+  hedged = exchange;
+  hedge_timer.expires_at(exchange->sent_at + delay);
+  hedge_timer.async_wait([self, this, exchange](const system::error_code &ec) {
+    if (stopped || ec || hedged != exchange) {
+      return;
+    }
+    send_hedge(exchange);
+  });
+}
+
+void Socket::send_hedge(const std::shared_ptr<Exchange> &exchange) {
+  auto self(shared_from_this());
+  size_t endpoint = cluster->pick_other(upstream_endpoint);
+  if (endpoint == cluster->size()) {
+    // an ejected endpoint wouldn't answer any sooner
+    hedged.reset();
+    return;
+  }
+  // shared, the callback has to be copyable
+  auto lease = std::make_shared<EndpointLease>(cluster, endpoint);
+  auto started = std::chrono::steady_clock::now();
+  std::make_shared<Hedge>(strand, hedge_cancel.slot())
+      ->start(cluster->endpoint(endpoint), exchange->request,
+              exchange->method == "HEAD",
+              [self, this, exchange, lease, started](
+                  const system::error_code &ec, std::string &&response) {
+                if (stopped || hedged != exchange ||
+                    exchange->stage != Exchange::Stage::SENT) {
+                  return;
+                }
+                hedged.reset();
+                if (ec) {
+                  // the first copy may still make it
+                  return;
+                }
+                auto now = std::chrono::steady_clock::now();
+                // "HTTP/1.1 200 OK"
+                int status =
+                    std::atoi(response.c_str() + response.find(' ') + 1);
+                lease->finish(status, now - started);
+                use_hedge(*exchange, std::move(response));
+              });
+}
+
+void Socket::use_hedge(Exchange &exchange, std::string &&response) {
+  // Dropping server_socket loses whatever else was sent on it, which has to
+  // be safe to send again
+  for (const auto &other : exchanges) {
+    if (other.get() != &exchange && other->stage == Exchange::Stage::SENT &&
+        !other->multiplexed && !idempotent(other->method)) {
+      return;
+    }
+  }
+  for (const auto &other : exchanges) {
+    if (other.get() != &exchange && other->stage == Exchange::Stage::SENT &&
+        !other->multiplexed) {
+      other->stage = Exchange::Stage::QUEUED;
+      other->response.clear();
+      other->lease.release();
+      other->pending.reset();
+    }
+  }
+  exchange.header_at = std::chrono::steady_clock::now();
+  record_phase(Phase::TTFB, exchange.header_at - exchange.sent_at);
+  trace("hedge", exchange.sent_at, request_line(exchange));
+  exchange.response = std::move(response);
+  exchange.stage = Exchange::Stage::DONE;
+  exchange.lease.release();
+  exchange.pending.reset();
+  exchange.retry.reset();
+  server_cancel.emit(asio::cancellation_type::terminal);
+  // the first copy is still being answered on it
+  server_socket.close();
+  server_in.clear();
+  pump();
+}
+
+bool Socket::retry_sent() {
+  std::vector<std::shared_ptr<Exchange>> sent;
+  std::vector<CircuitBreaker::Slot> slots;
+  for (const auto &exchange : exchanges) {
+    if (exchange->stage != Exchange::Stage::SENT || exchange->multiplexed) {
+      continue;
+    }
+    // part of a response may have been relayed already
+    if (!idempotent(exchange->method) || !exchange->response.empty() ||
+        exchange->retries == MAX_RETRIES) {
+      return false;
+    }
+    slots.push_back(breaker->retry());
+    if (!slots.back()) {
+      return false;
+    }
+    sent.push_back(exchange);
+  }
+  if (sent.empty()) {
+    return false;
+  }
+  // the retry goes out on its own, it doesn't need the hedge
+  hedged.reset();
+  hedge_timer.cancel();
+  hedge_cancel.emit(asio::cancellation_type::terminal);
+  for (size_t i = 0; i < sent.size(); ++i) {
+    sent[i]->stage = Exchange::Stage::QUEUED;
+    sent[i]->lease.release();
+    sent[i]->pending.reset();
+    sent[i]->retry = std::move(slots[i]);
+    ++sent[i]->retries;
+  }
+  server_in.clear();
+  // whatever is still reading or writing on it finishes with
+  // operation_aborted and pumps
+  server_socket.close();
+  pump();
+  return true;
+}
+
+void Socket::reject_queued() {
+  for (const auto &exchange : exchanges) {
+    if (exchange->stage == Exchange::Stage::QUEUED &&
+        !exchange->multiplexed && exchange->host == curr_host) {
+      reject(*exchange);
+    }
+  }
+}
+
+void Socket::reject(Exchange &exchange) {
+  exchange.response =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\n"
+      "X-Proxy-Overflow: circuit breaker\r\n\r\n";
+  exchange.stage = Exchange::Stage::DONE;
+}
+
+void Socket::bad_request() {
+  // nothing after it can be framed, answer what came before and close
+  auto exchange = std::make_shared<Exchange>();
+  exchange->response =
+      "HTTP/1.1 400 Bad Request\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n";
+  exchange->stage = Exchange::Stage::DONE;
+  exchanges.push_back(exchange);
+  client_in.clear();
+  client_eof = true;
+  reading_client = false;
+  pump();
+}
+
+void Socket::throttle(Exchange &exchange) {
+  exchange.response =
+      "HTTP/1.1 429 Too Many Requests\r\n"
+      "Content-Length: 0\r\n"
+      "Retry-After: 1\r\n\r\n";
+  exchange.stage = Exchange::Stage::DONE;
+}
+
+void Socket::compress(Exchange &exchange) {
+  Encoding encoding = exchange.encoding;
+  // only tried once, pump() runs many times while the response waits
+  exchange.encoding = Encoding::IDENTITY;
+  if (!compress_response(exchange.response, encoding)) {
+    return;
+  }
+  if (!exchange.cache_key.empty()) {
+    // compressed once per object, later hits get this copy from route()
+    ResponseCache::store(variant_key(exchange.cache_key, encoding),
+                         exchange.response);
+  }
+  add_vary(exchange.response);
+}
+
+void Socket::serve_metrics(Exchange &exchange) {
+  std::string body = render_metrics();
+  exchange.response = "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " +
+                      std::to_string(body.size()) + "\r\n\r\n" + body;
+  exchange.stage = Exchange::Stage::DONE;
+}
+
+void Socket::serve_trace(Exchange &exchange) {
+  std::string body = Trace::render();
+  exchange.response = "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: application/json\r\n"
+                      "Content-Length: " +
+                      std::to_string(body.size()) + "\r\n\r\n" + body;
+  exchange.stage = Exchange::Stage::DONE;
 }
 
 // TODO Do I need mutexes?
@@ -271,6 +1153,13 @@ void Socket::close() {
   stopped = true;
   mutex.unlock();
   timer.cancel();
+  hedge_timer.cancel();
+  hedge_cancel.emit(asio::cancellation_type::terminal);
+  breaker_timer.cancel();
+  shape_timer.cancel();
+  if (connecting) {
+    connecting->cancel();
+  }
   if (server_socket.is_open()) {
     // server_socket.shutdown(asio::socket_base::shutdown_both);
     server_socket.cancel();
@@ -0,0 +1,141 @@
+#include "Threads.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+// Where the cgroup filesystem of the given type is mounted, "" if nowhere.
+// For v1 `option` picks the hierarchy with the cpu controller.
+static std::string cgroup_mount(const std::string &fs_type,
+                                const std::string &option) {
+  std::ifstream mountinfo{"/proc/self/mountinfo"};
+  std::string line;
+  while (std::getline(mountinfo, line)) {
+    // "36 25 0:31 / /sys/fs/cgroup/cpu rw,... - cgroup cgroup rw,cpu,cpuacct"
+    auto dash = line.find(" - ");
+    if (dash == std::string::npos) {
+      continue;
+    }
+    std::istringstream before{line.substr(0, dash)};
+    std::istringstream after{line.substr(dash + 3)};
+    std::string skip, mount_point, type, source, options;
+    before >> skip >> skip >> skip >> skip >> mount_point;
+    after >> type >> source >> options;
+    if (type != fs_type) {
+      continue;
+    }
+    if (option.empty() || ("," + options + ",").find("," + option + ",") !=
+                              std::string::npos) {
+      return mount_point;
+    }
+  }
+  return "";
+}
+
+// Our cgroup path in the hierarchy, v2 has id 0, v1 lists its controllers
+static std::string cgroup_path(const std::string &controller) {
+  std::ifstream cgroup{"/proc/self/cgroup"};
+  std::string line;
+  while (std::getline(cgroup, line)) {
+    auto first = line.find(':');
+    auto second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      continue;
+    }
+    std::string controllers = line.substr(first + 1, second - first - 1);
+    if (controller.empty() ? line.compare(0, 3, "0::") == 0
+                           : ("," + controllers + ",").find(
+                                 "," + controller + ",") != std::string::npos) {
+      return line.substr(second + 1);
+    }
+  }
+  return "";
+}
+
+// Quota / period in CPUs, 0 when unlimited or unknown
+static double read_quota(const std::string &quota_file,
+                         const std::string &period_file) {
+  std::ifstream quota_in{quota_file};
+  std::string quota;
+  long period = 0;
+  if (!(quota_in >> quota)) {
+    return 0;
+  }
+  if (period_file.empty()) {
+    // cgroup v2 cpu.max is "$MAX $PERIOD"
+    quota_in >> period;
+  } else {
+    std::ifstream{period_file} >> period;
+  }
+  if (quota == "max" || quota == "-1" || period <= 0) {
+    return 0;
+  }
+  return std::stod(quota) / period;
+}
+
+// Smallest quota set on our cgroup or any of its ancestors
+static double cgroup_cpu_limit() {
+  double limit = 0;
+  auto tighten = [&limit](double quota) {
+    if (quota > 0 && (limit == 0 || quota < limit)) {
+      limit = quota;
+    }
+  };
+  std::string root = cgroup_mount("cgroup2", "");
+  std::string path = cgroup_path("");
+  if (!root.empty() && !path.empty()) {
+    for (;;) {
+      tighten(read_quota(root + path + "/cpu.max", ""));
+      if (path.empty() || path == "/") {
+        break;
+      }
+      path = path.substr(0, path.rfind('/'));
+    }
+  }
+  root = cgroup_mount("cgroup", "cpu");
+  path = cgroup_path("cpu");
+  if (!root.empty()) {
+    // A container usually sees its own cgroup mounted as the root
+    tighten(read_quota(root + path + "/cpu.cfs_quota_us",
+                       root + path + "/cpu.cfs_period_us"));
+    tighten(read_quota(root + "/cpu.cfs_quota_us",
+                       root + "/cpu.cfs_period_us"));
+  }
+  return limit;
+}
+
+std::size_t available_cpus() {
+  std::size_t cpus = std::max<std::size_t>(1, allowed_cpus().size());
+  double limit = cgroup_cpu_limit();
+  if (limit > 0) {
+    // A quota of 2.5 CPUs still keeps 3 threads busy part of the time
+    cpus = std::min<std::size_t>(cpus, std::ceil(limit));
+  }
+  return std::max<std::size_t>(1, cpus);
+}
+
+bool pin_current_thread(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
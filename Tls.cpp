@@ -0,0 +1,228 @@
+#include "Tls.h"
+
+#include <openssl/err.h>
+
+#include <boost/asio/ssl/error.hpp>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <iostream>
+
+#include "Metrics.h"
+#include "utils.h"
+
+using namespace boost;
+
+// Sessions the shared ID cache keeps, and for how long
+constexpr long SESSION_CACHE_SIZE = 20000;
+constexpr long SESSION_TIMEOUT = 3600;
+constexpr auto HANDSHAKE_TIMEOUT = std::chrono::seconds(15);
+
+void TlsStream::start_read(asio::mutable_buffer buffer, Handler handler) {
+  transfer(true, buffer.data(), buffer.size(), std::move(handler));
+}
+
+void TlsStream::start_write(asio::const_buffer buffer, Handler handler) {
+  // SSL_write doesn't touch the data, it just isn't declared const
+  transfer(false, const_cast<void *>(buffer.data()), buffer.size(),
+           std::move(handler));
+}
+
+void TlsStream::transfer(bool reading, void *data, std::size_t size,
+                         Handler handler) {
+  system::error_code ec;
+  int res = 0;
+  if (size) {
+    int len = static_cast<int>(std::min<std::size_t>(size, INT_MAX));
+    ERR_clear_error();
+    res = reading ? SSL_read(ssl.get(), data, len)
+                  : SSL_write(ssl.get(), data, len);
+    int error = res > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl.get(), res);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      socket.async_wait(
+          error == SSL_ERROR_WANT_READ ? asio::socket_base::wait_read
+                                       : asio::socket_base::wait_write,
+          [this, reading, data, size, handler = std::move(handler)](
+              const system::error_code &ec) mutable {
+            if (ec) {
+              std::move(handler)(ec, 0);
+              return;
+            }
+            transfer(reading, data, size, std::move(handler));
+          });
+      return;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN) {
+      ec = asio::error::eof;
+    } else if (error == SSL_ERROR_SYSCALL) {
+      ec = errno ? system::error_code{errno, system::system_category()}
+                 : asio::error::eof;
+    } else if (error != SSL_ERROR_NONE) {
+      ec = {static_cast<int>(ERR_get_error()), asio::error::get_ssl_category()};
+    }
+  }
+  std::size_t n = res > 0 ? res : 0;
+  asio::post(socket.get_executor(),
+             [handler = std::move(handler), ec, n]() mutable {
+               std::move(handler)(ec, n);
+             });
+}
+
+static int select_alpn(SSL *, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *) {
+  // preference order, h2 first
+  static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+  unsigned char *selected;
+  if (SSL_select_next_proto(&selected, outlen, protocols,
+                            sizeof(protocols) - 1, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+asio::ssl::context make_tls_context(const std::string &cert_file,
+                                    const std::string &key_file) {
+  asio::ssl::context context{asio::ssl::context::tls_server};
+  context.set_options(asio::ssl::context::default_workarounds |
+                      asio::ssl::context::no_sslv2 |
+                      asio::ssl::context::no_sslv3 |
+                      asio::ssl::context::no_tlsv1 |
+                      asio::ssl::context::no_tlsv1_1);
+  context.use_certificate_chain_file(cert_file);
+  context.use_private_key_file(key_file, asio::ssl::context::pem);
+
+  SSL_CTX *ctx = context.native_handle();
+  // kTLS wants the record layer to itself, so no renegotiation either. A
+  // client that just drops the connection is an ordinary EOF.
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                               SSL_OP_IGNORE_UNEXPECTED_EOF);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                            SSL_MODE_RELEASE_BUFFERS);
+  // Resumption, by session ID from the shared cache or by ticket. Tickets
+  // are sealed with keys OpenSSL keeps in the context, one ticket per full
+  // handshake is plenty for a proxy.
+  static const unsigned char session_context[] = "http-proxy";
+  SSL_CTX_set_session_id_context(ctx, session_context,
+                                 sizeof(session_context) - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+  SSL_CTX_set_num_tickets(ctx, 1);
+  SSL_CTX_set_alpn_select_cb(ctx, select_alpn, nullptr);
+  return context;
+}
+
+namespace {
+
+struct TlsHandshake : public std::enable_shared_from_this<TlsHandshake> {
+  using Callback =
+      std::function<void(const system::error_code &, TlsStream &&)>;
+
+  TlsHandshake(asio::ssl::context &context, asio::ip::tcp::socket &&socket,
+               Callback callback)
+      : socket{std::move(socket)},
+        timer{this->socket.get_executor(), HANDSHAKE_TIMEOUT},
+        ssl{SSL_new(context.native_handle())},
+        callback{std::move(callback)},
+        start{std::chrono::steady_clock::now()} {}
+
+  ~TlsHandshake() {
+    if (ssl) {
+      SSL_free(ssl);
+    }
+  }
+
+  void run() {
+    auto self(shared_from_this());
+    system::error_code ec;
+    socket.non_blocking(true, ec);
+    // a socket BIO, so OpenSSL can hand the keys to the kernel
+    if (ec || !SSL_set_fd(ssl, socket.native_handle())) {
+      fail(ec ? ec : asio::error::invalid_argument);
+      return;
+    }
+    SSL_set_accept_state(ssl);
+    timer.async_wait([self, this](const system::error_code &ec) {
+      if (!ec) {
+        socket.close();
+      }
+    });
+    step();
+  }
+
+  void step() {
+    auto self(shared_from_this());
+    ERR_clear_error();
+    int res = SSL_do_handshake(ssl);
+    if (res == 1) {
+      finish();
+      return;
+    }
+    int error = SSL_get_error(ssl, res);
+    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+      unsigned long reason = ERR_get_error();
+      fail(reason ? system::error_code{static_cast<int>(reason),
+                                       asio::error::get_ssl_category()}
+                  : system::error_code{asio::error::eof});
+      return;
+    }
+    socket.async_wait(error == SSL_ERROR_WANT_READ
+                          ? asio::socket_base::wait_read
+                          : asio::socket_base::wait_write,
+                      [self, this](const system::error_code &ec) {
+                        if (ec) {
+                          fail(ec);
+                          return;
+                        }
+                        step();
+                      });
+  }
+
+  void finish() {
+    timer.cancel();
+    record_phase(Phase::HANDSHAKE, std::chrono::steady_clock::now() - start);
+    bool ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    bool ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    system::error_code ignored;
+    std::cout << BLU << "TLS on port " << socket.remote_endpoint(ignored).port()
+              << (SSL_session_reused(ssl) ? " resumed" : "")
+              << (ktls_send ? " kTLS-tx" : "") << (ktls_recv ? " kTLS-rx" : "")
+              << RESET << std::endl;
+    SSL *handed_over = ssl;
+    ssl = nullptr;
+    if (ktls_send && ktls_recv) {
+      // The kernel has the keys, only close_notify or a key update could
+      // still need OpenSSL and either ends the connection anyway. Marked as
+      // shut down so the session stays in the cache.
+      SSL_set_shutdown(handed_over, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      SSL_free(handed_over);
+      handed_over = nullptr;
+    }
+    callback({}, TlsStream{std::move(socket), handed_over});
+  }
+
+  void fail(const system::error_code &ec) {
+    timer.cancel();
+    socket.close();
+    callback(ec, TlsStream{socket.get_executor()});
+  }
+
+  asio::ip::tcp::socket socket;
+  asio::steady_timer timer;
+  SSL *ssl;
+  Callback callback;
+  std::chrono::steady_clock::time_point start;
+};
+
+}  // namespace
+
+void tls_handshake(asio::ssl::context &context, asio::ip::tcp::socket &&socket,
+                   std::function<void(const system::error_code &, TlsStream &&)>
+                       callback) {
+  std::make_shared<TlsHandshake>(context, std::move(socket),
+                                 std::move(callback))
+      ->run();
+}
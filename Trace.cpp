@@ -0,0 +1,128 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct Event {
+  uint64_t id;
+  const char *name;
+  std::chrono::steady_clock::time_point begin;
+  std::chrono::steady_clock::time_point end;
+  char detail[Trace::DETAIL];
+};
+
+// Only its thread writes to a ring, the lock is there for render() and is
+// uncontended otherwise
+struct Ring {
+  std::mutex mutex;
+  std::array<Event, Trace::RING_EVENTS> events;
+  // events recorded so far, the oldest are overwritten
+  size_t recorded = 0;
+};
+
+uint32_t every = 0;
+std::atomic<uint64_t> connections{0};
+const auto start = std::chrono::steady_clock::now();
+
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<Ring>> rings;
+
+Ring &local_ring() {
+  thread_local Ring *mine = [] {
+    auto ring = std::make_unique<Ring>();
+    auto *ptr = ring.get();
+    std::lock_guard<std::mutex> lock{rings_mutex};
+    rings.push_back(std::move(ring));
+    return ptr;
+  }();
+  return *mine;
+}
+
+double micros(std::chrono::steady_clock::duration elapsed) {
+  return std::chrono::duration<double, std::micro>(elapsed).count();
+}
+
+void append_escaped(std::string &out, const char *text) {
+  for (; *text; ++text) {
+    unsigned char c = *text;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof escaped, "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+}
+
+}  // namespace
+
+void Trace::configure(uint32_t n) { every = n; }
+
+uint64_t Trace::sample() {
+  if (!every) {
+    return 0;
+  }
+  uint64_t n = connections.fetch_add(1, std::memory_order_relaxed);
+  return n % every == 0 ? n + 1 : 0;
+}
+
+void Trace::record(uint64_t id, const char *name,
+                   std::chrono::steady_clock::time_point begin,
+                   std::chrono::steady_clock::time_point end,
+                   std::string_view detail) {
+  Ring &ring = local_ring();
+  std::lock_guard<std::mutex> lock{ring.mutex};
+  Event &event = ring.events[ring.recorded++ % RING_EVENTS];
+  event.id = id;
+  event.name = name;
+  event.begin = begin;
+  event.end = end;
+  size_t len = std::min(detail.size(), DETAIL - 1);
+  detail.copy(event.detail, len);
+  event.detail[len] = '\0';
+}
+
+std::string Trace::render() {
+  std::string out = "{\"traceEvents\":[";
+  bool first = true;
+  std::lock_guard<std::mutex> rings_lock{rings_mutex};
+  for (size_t thread = 0; thread < rings.size(); ++thread) {
+    Ring &ring = *rings[thread];
+    std::lock_guard<std::mutex> lock{ring.mutex};
+    size_t kept = std::min(ring.recorded, RING_EVENTS);
+    for (size_t i = ring.recorded - kept; i < ring.recorded; ++i) {
+      const Event &event = ring.events[i % RING_EVENTS];
+      char fields[160];
+      std::snprintf(fields, sizeof fields,
+                    "\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"args\":{\"thread\":%zu",
+                    static_cast<unsigned long long>(event.id),
+                    micros(event.begin - start),
+                    micros(event.end - event.begin), thread);
+      out += first ? "\n{\"name\":\"" : ",\n{\"name\":\"";
+      first = false;
+      out += event.name;
+      out += "\",";
+      out += fields;
+      if (event.detail[0]) {
+        out += ",\"detail\":\"";
+        append_escaped(out, event.detail);
+        out += '"';
+      }
+      out += "}}";
+    }
+  }
+  out += "\n]}\n";
+  return out;
+}
@@ -0,0 +1,191 @@
+#include "Upgrade.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include "Overload.h"
+
+using namespace boost;
+
+namespace {
+
+using Listeners = std::vector<std::pair<unsigned short, int>>;
+using LocalAcceptor = asio::local::stream_protocol::acceptor;
+
+// More than any config sets up, the rest wouldn't fit one message
+constexpr size_t MAX_LISTENERS = 64;
+
+std::atomic<bool> handed_over{false};
+// The connection to the previous process, open until ready()
+int previous = -1;
+
+sockaddr_un unix_address(const std::string &path) {
+  sockaddr_un address{};
+  if (path.size() >= sizeof address.sun_path) {
+    throw std::runtime_error("Upgrade socket path too long: " + path);
+  }
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+// The ports go in the payload, the fds in the same order in SCM_RIGHTS
+bool send_listeners(int fd, const Listeners &listeners) {
+  std::vector<unsigned short> ports;
+  std::vector<int> fds;
+  for (const auto &[port, listener] : listeners) {
+    if (ports.size() == MAX_LISTENERS) {
+      break;
+    }
+    ports.push_back(port);
+    fds.push_back(listener);
+  }
+  iovec payload{ports.data(), ports.size() * sizeof(unsigned short)};
+  std::vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+  msghdr message{};
+  message.msg_iov = &payload;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+  cmsghdr *rights = CMSG_FIRSTHDR(&message);
+  rights->cmsg_level = SOL_SOCKET;
+  rights->cmsg_type = SCM_RIGHTS;
+  rights->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+  std::memcpy(CMSG_DATA(rights), fds.data(), fds.size() * sizeof(int));
+  return ::sendmsg(fd, &message, MSG_NOSIGNAL) >= 0;
+}
+
+void drain(asio::io_context &io_context,
+           std::shared_ptr<asio::steady_timer> timer) {
+  timer->expires_after(Upgrade::DRAIN_CHECK);
+  timer->async_wait([&io_context, timer](const system::error_code &ec) {
+    if (ec) {
+      return;
+    }
+    if (Overload::open_connections() == 0) {
+      std::cout << "Drained, exiting" << std::endl;
+      io_context.stop();
+      return;
+    }
+    drain(io_context, timer);
+  });
+}
+
+void wait_for_successor(asio::io_context &io_context,
+                        std::shared_ptr<LocalAcceptor> acceptor,
+                        std::shared_ptr<Listeners> listeners,
+                        std::shared_ptr<std::function<void()>> stop) {
+  acceptor->async_accept([&io_context, acceptor, listeners, stop](
+                             const system::error_code &ec,
+                             asio::local::stream_protocol::socket socket) {
+    if (ec) {
+      if (ec != asio::error::operation_aborted) {
+        std::cerr << "Error accepting an upgrade: " << ec.message()
+                  << std::endl;
+        wait_for_successor(io_context, acceptor, listeners, stop);
+      }
+      return;
+    }
+    if (!send_listeners(socket.native_handle(), *listeners)) {
+      std::cerr << "Couldn't hand the listeners over: " << strerror(errno)
+                << std::endl;
+      wait_for_successor(io_context, acceptor, listeners, stop);
+      return;
+    }
+    // the successor acknowledges once it accepts on them
+    auto successor = std::make_shared<asio::local::stream_protocol::socket>(
+        std::move(socket));
+    auto ack = std::make_shared<char>();
+    asio::async_read(
+        *successor, asio::buffer(ack.get(), 1),
+        [&io_context, acceptor, listeners, stop, successor, ack](
+            const system::error_code &ec, size_t) {
+          if (ec) {
+            std::cerr << "The new process went away before taking over"
+                      << std::endl;
+            wait_for_successor(io_context, acceptor, listeners, stop);
+            return;
+          }
+          std::cout << "Listeners handed over, draining" << std::endl;
+          handed_over = true;
+          // the path belongs to the successor now, don't unlink it
+          system::error_code ignored;
+          acceptor->close(ignored);
+          (*stop)();
+          drain(io_context, std::make_shared<asio::steady_timer>(io_context));
+        });
+  });
+}
+
+}  // namespace
+
+std::map<unsigned short, int> Upgrade::inherit(const std::string &path) {
+  std::map<unsigned short, int> listeners;
+  sockaddr_un address = unix_address(path);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof address)) {
+    // first of its line, or whoever was there is gone
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return listeners;
+  }
+  unsigned short ports[MAX_LISTENERS];
+  alignas(cmsghdr) char control[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+  iovec payload{ports, sizeof ports};
+  msghdr message{};
+  message.msg_iov = &payload;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof control;
+  ssize_t received = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+  cmsghdr *rights = received > 0 ? CMSG_FIRSTHDR(&message) : nullptr;
+  if (!rights || rights->cmsg_level != SOL_SOCKET ||
+      rights->cmsg_type != SCM_RIGHTS) {
+    ::close(fd);
+    throw std::runtime_error("No listeners handed over on " + path);
+  }
+  size_t count = std::min<size_t>(
+      received / sizeof(unsigned short),
+      (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+  int fds[MAX_LISTENERS];
+  std::memcpy(fds, CMSG_DATA(rights), count * sizeof(int));
+  for (size_t i = 0; i < count; ++i) {
+    listeners.emplace(ports[i], fds[i]);
+  }
+  previous = fd;
+  return listeners;
+}
+
+void Upgrade::serve(asio::io_context &io_context, const std::string &path,
+                    Listeners listeners, std::function<void()> stop_accepting) {
+  // a stale socket left by a crash, or the previous process's
+  ::unlink(path.c_str());
+  auto acceptor = std::make_shared<LocalAcceptor>(
+      io_context, asio::local::stream_protocol::endpoint{path});
+  wait_for_successor(
+      io_context, acceptor, std::make_shared<Listeners>(std::move(listeners)),
+      std::make_shared<std::function<void()>>(std::move(stop_accepting)));
+}
+
+void Upgrade::ready() {
+  if (previous < 0) {
+    return;
+  }
+  char ack = 1;
+  (void)!::write(previous, &ack, 1);
+  ::close(previous);
+  previous = -1;
+}
+
+bool Upgrade::draining() { return handed_over; }
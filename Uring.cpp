@@ -0,0 +1,602 @@
+#include "Uring.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+using namespace boost;
+
+// Stop receiving into a connection once this much is waiting to be read,
+// the kernel's socket buffer then pushes back on the peer like it does
+// without io_uring
+constexpr size_t MAX_PENDING = 256 * 1024;
+
+static system::error_code error_from(int res) {
+  if (res == -ECANCELED) {
+    return asio::error::operation_aborted;
+  }
+  return {-res, system::system_category()};
+}
+
+template <typename T>
+static T *at(void *base, unsigned offset) {
+  return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+Uring::Uring(unsigned entries) {
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+  fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    throw system::system_error{{errno, system::system_category()},
+                               "io_uring_setup"};
+  }
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+                ? sq_ring
+                : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqes = static_cast<io_uring_sqe *>(
+      mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+           IORING_OFF_SQES));
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    ::close(fd);
+    throw system::system_error{{errno, system::system_category()},
+                               "io_uring mmap"};
+  }
+  sq_head = at<unsigned>(sq_ring, params.sq_off.head);
+  sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+  sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+  sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+  sq_flags = at<unsigned>(sq_ring, params.sq_off.flags);
+  cq_head = at<unsigned>(cq_ring, params.cq_off.head);
+  cq_tail = at<unsigned>(cq_ring, params.cq_off.tail);
+  cq_mask = at<unsigned>(cq_ring, params.cq_off.ring_mask);
+  cqes = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+  sqe_tail = *sq_tail;
+}
+
+Uring::~Uring() {
+  if (buf_ring) {
+    munmap(buf_ring, buf_ring_size);
+    delete[] buffers;
+  }
+  munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+  if (cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  munmap(sq_ring, sq_ring_size);
+  ::close(fd);
+}
+
+io_uring_sqe *Uring::get_sqe() {
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (sqe_tail - head >= params.sq_entries) {
+    return nullptr;
+  }
+  unsigned index = sqe_tail & *sq_mask;
+  sq_array[index] = index;
+  ++sqe_tail;
+  io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int Uring::submit() {
+  unsigned to_submit = sqe_tail - *sq_tail;
+  unsigned flags = 0;
+  // The kernel keeps CQEs that didn't fit, it flushes them on GETEVENTS
+  if (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+  if (!to_submit && !flags) {
+    return 0;
+  }
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, nullptr, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+bool Uring::cq_ready() const {
+  return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+}
+
+void Uring::reap(std::vector<io_uring_cqe> &out) {
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    out.push_back(cqes[head & *cq_mask]);
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+void Uring::register_buffers(uint16_t bgid, unsigned count, unsigned size) {
+  buf_ring_size = count * sizeof(io_uring_buf);
+  buf_ring = static_cast<io_uring_buf_ring *>(
+      mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (buf_ring == MAP_FAILED) {
+    buf_ring = nullptr;
+    throw system::system_error{{errno, system::system_category()},
+                               "buffer ring mmap"};
+  }
+  buffers = new char[size_t{count} * size];
+  buffer_count = count;
+  buffer_size = size;
+  io_uring_buf_reg reg{};
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+  reg.ring_entries = count;
+  reg.bgid = bgid;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0) {
+    throw system::system_error{{errno, system::system_category()},
+                               "IORING_REGISTER_PBUF_RING"};
+  }
+  for (unsigned bid = 0; bid < count; ++bid) {
+    recycle(bid);
+  }
+}
+
+void Uring::recycle(uint16_t bid) {
+  // Not buf_ring->bufs: in C++ the empty struct in __DECLARE_FLEX_ARRAY
+  // takes space and shifts the array off the entries the kernel reads
+  io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(buf_ring) +
+                      (buf_tail & (buffer_count - 1));
+  buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+  buf->len = buffer_size;
+  buf->bid = bid;
+  ++buf_tail;
+  __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+asio::io_context::id UringService::id;
+
+UringService::UringService(asio::io_context &io_context)
+    : asio::io_context::service{io_context},
+      io_context{io_context},
+      ring{ENTRIES},
+      notifier{io_context, ::dup(ring.fd)} {
+  ring.register_buffers(BUFFER_GROUP, BUFFER_COUNT, BUFFER_SIZE);
+  wait_for_completions();
+}
+
+void UringService::shutdown() {
+  system::error_code ignored;
+  notifier.close(ignored);
+}
+
+void UringService::queue(UringOp *op,
+                         const std::function<void(io_uring_sqe &)> &prep) {
+  io_uring_sqe prepared{};
+  prep(prepared);
+  prepared.user_data = reinterpret_cast<uint64_t>(op);
+  std::lock_guard<std::mutex> lock{mutex};
+  // nothing may overtake what's already waiting, a close is linked to the
+  // cancel before it
+  io_uring_sqe *sqe = overflow.empty() ? ring.get_sqe() : nullptr;
+  if (!sqe && overflow.empty()) {
+    ring.submit();
+    sqe = ring.get_sqe();
+  }
+  if (sqe) {
+    *sqe = prepared;
+  } else {
+    // the kernel didn't take the full queue (EBUSY, EAGAIN), flush() retries
+    overflow.push_back(prepared);
+  }
+  if (!flush_scheduled) {
+    flush_scheduled = true;
+    asio::post(io_context, [this] { flush(); });
+  }
+}
+
+void UringService::consume_buffer(uint16_t bid, size_t len,
+                                  std::string &into) {
+  // The buffer is ours until it's recycled, only the ring needs the lock
+  into.append(ring.buffer(bid), len);
+  std::lock_guard<std::mutex> lock{mutex};
+  ring.recycle(bid);
+}
+
+void UringService::flush() {
+  std::lock_guard<std::mutex> lock{mutex};
+  flush_scheduled = false;
+  refill();
+  ring.submit();
+  if (!overflow.empty()) {
+    refill();
+    ring.submit();
+  }
+  if (!overflow.empty()) {
+    // try again once the handlers queued behind this one have run
+    flush_scheduled = true;
+    asio::post(io_context, [this] { flush(); });
+  }
+}
+
+void UringService::refill() {
+  while (!overflow.empty()) {
+    io_uring_sqe *sqe = ring.get_sqe();
+    if (!sqe) {
+      return;
+    }
+    *sqe = overflow.front();
+    overflow.pop_front();
+  }
+}
+
+void UringService::wait_for_completions() {
+  notifier.async_wait(asio::posix::descriptor_base::wait_read,
+                      [this](const system::error_code &ec) {
+                        if (ec) {
+                          return;
+                        }
+                        handle_completions();
+                        wait_for_completions();
+                        // A CQE posted before the wait was re-armed didn't
+                        // produce a readiness edge we could see
+                        std::lock_guard<std::mutex> lock{mutex};
+                        if (ring.cq_ready()) {
+                          asio::post(io_context,
+                                     [this] { handle_completions(); });
+                        }
+                      });
+}
+
+void UringService::handle_completions() {
+  // Whoever is draining already picks up the new CQEs too
+  if (draining.exchange(true, std::memory_order_acquire)) {
+    return;
+  }
+  std::vector<io_uring_cqe> batch;
+  bool more;
+  do {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      ring.reap(batch);
+    }
+    for (const auto &cqe : batch) {
+      auto *op = reinterpret_cast<UringOp *>(cqe.user_data);
+      if (!op) {
+        continue;
+      }
+      op->complete(cqe.res, cqe.flags);
+      if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        delete op;
+      }
+    }
+    batch.clear();
+    draining.store(false, std::memory_order_release);
+    // CQEs a caller turned away above left for us to handle
+    std::lock_guard<std::mutex> lock{mutex};
+    more = ring.cq_ready();
+  } while (more && !draining.exchange(true, std::memory_order_acquire));
+}
+
+struct UringStream::State : std::enable_shared_from_this<State> {
+  State(const executor_type &executor)
+      : service{asio::use_service<UringService>(static_cast<asio::io_context &>(
+            asio::query(executor, asio::execution::context)))},
+        executor{executor} {}
+
+  void arm_recv();
+  // Completes the waiting read if there's data or an error for it, must be
+  // called with the mutex held
+  void try_complete_read();
+  void abort_read();
+
+  UringService &service;
+  executor_type executor;
+  int fd = -1;
+  std::mutex mutex;
+  std::string pending;
+  system::error_code read_error;
+  bool receiving = false;
+  bool stopping_recv = false;
+  bool reading = false;
+  asio::mutable_buffer read_buffer;
+  Handler read_handler;
+};
+
+struct RecvOp : UringOp {
+  RecvOp(std::shared_ptr<UringStream::State> state) : state{std::move(state)} {}
+
+  void complete(int res, unsigned flags) override {
+    std::lock_guard<std::mutex> lock{state->mutex};
+    if (flags & IORING_CQE_F_BUFFER) {
+      uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      state->service.consume_buffer(bid, res > 0 ? res : 0, state->pending);
+    }
+    bool last = !(flags & IORING_CQE_F_MORE);
+    if (res == 0) {
+      state->read_error = asio::error::eof;
+    } else if (res < 0 && res != -ECANCELED && res != -ENOBUFS) {
+      state->read_error = error_from(res);
+    }
+    if (last) {
+      state->receiving = false;
+      state->stopping_recv = false;
+      // Out of provided buffers, try again once a read asks for more
+      if (res == -ENOBUFS && state->reading) {
+        state->arm_recv();
+      }
+    } else if (state->pending.size() >= MAX_PENDING && !state->stopping_recv) {
+      // Stop the multishot recv, it's re-armed once the reader catches up
+      state->stopping_recv = true;
+      state->service.queue(nullptr, [this](io_uring_sqe &sqe) {
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.addr = reinterpret_cast<uint64_t>(this);
+      });
+    }
+    state->try_complete_read();
+  }
+
+  std::shared_ptr<UringStream::State> state;
+};
+
+struct SendOp : UringOp {
+  SendOp(std::shared_ptr<UringStream::State> state, UringStream::Handler handler)
+      : state{std::move(state)}, handler{std::move(handler)} {}
+
+  void complete(int res, unsigned) override {
+    system::error_code ec = res < 0 ? error_from(res) : system::error_code{};
+    size_t n = res > 0 ? res : 0;
+    asio::post(state->executor,
+               [handler = std::move(handler), ec, n]() mutable {
+                 std::move(handler)(ec, n);
+               });
+  }
+
+  std::shared_ptr<UringStream::State> state;
+  UringStream::Handler handler;
+};
+
+void UringStream::State::arm_recv() {
+  if (receiving || read_error || fd < 0 || pending.size() >= MAX_PENDING) {
+    return;
+  }
+  receiving = true;
+  int fd = this->fd;
+  service.queue(new RecvOp{shared_from_this()}, [fd](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = fd;
+    sqe.ioprio = IORING_RECV_MULTISHOT;
+    sqe.flags = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = UringService::BUFFER_GROUP;
+  });
+}
+
+void UringStream::State::try_complete_read() {
+  if (!reading) {
+    return;
+  }
+  size_t n = std::min(pending.size(), read_buffer.size());
+  if (!n && read_buffer.size() && !read_error) {
+    arm_recv();
+    return;
+  }
+  memcpy(read_buffer.data(), pending.data(), n);
+  pending.erase(0, n);
+  // asio's composed operations issue zero-sized reads just to get their
+  // completion posted, those must succeed even after EOF
+  system::error_code ec =
+      n || !read_buffer.size() ? system::error_code{} : read_error;
+  reading = false;
+  asio::post(executor, [handler = std::move(read_handler), ec, n]() mutable {
+    std::move(handler)(ec, n);
+  });
+  arm_recv();
+}
+
+void UringStream::State::abort_read() {
+  if (!reading) {
+    return;
+  }
+  reading = false;
+  asio::post(executor, [handler = std::move(read_handler)]() mutable {
+    std::move(handler)(asio::error::operation_aborted, 0);
+  });
+}
+
+UringStream::UringStream(const executor_type &executor)
+    : state{std::make_shared<State>(executor)} {}
+
+UringStream::UringStream(const executor_type &executor, int fd)
+    : UringStream{executor} {
+  assign(fd);
+}
+
+UringStream &UringStream::operator=(UringStream &&other) {
+  if (this != &other) {
+    close();
+    state = std::move(other.state);
+  }
+  return *this;
+}
+
+UringStream::~UringStream() {
+  if (state) {
+    close();
+  }
+}
+
+UringStream::executor_type UringStream::get_executor() noexcept {
+  return state->executor;
+}
+
+bool UringStream::is_open() const {
+  std::lock_guard<std::mutex> lock{state->mutex};
+  return state->fd >= 0;
+}
+
+void UringStream::assign(int fd) {
+  std::lock_guard<std::mutex> lock{state->mutex};
+  state->fd = fd;
+  state->read_error = {};
+  state->pending.clear();
+}
+
+void UringStream::cancel() {
+  std::lock_guard<std::mutex> lock{state->mutex};
+  state->abort_read();
+  if (state->fd < 0) {
+    return;
+  }
+  int fd = state->fd;
+  state->service.queue(nullptr, [fd](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  });
+}
+
+void UringStream::close() {
+  std::lock_guard<std::mutex> lock{state->mutex};
+  state->abort_read();
+  if (state->fd < 0) {
+    return;
+  }
+  int fd = state->fd;
+  state->fd = -1;
+  // Cancel whatever still uses the fd, then close it. The close is queued
+  // behind the cancel so the fd number can't be reused in between.
+  state->service.queue(nullptr, [fd](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe.flags = IOSQE_IO_HARDLINK;
+  });
+  state->service.queue(nullptr, [fd](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_CLOSE;
+    sqe.fd = fd;
+  });
+}
+
+asio::ip::tcp::endpoint UringStream::remote_endpoint() const {
+  system::error_code ec;
+  asio::ip::tcp::endpoint endpoint = remote_endpoint(ec);
+  if (ec) {
+    throw system::system_error{ec, "remote_endpoint"};
+  }
+  return endpoint;
+}
+
+asio::ip::tcp::endpoint UringStream::remote_endpoint(
+    system::error_code &ec) const {
+  asio::ip::tcp::endpoint endpoint;
+  socklen_t len = endpoint.capacity();
+  if (getpeername(state->fd, endpoint.data(), &len)) {
+    ec.assign(errno, system::system_category());
+    return {};
+  }
+  ec.clear();
+  endpoint.resize(len);
+  return endpoint;
+}
+
+void UringStream::start_read(asio::mutable_buffer buffer, Handler handler) {
+  std::lock_guard<std::mutex> lock{state->mutex};
+  if (state->fd < 0) {
+    asio::post(state->executor, [handler = std::move(handler)]() mutable {
+      std::move(handler)(asio::error::bad_descriptor, 0);
+    });
+    return;
+  }
+  state->reading = true;
+  state->read_buffer = buffer;
+  state->read_handler = std::move(handler);
+  state->try_complete_read();
+}
+
+void UringStream::start_write(asio::const_buffer buffer, Handler handler) {
+  std::lock_guard<std::mutex> lock{state->mutex};
+  if (state->fd < 0) {
+    asio::post(state->executor, [handler = std::move(handler)]() mutable {
+      std::move(handler)(asio::error::bad_descriptor, 0);
+    });
+    return;
+  }
+  int fd = state->fd;
+  state->service.queue(new SendOp{state, std::move(handler)},
+                       [fd, buffer](io_uring_sqe &sqe) {
+                         sqe.opcode = IORING_OP_SEND;
+                         sqe.fd = fd;
+                         sqe.addr = reinterpret_cast<uint64_t>(buffer.data());
+                         sqe.len = buffer.size();
+                         sqe.msg_flags = MSG_NOSIGNAL;
+                       });
+}
+
+struct AcceptOp : UringOp {
+  AcceptOp(asio::io_context &io_context, UringService &service, int listen_fd,
+           UringAcceptor::Callback callback)
+      : io_context{io_context},
+        service{service},
+        listen_fd{listen_fd},
+        callback{std::move(callback)} {}
+
+  void arm() {
+    int fd = listen_fd;
+    service.queue(this, [fd](io_uring_sqe &sqe) {
+      sqe.opcode = IORING_OP_ACCEPT;
+      sqe.fd = fd;
+      sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+    });
+  }
+
+  void complete(int res, unsigned flags) override {
+    system::error_code ec = res < 0 ? error_from(res) : system::error_code{};
+    asio::post(io_context, [callback = callback, ec, res] {
+      callback(ec, res);
+    });
+    // The kernel ended the multishot accept, keep accepting with a new op.
+    // Errors like EMFILE won't go away at once, so back off a little.
+    if (!(flags & IORING_CQE_F_MORE) && res != -ECANCELED) {
+      auto *next = new AcceptOp{io_context, service, listen_fd, callback};
+      if (res >= 0) {
+        next->arm();
+        return;
+      }
+      auto timer = std::make_shared<asio::steady_timer>(
+          io_context, std::chrono::milliseconds(100));
+      timer->async_wait(
+          [timer, next](const system::error_code &) { next->arm(); });
+    }
+  }
+
+  asio::io_context &io_context;
+  UringService &service;
+  int listen_fd;
+  UringAcceptor::Callback callback;
+};
+
+UringAcceptor::UringAcceptor(asio::io_context &io_context, int listen_fd)
+    : io_context{io_context},
+      service{asio::use_service<UringService>(io_context)},
+      listen_fd{listen_fd} {}
+
+void UringAcceptor::start(Callback callback) {
+  (new AcceptOp{io_context, service, listen_fd, std::move(callback)})->arm();
+}
+
+void UringAcceptor::stop() {
+  int fd = listen_fd;
+  service.queue(nullptr, [fd](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  });
+}
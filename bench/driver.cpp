@@ -0,0 +1,164 @@
+// Runs the end-to-end benchmarks: starts bench_origin and the proxy, then
+// pushes every workload through the proxy with bench_loadgen and prints
+// throughput and latency percentiles (in microseconds) for each.
+//
+// Usage: bench_driver [--rate REQ_PER_SEC] [--duration SECONDS]
+//                     [--proxy PATH_TO_PROXY]
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace boost;
+
+constexpr unsigned short PROXY_PORT = 8000;
+constexpr unsigned short ORIGIN_PORT = 9080;
+
+struct Workload {
+  const char *name;
+  const char *query;
+  double rate_factor;  // share of --rate offered to this workload
+  bool keep_alive;
+};
+
+const Workload WORKLOADS[] = {
+    {"keep-alive", "size=1024", 1, true},
+    {"non-keep-alive", "size=1024", 0.5, false},
+    {"large-body", "size=1048576", 0.05, true},
+    {"chunked", "size=65536&chunked=1", 0.5, true},
+};
+
+// Starts `path` with `args`. Its stdout goes to `out_fd`, or both stdout and
+// stderr to /dev/null so the proxy's logging doesn't flood the report.
+static pid_t spawn(const std::string &path, std::vector<std::string> args,
+                   int out_fd = -1) {
+  pid_t pid = fork();
+  if (pid) {
+    return pid;
+  }
+  if (out_fd < 0) {
+    out_fd = open("/dev/null", O_WRONLY);
+    dup2(out_fd, STDERR_FILENO);
+  }
+  dup2(out_fd, STDOUT_FILENO);
+  std::vector<char *> argv{const_cast<char *>(path.c_str())};
+  for (auto &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+  execv(path.c_str(), argv.data());
+  perror(path.c_str());
+  _exit(127);
+}
+
+static bool wait_for_port(unsigned short port) {
+  asio::io_context io_context;
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    asio::ip::tcp::socket socket{io_context};
+    system::error_code ec;
+    socket.connect({asio::ip::make_address("127.0.0.1"), port}, ec);
+    if (!ec) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+// Runs bench_loadgen to completion and parses its key=value report
+static std::map<std::string, std::string> run_loadgen(
+    const std::string &path, std::vector<std::string> args) {
+  int fds[2];
+  if (pipe(fds)) {
+    throw std::runtime_error("pipe failed");
+  }
+  pid_t pid = spawn(path, args, fds[1]);
+  close(fds[1]);
+  std::string output;
+  char buf[512];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    output.append(buf, n);
+  }
+  close(fds[0]);
+  waitpid(pid, nullptr, 0);
+  std::map<std::string, std::string> report;
+  std::istringstream iss{output};
+  std::string pair;
+  while (iss >> pair) {
+    auto eq = pair.find('=');
+    if (eq != std::string::npos) {
+      report[pair.substr(0, eq)] = pair.substr(eq + 1);
+    }
+  }
+  return report;
+}
+
+int main(int argc, char *argv[]) {
+  double rate = 2000;
+  double duration = 10;
+  std::string proxy = "./boost";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--rate") {
+      rate = std::stod(argv[i + 1]);
+    } else if (arg == "--duration") {
+      duration = std::stod(argv[i + 1]);
+    } else if (arg == "--proxy") {
+      proxy = argv[i + 1];
+    }
+  }
+  std::string dir = argv[0];
+  dir = dir.find('/') == std::string::npos ? "."
+                                           : dir.substr(0, dir.rfind('/'));
+
+  pid_t origin = spawn(dir + "/bench_origin", {std::to_string(ORIGIN_PORT)});
+  pid_t proxy_pid = spawn(proxy, {});
+  if (!wait_for_port(ORIGIN_PORT) || !wait_for_port(PROXY_PORT)) {
+    std::cerr << "origin or proxy did not come up" << std::endl;
+    kill(origin, SIGTERM);
+    kill(proxy_pid, SIGTERM);
+    return 1;
+  }
+
+  printf("%-16s %9s %8s %7s %11s %9s %9s %9s %9s %9s\n", "workload",
+         "requests", "errors", "rate", "throughput", "p50", "p90", "p99",
+         "p99.9", "max");
+  for (const auto &workload : WORKLOADS) {
+    double workload_rate = rate * workload.rate_factor;
+    std::vector<std::string> args{
+        "--url",
+        "http://127.0.0.1:" + std::to_string(ORIGIN_PORT) + "/?" +
+            workload.query,
+        "--proxy",
+        "127.0.0.1:" + std::to_string(PROXY_PORT),
+        "--rate",
+        std::to_string(workload_rate),
+        "--duration",
+        std::to_string(duration)};
+    if (!workload.keep_alive) {
+      args.push_back("--close");
+    }
+    auto report = run_loadgen(dir + "/bench_loadgen", args);
+    printf("%-16s %9s %8s %7.0f %11s %9s %9s %9s %9s %9s\n", workload.name,
+           report["requests"].c_str(), report["errors"].c_str(),
+           workload_rate, report["throughput"].c_str(), report["p50"].c_str(),
+           report["p90"].c_str(), report["p99"].c_str(),
+           report["p999"].c_str(), report["max"].c_str());
+    fflush(stdout);
+  }
+
+  kill(proxy_pid, SIGTERM);
+  kill(origin, SIGTERM);
+  waitpid(proxy_pid, nullptr, 0);
+  waitpid(origin, nullptr, 0);
+}
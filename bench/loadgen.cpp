@@ -0,0 +1,333 @@
+// Open-loop HTTP load generator. Requests are scheduled at a fixed rate no
+// matter how fast the proxy answers, and latency is measured from the time a
+// request was *supposed* to be sent. A stalled proxy therefore shows up as
+// latency instead of silently lowering the offered load (coordinated
+// omission).
+//
+// Usage: bench_loadgen --url URL [--proxy HOST:PORT] [--rate REQ_PER_SEC]
+//                      [--duration SECONDS] [--connections N] [--close]
+//
+// Prints one line of key=value pairs, latencies are in microseconds.
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <string>
+
+#include "Histogram.h"
+#include "utils.h"
+
+using namespace boost;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string proxy = "127.0.0.1:8000";
+  std::string url;
+  double rate = 1000;
+  double duration = 10;
+  size_t connections = 64;
+  bool keep_alive = true;
+};
+
+class Loadgen;
+
+class Connection : public std::enable_shared_from_this<Connection> {
+ public:
+  Connection(asio::io_context &io_context, Loadgen &loadgen)
+      : socket{io_context}, loadgen{loadgen} {}
+
+  void connect(const asio::ip::tcp::resolver::results_type &endpoints,
+               Clock::time_point intended);
+  void send(Clock::time_point intended);
+
+ private:
+  void read_header();
+  void read_chunk();
+  // Makes sure `in` holds at least n bytes before calling callback
+  void fill(size_t n, std::function<void()> callback);
+  void done();
+  void fail();
+
+  asio::ip::tcp::socket socket;
+  Loadgen &loadgen;
+  std::string in;
+  Clock::time_point intended;
+};
+
+// Seconds a run may overrun its duration while waiting for stragglers
+constexpr double DRAIN_SECONDS = 5;
+
+static Clock::duration seconds(double s) {
+  return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(s));
+}
+
+class Loadgen {
+ public:
+  Loadgen(asio::io_context &io_context, const Options &options)
+      : io_context{io_context}, options{options}, timer{io_context} {
+    auto [host, port] = split_host_port(options.proxy);
+    endpoints = asio::ip::tcp::resolver{io_context}.resolve(host, port);
+    // "http://host:port/path" -> "host:port"
+    auto authority_beg = options.url.find("//") + 2;
+    auto authority_end = options.url.find('/', authority_beg);
+    std::string authority =
+        options.url.substr(authority_beg, authority_end - authority_beg);
+    request = "GET " + options.url + " HTTP/1.1\r\nHost: " + authority +
+              "\r\nUser-Agent: bench_loadgen\r\n";
+    request += options.keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+  }
+
+  void start() {
+    start_time = Clock::now();
+    end_time = start_time + seconds(options.duration);
+    tick();
+  }
+
+  void report() const {
+    double elapsed =
+        std::chrono::duration<double>(finish_time - start_time).count();
+    printf(
+        "requests=%lu errors=%lu throughput=%.1f p50=%lu p90=%lu p99=%lu "
+        "p999=%lu max=%lu\n",
+        latencies.count(), errors, latencies.count() / elapsed,
+        latencies.percentile(50), latencies.percentile(90),
+        latencies.percentile(99), latencies.percentile(99.9),
+        latencies.max());
+  }
+
+  void completed(std::shared_ptr<Connection> connection,
+                 Clock::time_point intended) {
+    latencies.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                         Clock::now() - intended)
+                         .count());
+    --in_flight;
+    if (options.keep_alive) {
+      idle.push_back(std::move(connection));
+    } else {
+      --open;
+    }
+    dispatch();
+  }
+
+  void failed() {
+    ++errors;
+    --in_flight;
+    --open;
+    dispatch();
+  }
+
+  std::string request;
+
+ private:
+  // Queue every request whose send time has come, then sleep until the next
+  void tick() {
+    auto now = Clock::now();
+    while (scheduled_time() <= now && scheduled_time() < end_time) {
+      backlog.push_back(scheduled_time());
+      ++scheduled;
+    }
+    dispatch();
+    if (scheduled_time() < end_time) {
+      timer.expires_at(scheduled_time());
+      timer.async_wait([this](const system::error_code &ec) {
+        if (!ec) {
+          tick();
+        }
+      });
+      return;
+    }
+    // Everything is scheduled, give stragglers a grace period
+    timer.expires_at(end_time + seconds(DRAIN_SECONDS));
+    timer.async_wait([this](const system::error_code &ec) {
+      if (!ec) {
+        errors += in_flight + backlog.size();
+        finish_time = Clock::now();
+        io_context.stop();
+      }
+    });
+  }
+
+  Clock::time_point scheduled_time() const {
+    return start_time + seconds(scheduled / options.rate);
+  }
+
+  void dispatch() {
+    while (!backlog.empty()) {
+      auto intended = backlog.front();
+      if (!idle.empty()) {
+        auto connection = std::move(idle.back());
+        idle.pop_back();
+        connection->send(intended);
+      } else if (open < options.connections) {
+        ++open;
+        std::make_shared<Connection>(io_context, *this)
+            ->connect(endpoints, intended);
+      } else {
+        break;
+      }
+      backlog.pop_front();
+      ++in_flight;
+    }
+    if (!in_flight && backlog.empty() && scheduled_time() >= end_time) {
+      finish_time = Clock::now();
+      timer.cancel();
+      idle.clear();
+    }
+  }
+
+  asio::io_context &io_context;
+  Options options;
+  asio::steady_timer timer;
+  asio::ip::tcp::resolver::results_type endpoints;
+  Clock::time_point start_time;
+  Clock::time_point end_time;
+  Clock::time_point finish_time;
+  uint64_t scheduled = 0;
+  std::deque<Clock::time_point> backlog;
+  std::vector<std::shared_ptr<Connection>> idle;
+  size_t open = 0;
+  size_t in_flight = 0;
+  uint64_t errors = 0;
+  Histogram latencies;
+};
+
+void Connection::connect(
+    const asio::ip::tcp::resolver::results_type &endpoints,
+    Clock::time_point intended) {
+  auto self(shared_from_this());
+  asio::async_connect(socket, endpoints,
+                      [self, this, intended](const system::error_code &ec,
+                                             const asio::ip::tcp::endpoint &) {
+                        if (ec) {
+                          fail();
+                          return;
+                        }
+                        socket.set_option(asio::ip::tcp::no_delay{true});
+                        send(intended);
+                      });
+}
+
+void Connection::send(Clock::time_point intended) {
+  auto self(shared_from_this());
+  this->intended = intended;
+  asio::async_write(socket, asio::buffer(loadgen.request),
+                    [self, this](const system::error_code &ec, std::size_t) {
+                      if (ec) {
+                        fail();
+                        return;
+                      }
+                      read_header();
+                    });
+}
+
+void Connection::read_header() {
+  auto self(shared_from_this());
+  asio::async_read_until(
+      socket, asio::dynamic_buffer(in), "\r\n\r\n",
+      [self, this](const system::error_code &ec, std::size_t header_len) {
+        if (ec) {
+          fail();
+          return;
+        }
+        std::string header = in.substr(0, header_len);
+        in.erase(0, header_len);
+        if (header.compare(0, 12, "HTTP/1.1 200") != 0 &&
+            header.compare(0, 12, "HTTP/1.0 200") != 0) {
+          fail();
+          return;
+        }
+        if (identify_body(header) == Body::CHUNKED) {
+          read_chunk();
+          return;
+        }
+        std::string length = parse_field(header, "content-length");
+        size_t body_len = length.empty() ? 0 : std::stoul(length);
+        fill(body_len, [this, body_len] {
+          in.erase(0, body_len);
+          done();
+        });
+      });
+}
+
+void Connection::read_chunk() {
+  auto self(shared_from_this());
+  asio::async_read_until(
+      socket, asio::dynamic_buffer(in), "\r\n",
+      [self, this](const system::error_code &ec, std::size_t line_len) {
+        if (ec) {
+          fail();
+          return;
+        }
+        size_t chunk_len = std::stoul(in.substr(0, line_len), nullptr, 16);
+        in.erase(0, line_len);
+        // chunk data and its CRLF, or the empty trailer after the last chunk
+        fill(chunk_len + 2, [this, chunk_len] {
+          in.erase(0, chunk_len + 2);
+          if (chunk_len) {
+            read_chunk();
+          } else {
+            done();
+          }
+        });
+      });
+}
+
+void Connection::fill(size_t n, std::function<void()> callback) {
+  if (in.size() >= n) {
+    callback();
+    return;
+  }
+  auto self(shared_from_this());
+  asio::async_read(socket, asio::dynamic_buffer(in),
+                   asio::transfer_exactly(n - in.size()),
+                   [self, this, callback](const system::error_code &ec,
+                                          std::size_t) {
+                     if (ec) {
+                       fail();
+                       return;
+                     }
+                     callback();
+                   });
+}
+
+void Connection::done() { loadgen.completed(shared_from_this(), intended); }
+
+void Connection::fail() {
+  system::error_code ignored;
+  socket.close(ignored);
+  loadgen.failed();
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--close") {
+      options.keep_alive = false;
+    } else if (i + 1 < argc && arg == "--url") {
+      options.url = argv[++i];
+    } else if (i + 1 < argc && arg == "--proxy") {
+      options.proxy = argv[++i];
+    } else if (i + 1 < argc && arg == "--rate") {
+      options.rate = std::stod(argv[++i]);
+    } else if (i + 1 < argc && arg == "--duration") {
+      options.duration = std::stod(argv[++i]);
+    } else if (i + 1 < argc && arg == "--connections") {
+      options.connections = std::stoul(argv[++i]);
+    } else {
+      std::cerr << "Unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+  if (options.url.empty()) {
+    std::cerr << "--url is required" << std::endl;
+    return 1;
+  }
+  asio::io_context io_context;
+  Loadgen loadgen{io_context, options};
+  loadgen.start();
+  io_context.run();
+  loadgen.report();
+}
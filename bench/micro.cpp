@@ -0,0 +1,131 @@
+// Microbenchmarks for the header handling that runs on every message. Each
+// case runs over a corpus of captured request and response headers and
+// reports the time, heap allocations and allocated bytes per header.
+//
+// Usage: bench_micro [corpus] [milliseconds per case]
+//
+// To compare a replacement parser, add it to CASES next to the function it
+// replaces.
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  allocated_bytes += size;
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+// Keeps the compiler from optimising away a result nobody reads
+template <typename T>
+static void keep(T &&value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Case {
+  const char *name;
+  std::function<void(const std::string &)> run;
+};
+
+// Headers are separated by empty lines, line endings become CRLF
+static std::vector<std::string> load_corpus(const std::string &path) {
+  std::ifstream file{path};
+  if (!file) {
+    throw std::runtime_error("can't open corpus " + path);
+  }
+  std::vector<std::string> headers;
+  std::string header;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty()) {
+      if (!header.empty()) {
+        headers.push_back(header + "\r\n");
+        header.clear();
+      }
+      continue;
+    }
+    header += line + "\r\n";
+  }
+  if (!header.empty()) {
+    headers.push_back(header + "\r\n");
+  }
+  return headers;
+}
+
+int main(int argc, char *argv[]) {
+  std::string corpus_path = argc > 1 ? argv[1] : "bench/corpus/headers.txt";
+  std::chrono::milliseconds budget{argc > 2 ? std::stoul(argv[2]) : 300};
+  const auto corpus = load_corpus(corpus_path);
+
+  std::string scratch;
+  scratch.reserve(64 * 1024);
+  const std::vector<Case> CASES = {
+      {"to_lowercase",
+       [&scratch](const std::string &header) {
+         scratch.assign(header);
+         to_lowercase(scratch);
+         keep(scratch);
+       }},
+      {"find_ci(content-length)",
+       [](const std::string &header) {
+         keep(find_ci(header, "content-length"));
+       }},
+      {"identify_body",
+       [](const std::string &header) { keep(identify_body(header)); }},
+      {"parse_field(host)",
+       [](const std::string &header) { keep(parse_field(header, "host")); }},
+      {"parse_field(content-length)",
+       [](const std::string &header) {
+         keep(parse_field(header, "content-length"));
+       }},
+  };
+
+  printf("%zu headers, %zu bytes on average\n\n", corpus.size(), [&corpus] {
+    size_t bytes = 0;
+    for (const auto &header : corpus) {
+      bytes += header.size();
+    }
+    return bytes / corpus.size();
+  }());
+  printf("%-30s %12s %14s %14s\n", "case", "ns/header", "allocs/header",
+         "bytes/header");
+  for (const auto &c : CASES) {
+    // warm up caches and the branch predictor
+    for (const auto &header : corpus) {
+      c.run(header);
+    }
+    size_t headers = 0;
+    size_t allocations_before = allocations;
+    size_t bytes_before = allocated_bytes;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    while (elapsed < budget) {
+      for (const auto &header : corpus) {
+        c.run(header);
+      }
+      headers += corpus.size();
+      elapsed = std::chrono::steady_clock::now() - start;
+    }
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    printf("%-30s %12.1f %14.2f %14.1f\n", c.name, ns / headers,
+           double(allocations - allocations_before) / headers,
+           double(allocated_bytes - bytes_before) / headers);
+  }
+}
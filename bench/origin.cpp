@@ -0,0 +1,150 @@
+// Local origin server for the benchmarks. Every response is shaped by the
+// query string of the request target, so one server covers all workloads:
+//   size=N     body size in bytes (default 1024)
+//   delay=MS   wait MS milliseconds before answering
+//   chunked=1  use chunked transfer encoding instead of Content-Length
+//
+// Usage: bench_origin [port] [threads]
+
+#include <boost/asio.hpp>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+using namespace boost;
+
+constexpr size_t CHUNK_SIZE = 16 * 1024;
+
+static std::string query_param(const std::string &target,
+                               const std::string &name) {
+  auto query = target.find('?');
+  if (query == std::string::npos) {
+    return "";
+  }
+  size_t pos = query + 1;
+  while (pos < target.size()) {
+    auto end = target.find('&', pos);
+    if (end == std::string::npos) {
+      end = target.size();
+    }
+    auto eq = target.find('=', pos);
+    if (eq < end && target.compare(pos, eq - pos, name) == 0) {
+      return target.substr(eq + 1, end - eq - 1);
+    }
+    pos = end + 1;
+  }
+  return "";
+}
+
+static std::string make_response(size_t size, bool chunked, bool close) {
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+  if (close) {
+    response += "Connection: close\r\n";
+  }
+  if (!chunked) {
+    response += "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+    response.append(size, 'x');
+    return response;
+  }
+  response += "Transfer-Encoding: chunked\r\n\r\n";
+  char hex[32];
+  while (size) {
+    size_t n = std::min(size, CHUNK_SIZE);
+    snprintf(hex, sizeof(hex), "%zx\r\n", n);
+    response += hex;
+    response.append(n, 'x');
+    response += "\r\n";
+    size -= n;
+  }
+  response += "0\r\n\r\n";
+  return response;
+}
+
+struct Session : public std::enable_shared_from_this<Session> {
+  Session(asio::ip::tcp::socket &&socket)
+      : socket{std::move(socket)}, timer{this->socket.get_executor()} {}
+
+  void read_request() {
+    auto self(shared_from_this());
+    asio::async_read_until(
+        socket, asio::dynamic_buffer(in), "\r\n\r\n",
+        [self, this](const system::error_code &ec, std::size_t header_len) {
+          if (ec) {
+            return;
+          }
+          std::string header = in.substr(0, header_len);
+          in.erase(0, header_len);
+          std::string target = header.substr(header.find(' ') + 1);
+          target = target.substr(0, target.find(' '));
+          std::string size = query_param(target, "size");
+          std::string delay = query_param(target, "delay");
+          close = find_ci(parse_field(header, "connection"), "close");
+          out = make_response(size.empty() ? 1024 : std::stoul(size),
+                              query_param(target, "chunked") == "1", close);
+          if (delay.empty() || delay == "0") {
+            write_response();
+            return;
+          }
+          timer.expires_after(std::chrono::milliseconds(std::stoul(delay)));
+          timer.async_wait(
+              [self, this](const system::error_code &) { write_response(); });
+        });
+  }
+
+  void write_response() {
+    auto self(shared_from_this());
+    asio::async_write(socket, asio::buffer(out),
+                      [self, this](const system::error_code &ec, std::size_t) {
+                        if (ec) {
+                          return;
+                        }
+                        if (close) {
+                          system::error_code ignored;
+                          socket.shutdown(asio::socket_base::shutdown_both,
+                                          ignored);
+                          return;
+                        }
+                        read_request();
+                      });
+  }
+
+  asio::ip::tcp::socket socket;
+  asio::steady_timer timer;
+  std::string in;
+  std::string out;
+  bool close = false;
+};
+
+static void start_accept(asio::io_context &io_context,
+                         asio::ip::tcp::acceptor &acceptor) {
+  acceptor.async_accept(
+      asio::make_strand(io_context),
+      [&io_context, &acceptor](const system::error_code &ec,
+                               asio::ip::tcp::socket socket) {
+        if (!ec) {
+          socket.set_option(asio::ip::tcp::no_delay{true});
+          std::make_shared<Session>(std::move(socket))->read_request();
+        }
+        start_accept(io_context, acceptor);
+      });
+}
+
+int main(int argc, char *argv[]) {
+  unsigned short port = argc > 1 ? std::stoi(argv[1]) : 9080;
+  std::size_t threads_num = argc > 2 ? std::stoul(argv[2]) : 1;
+  asio::io_context io_context;
+  asio::ip::tcp::acceptor acceptor{
+      io_context, asio::ip::tcp::endpoint{asio::ip::tcp::v4(), port}};
+  start_accept(io_context, acceptor);
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < threads_num; ++i) {
+    threads.emplace_back([&io_context] { io_context.run(); });
+  }
+  printf("Origin listening on port %u\n", port);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
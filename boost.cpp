@@ -1,46 +1,429 @@
+#include <unistd.h>
+
 #include <algorithm>
 #include <boost/asio.hpp>
 #include <iostream>
+#include <map>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "Cache.h"
+#include "ClientLimits.h"
+#include "Config.h"
+#include "Fleet.h"
+#include "HealthCheck.h"
+#include "Http2Upstream.h"
+#include "Metrics.h"
+#include "Overload.h"
+#include "Shaper.h"
 #include "Socket.h"
+#include "Threads.h"
+#include "Trace.h"
+#include "Upgrade.h"
+#include "Usdt.h"
 #include "utils.h"
 
 using namespace boost;
 
 constexpr unsigned PORT = 8000;
 
+#ifdef PROXY_WITH_TLS
+// Set with --tls, the listener then only speaks TLS
+std::unique_ptr<asio::ssl::context> tls_context;
+#endif
+
+// Serves a connection accepted on `port` under the config in effect now
+void start_socket(asio::io_context &io_context, Stream &&stream,
+                  unsigned short port, ClientLimits::Ticket &&ticket) {
+  auto config = current_config();
+  Cluster *cluster = config->route(port);
+  std::make_shared<Socket>(io_context, std::move(stream), std::move(config),
+                           cluster, std::move(ticket))
+      ->start();
+}
+
+#ifndef PROXY_WITH_URING
 void start_accept(asio::io_context &io_context,
-                  asio::ip::tcp::acceptor &acceptor) {
+                  asio::ip::tcp::acceptor &acceptor, unsigned short port);
+
+// Accepts again after Overload::ACCEPT_PAUSE, meanwhile new connections wait
+// in the listen backlog
+void pause_accept(asio::io_context &io_context,
+                  asio::ip::tcp::acceptor &acceptor, unsigned short port) {
+  auto timer = std::make_shared<asio::steady_timer>(io_context,
+                                                    Overload::ACCEPT_PAUSE);
+  timer->async_wait(asio::bind_executor(
+      acceptor.get_executor(),
+      [&io_context, &acceptor, port, timer](const system::error_code &) {
+        start_accept(io_context, acceptor, port);
+      }));
+}
+
+void start_accept(asio::io_context &io_context,
+                  asio::ip::tcp::acceptor &acceptor, unsigned short port) {
+  if (Upgrade::draining()) {
+    // the listener is the new process's now
+    return;
+  }
+  if (Overload::level() == Overload::Level::PAUSE) {
+    pause_accept(io_context, acceptor, port);
+    return;
+  }
   acceptor.async_accept(
-      // asio::make_strand(io_context),
-      [&io_context, &acceptor](const system::error_code &ec,
-                               asio::ip::tcp::socket socket) {
+      asio::make_strand(io_context),
+      [&io_context, &acceptor, port](const system::error_code &ec,
+                                        asio::ip::tcp::socket socket) {
+        if (ec == asio::error::operation_aborted) {
+          // stopped for an upgrade
+          return;
+        }
         if (ec) {
-          puts("Error accepting..");
-          throw system::system_error{ec};
+          std::cerr << "Error accepting: " << ec.message() << std::endl;
+          if (ec == asio::error::no_descriptors ||
+              ec == system::errc::too_many_files_open_in_system ||
+              ec == asio::error::no_buffer_space ||
+              ec == asio::error::no_memory) {
+            // out of resources, let the connections we have finish first
+            pause_accept(io_context, acceptor, port);
+          } else {
+            start_accept(io_context, acceptor, port);
+          }
+          return;
+        }
+        if (Overload::level() != Overload::Level::NORMAL) {
+          bool plain = true;
+#ifdef PROXY_WITH_TLS
+          // a TLS client couldn't read a plain 503
+          plain = !tls_context;
+#endif
+          if (plain) {
+            Overload::reject(socket.native_handle());
+          }
+          system::error_code ignored;
+          socket.close(ignored);
+          start_accept(io_context, acceptor, port);
+          return;
+        }
+        system::error_code peer_ec;
+        auto peer = socket.remote_endpoint(peer_ec);
+        ClientLimits::Ticket ticket;
+        if (peer_ec || !ClientLimits::admit(peer.address(), ticket)) {
+          // gone already, or over its connection cap
+          socket.close(peer_ec);
+          start_accept(io_context, acceptor, port);
+          return;
+        }
+        std::cout << MAG << "New socket on port " << peer.port() << RESET
+                  << std::endl;
+        PROXY_PROBE2(accept, socket.native_handle(), peer.port());
+#ifdef PROXY_WITH_TLS
+        if (tls_context) {
+          tls_handshake(
+              *tls_context, std::move(socket),
+              [&io_context, port,
+               ticket = std::make_shared<ClientLimits::Ticket>(
+                   std::move(ticket))](const system::error_code &ec,
+                                       TlsStream &&stream) {
+                if (ec) {
+                  std::cerr << "TLS handshake failed: " << ec.message()
+                            << std::endl;
+                  return;
+                }
+                start_socket(io_context, std::move(stream), port,
+                             std::move(*ticket));
+              });
+          start_accept(io_context, acceptor, port);
+          return;
+        }
+#endif
+        start_socket(io_context, Stream{std::move(socket)}, port,
+                     std::move(ticket));
+        start_accept(io_context, acceptor, port);
+      });
+}
+#else
+void start_accept(asio::io_context &io_context, UringAcceptor &acceptor,
+                  unsigned short port) {
+  acceptor.start([&io_context, port](const system::error_code &ec, int fd) {
+    if (ec == asio::error::operation_aborted) {
+      // stopped for an upgrade
+      return;
+    }
+    if (ec) {
+      std::cerr << "Error accepting: " << ec.message() << std::endl;
+      return;
+    }
+    // The multishot accept can't be paused, so pausing sheds here too
+    if (Overload::level() != Overload::Level::NORMAL) {
+      Overload::reject(fd);
+      ::close(fd);
+      return;
+    }
+    auto socket = UringStream{asio::make_strand(io_context), fd};
+    system::error_code peer_ec;
+    auto peer = socket.remote_endpoint(peer_ec);
+    ClientLimits::Ticket ticket;
+    if (peer_ec || !ClientLimits::admit(peer.address(), ticket)) {
+      // gone already, or over its connection cap
+      socket.close();
+      return;
+    }
+    std::cout << MAG << "New socket on port " << peer.port() << RESET
+              << std::endl;
+    PROXY_PROBE2(accept, fd, peer.port());
+    start_socket(io_context, std::move(socket), port, std::move(ticket));
+  });
+}
+#endif
+
+// Forward proxying on PORT unless the config listens somewhere
+void add_default_listener(Config &config) {
+  if (config.listeners.empty()) {
+    config.listeners.push_back({PORT, nullptr});
+  }
+}
+
+std::vector<unsigned short> ports(const Config &config) {
+  std::vector<unsigned short> ports;
+  for (const auto &listener : config.listeners) {
+    ports.push_back(listener.port);
+  }
+  std::sort(ports.begin(), ports.end());
+  return ports;
+}
+
+void apply_config(asio::io_context &io_context, std::shared_ptr<Config> config,
+                  const std::string &path) {
+  add_default_listener(*config);
+  if (ports(*config) != ports(*current_config())) {
+    std::cerr << "Keeping the current config: listening ports only change "
+                 "with a restart"
+              << std::endl;
+    return;
+  }
+  if (config->cache_bytes) {
+    ResponseCache::set_capacity(*config->cache_bytes);
+  }
+  std::shared_ptr<const Config> snapshot = std::move(config);
+  for (const auto &cluster : snapshot->clusters) {
+    std::make_shared<HealthChecker>(io_context, *cluster, snapshot)->start();
+  }
+  publish_config(std::move(snapshot));
+  std::cout << "Reloaded " << path << std::endl;
+}
+
+// Loading resolves every endpoint, which would hold up a worker, so it
+// happens on a thread of its own. The next SIGHUP is only waited for once
+// this reload is applied, reloads never overtake each other.
+void reload_on_sighup(asio::io_context &io_context, asio::signal_set &signals,
+                      const std::string &path) {
+  signals.async_wait([&io_context, &signals, path](
+                         const system::error_code &ec, int) {
+    if (ec) {
+      return;
+    }
+    std::thread([&io_context, &signals, path] {
+      auto config = std::make_shared<Config>();
+      try {
+        *config = load_config(path);
+      } catch (const std::exception &e) {
+        std::cerr << "Keeping the current config: " << e.what() << std::endl;
+        config.reset();
+      }
+      asio::post(io_context, [&io_context, &signals, path, config] {
+        if (config) {
+          apply_config(io_context, config, path);
         }
-        std::cout << MAG << "New socket on port "
-                  << socket.remote_endpoint().port() << RESET << std::endl;
-        std::make_shared<Socket>(io_context, std::move(socket))->start();
-        start_accept(io_context, acceptor);
+        reload_on_sighup(io_context, signals, path);
       });
+    }).detach();
+  });
 }
 
 int main(int argc, char *argv[]) {
-  // std::size_t threads_num = 10;
-  std::size_t threads_num = std::thread::hardware_concurrency();
+  bool pin_threads = false;
+  uint32_t client_connections = 0;
+  uint32_t client_rps = 0;
+  uint32_t client_bandwidth = 0;
+  uint32_t trace_every = 0;
+  size_t bandwidth = 0;
+  size_t max_connections = 0;
+  size_t max_rss = 0;
+  std::string upgrade_path;
+  std::string config_path;
+  Config config;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--pin-threads") {
+      // pins every worker to its own CPU
+      pin_threads = true;
+    } else if (arg == "--h2c" && i + 1 < argc) {
+      // HOST[:PORT] speaks HTTP/2 in cleartext, multiplex requests to it
+      Http2Upstream::add_h2c_origin(argv[++i]);
+    } else if (arg == "--cache" && i + 1 < argc) {
+      // megabytes of responses to keep in memory
+      ResponseCache::set_capacity(std::stoul(argv[++i]) << 20);
+    } else if (arg == "--peer" && i + 1 < argc) {
+      // HOST:PORT of a fleet node sharing the cache, repeatable
+      Fleet::add_peer(argv[++i]);
+    } else if (arg == "--self" && i + 1 < argc) {
+      // which of the peers this node is
+      Fleet::set_self(argv[++i]);
+    } else if (arg == "--client-conns" && i + 1 < argc) {
+      // connections one client IP may have open at once
+      client_connections = std::stoul(argv[++i]);
+    } else if (arg == "--client-rps" && i + 1 < argc) {
+      // requests per second one client IP may send
+      client_rps = std::stoul(argv[++i]);
+    } else if (arg == "--client-bandwidth" && i + 1 < argc) {
+      // kilobytes per second written back to one client IP
+      client_bandwidth = std::stoul(argv[++i]) * 1024;
+    } else if (arg == "--bandwidth" && i + 1 < argc) {
+      // kilobytes per second written back to all clients together
+      bandwidth = std::stoul(argv[++i]) * 1024;
+    } else if (arg == "--max-conns" && i + 1 < argc) {
+      // client connections open at once before accepting pauses
+      max_connections = std::stoul(argv[++i]);
+    } else if (arg == "--max-rss" && i + 1 < argc) {
+      // megabytes of memory in use before new connections get a 503
+      max_rss = std::stoul(argv[++i]) << 20;
+    } else if (arg == "--trace" && i + 1 < argc) {
+      // records the timeline of one connection in N, see GET /trace
+      trace_every = std::stoul(argv[++i]);
+    } else if (arg == "--upgrade" && i + 1 < argc) {
+      // Unix socket to take the listeners over from, see Upgrade.h
+      upgrade_path = argv[++i];
+    } else if (arg == "--config" && i + 1 < argc) {
+      // clusters, listeners and timeouts, reloaded on SIGHUP, see Config.h
+      config_path = argv[++i];
+      try {
+        config = load_config(config_path);
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+      }
+#ifdef PROXY_WITH_TLS
+    } else if (arg == "--tls" && i + 2 < argc) {
+      // CERT_FILE KEY_FILE, PEM
+      try {
+        tls_context = std::make_unique<asio::ssl::context>(
+            make_tls_context(argv[i + 1], argv[i + 2]));
+      } catch (const system::system_error &e) {
+        std::cerr << "Couldn't load the certificate: " << e.what()
+                  << std::endl;
+        return 1;
+      }
+      i += 2;
+#endif
+    } else {
+      std::cerr << "Unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+  ClientLimits::configure(client_connections, client_rps, client_bandwidth);
+  Shaper::configure(bandwidth);
+  Trace::configure(trace_every);
+  Overload::configure(max_connections, max_rss);
+  if (config.cache_bytes) {
+    ResponseCache::set_capacity(*config.cache_bytes);
+  }
+  std::size_t threads_num = config.threads ? config.threads : available_cpus();
+  std::vector<int> cpus = allowed_cpus();
+  add_default_listener(config);
+  std::shared_ptr<const Config> snapshot =
+      std::make_shared<Config>(std::move(config));
+  publish_config(snapshot);
   asio::io_context io_context;
-  asio::ip::tcp::acceptor acceptor{
-      io_context, asio::ip::tcp::endpoint{asio::ip::tcp::v4(), PORT}};
+  Overload::start_monitor(io_context);
+  Shaper::start(io_context);
+  start_loop_probe(io_context, threads_num);
   try {
-    start_accept(io_context, acceptor);
+    std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> acceptors;
+#ifdef PROXY_WITH_URING
+    std::vector<std::unique_ptr<UringAcceptor>> uring_acceptors;
+#endif
+    std::map<unsigned short, int> inherited;
+    if (!upgrade_path.empty()) {
+      inherited = Upgrade::inherit(upgrade_path);
+    }
+    for (const auto &listener : snapshot->listeners) {
+      auto it = inherited.find(listener.port);
+      if (it != inherited.end()) {
+        acceptors.push_back(std::make_unique<asio::ip::tcp::acceptor>(
+            asio::make_strand(io_context), asio::ip::tcp::v4(), it->second));
+        inherited.erase(it);
+      } else {
+        acceptors.push_back(std::make_unique<asio::ip::tcp::acceptor>(
+            asio::make_strand(io_context),
+            asio::ip::tcp::endpoint{asio::ip::tcp::v4(), listener.port}));
+      }
+#ifdef PROXY_WITH_URING
+      uring_acceptors.push_back(std::make_unique<UringAcceptor>(
+          io_context, acceptors.back()->native_handle()));
+      start_accept(io_context, *uring_acceptors.back(), listener.port);
+#else
+      start_accept(io_context, *acceptors.back(), listener.port);
+#endif
+    }
+    for (const auto &[port, fd] : inherited) {
+      // the new config doesn't listen there anymore
+      ::close(fd);
+    }
+    if (!upgrade_path.empty()) {
+      std::vector<std::pair<unsigned short, int>> listeners;
+      for (size_t i = 0; i < acceptors.size(); ++i) {
+        listeners.emplace_back(snapshot->listeners[i].port,
+                               acceptors[i]->native_handle());
+      }
+      Upgrade::serve(io_context, upgrade_path, std::move(listeners), [&] {
+#ifdef PROXY_WITH_URING
+        // queued on the ring, which takes SQEs from any thread
+        for (auto &acceptor : uring_acceptors) {
+          acceptor->stop();
+        }
+#else
+        // each acceptor only runs on its strand, where an accept may be
+        // starting right now
+        for (auto &acceptor : acceptors) {
+          asio::post(acceptor->get_executor(), [&acceptor] {
+            system::error_code ignored;
+            acceptor->cancel(ignored);
+          });
+        }
+#endif
+      });
+    }
+    for (const auto &cluster : snapshot->clusters) {
+      std::make_shared<HealthChecker>(io_context, *cluster, snapshot)->start();
+    }
+    asio::signal_set signals{io_context};
+    if (!config_path.empty()) {
+      signals.add(SIGHUP);
+      reload_on_sighup(io_context, signals, config_path);
+    }
     std::vector<std::thread> threads;
     for (std::size_t i = 0; i < threads_num; ++i) {
-      threads.emplace_back([&io_context] { io_context.run(); });
+      int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+      threads.emplace_back([&io_context, pin_threads, cpu] {
+        // Pin before running anything so per-thread state is allocated on
+        // this CPU's NUMA node
+        if (pin_threads && cpu >= 0 && !pin_current_thread(cpu)) {
+          std::cerr << "Couldn't pin thread to CPU " << cpu << std::endl;
+        }
+        io_context.run();
+      });
     }
+    Upgrade::ready();
 
-    printf("Listening on port %u\n", PORT);
+    for (const auto &listener : snapshot->listeners) {
+      printf("Listening on port %u with %zu threads", listener.port,
+             threads_num);
+      if (listener.cluster) {
+        printf(", proxying to %s", listener.cluster->name().c_str());
+      }
+      printf("\n");
+    }
 
     for (std::size_t i = 0; i < threads.size(); ++i) {
       threads[i].join();
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Concurrency limit for one upstream that follows its latency, the gradient
+// algorithm from Netflix's concurrency-limits. Time to first byte is averaged
+// over SAMPLE_WINDOW and compared with the lowest one seen recently: the
+// limit shrinks by the ratio when the average drifts above the minimum, and
+// grows by sqrt(limit) while they are close and the limit is actually used.
+// Requests then wait in the proxy rather than in the origin's queue, where
+// they would slow down everyone else's.
+class AdaptiveLimit {
+ public:
+  static constexpr uint32_t INITIAL_LIMIT = 100;
+  static constexpr uint32_t MIN_LIMIT = 10;
+  static constexpr uint32_t MAX_LIMIT = 1024;
+  static constexpr std::chrono::milliseconds SAMPLE_WINDOW{100};
+  // The minimum is measured again over each of these, so an origin that got
+  // slower for good isn't held to its old latency forever
+  static constexpr std::chrono::seconds MIN_RTT_WINDOW{30};
+  // Latency above the minimum still counted as unloaded
+  static constexpr double RTT_TOLERANCE = 1.5;
+  // Differences below this are noise (our own scheduling, mostly), RTTs are
+  // rounded up to it
+  static constexpr std::chrono::microseconds RTT_FLOOR{1000};
+
+  uint32_t current() const { return limit.load(std::memory_order_relaxed); }
+  // A response header came back after `rtt` with `in_flight` requests
+  // outstanding
+  void record(std::chrono::steady_clock::duration rtt, uint32_t in_flight);
+
+ private:
+  void update(int64_t now, uint32_t in_flight);
+
+  std::atomic<uint32_t> limit{INITIAL_LIMIT};
+  std::atomic<uint64_t> window_sum_us{0};
+  std::atomic<uint32_t> window_samples{0};
+  std::atomic<uint32_t> window_peak{0};
+  // steady_clock ticks, whoever records past it closes the window
+  std::atomic<int64_t> window_end{0};
+  // minimum over this MIN_RTT_WINDOW and the one before it
+  std::atomic<uint32_t> min_rtt_us{UINT32_MAX};
+  std::atomic<uint32_t> next_min_rtt_us{UINT32_MAX};
+  std::atomic<int64_t> min_rtt_end{0};
+};
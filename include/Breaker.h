@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "AdaptiveLimit.h"
+
+// Limits for one upstream, a Host in forward mode or a cluster in reverse
+// mode, shared by every worker. Whatever would go over a limit is refused
+// instead of piling onto an upstream that is already struggling. Requests
+// sent at once are also held under an AdaptiveLimit.
+//
+// Retries also spend from a token bucket that every request sent tops up by
+// a fraction of a token, so retries stay a small share of the traffic no
+// matter how badly the upstream fails.
+class CircuitBreaker {
+ public:
+  // Unless the config sets upstream_connections
+  static constexpr uint32_t MAX_CONNECTIONS = 1024;
+  // Requests sent and not answered yet, AdaptiveLimit::MAX_LIMIT at most
+  static constexpr uint32_t MAX_PENDING_REQUESTS = 1024;
+  static constexpr uint32_t MAX_ACTIVE_RETRIES = 3;
+  // Budget in thousandths of a retry, one request earns 0.2 of one
+  static constexpr uint32_t RETRY_COST = 1000;
+  static constexpr uint32_t RETRY_DEPOSIT = 200;
+  static constexpr uint32_t RETRY_BUDGET = 10 * RETRY_COST;
+
+  // One unit counted against a limit until it's destroyed or reset, empty
+  // when the limit was reached
+  class Slot {
+   public:
+    Slot() = default;
+    explicit Slot(std::atomic<uint32_t> *counter) : counter{counter} {}
+    Slot(Slot &&other) noexcept : counter{other.counter} {
+      other.counter = nullptr;
+    }
+    Slot &operator=(Slot &&other) noexcept;
+    ~Slot() { reset(); }
+
+    explicit operator bool() const { return counter; }
+    void reset();
+
+   private:
+    std::atomic<uint32_t> *counter = nullptr;
+  };
+
+  static std::shared_ptr<CircuitBreaker> get(const std::string &upstream);
+
+  Slot connection(uint32_t limit = MAX_CONNECTIONS);
+  // Only first attempts add to the retry budget
+  Slot request(bool first_attempt);
+  // Time to first byte of a request, feeds the adaptive limit
+  void record_rtt(std::chrono::steady_clock::duration rtt);
+  // Also takes RETRY_COST from the budget
+  Slot retry();
+
+ private:
+  static Slot acquire(std::atomic<uint32_t> &counter, uint32_t limit);
+
+  std::atomic<uint32_t> connections{0};
+  std::atomic<uint32_t> pending_requests{0};
+  std::atomic<uint32_t> active_retries{0};
+  // a full budget to start with
+  std::atomic<uint32_t> retry_tokens{RETRY_BUDGET};
+  AdaptiveLimit concurrency;
+};
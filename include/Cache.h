@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Shared in-memory cache of complete GET responses, enabled with
+// `--cache MB`. Split into shards, each an LRU list under its own lock, so
+// workers rarely contend. Only responses that say how long they stay fresh
+// (s-maxage or max-age) and aren't personalised get stored.
+class ResponseCache {
+ public:
+  static void set_capacity(size_t bytes);
+  static bool enabled();
+  // Copies a fresh response stored under `key` into `response`, with an Age
+  // header added
+  static bool lookup(const std::string &key, std::string &response);
+  // Stores `response` under `key` if its headers allow sharing it
+  static void store(const std::string &key, const std::string &response);
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+
+// Per client IP caps, set with `--client-conns N`, `--client-rps N` and
+// `--client-bandwidth KB`: connections open at once, checked at accept
+// before a Socket exists, a token bucket of requests (bursts of up to a
+// second's worth), checked as each request header comes in, and a token
+// bucket of bytes written back (bursts of a tenth of a second), checked
+// before each slice of a response goes out.
+//
+// Clients live in a fixed, lock-free hash table split into shards, each
+// probed linearly over a few slots. An entry is three words: the client's
+// 40-bit key with its connection count, so a slot can only be taken over by
+// a CAS that sees no connections, and each bucket's tokens with the time
+// they were last topped up. When every slot a client could use holds someone
+// with open connections, the client isn't limited at all, the table never
+// blocks anyone on its own account.
+class ClientLimits {
+ public:
+  static constexpr size_t SHARDS = 64;
+  static constexpr size_t SHARD_SLOTS = 1024;
+  static constexpr size_t PROBES = 8;
+  // Smallest byte burst, so a slice of a response always fits
+  static constexpr uint32_t MIN_BYTE_BURST = 64 * 1024;
+
+  struct Entry {
+    // key << 24 | connections, 0 when free
+    std::atomic<uint64_t> owner{0};
+    // milliseconds since start << 32 | thousandths of a token
+    std::atomic<uint64_t> bucket{0};
+    // milliseconds since start << 32 | bytes
+    std::atomic<uint64_t> bytes{0};
+  };
+
+  // One open connection counted against a client, and where its bucket is
+  class Ticket {
+   public:
+    Ticket() = default;
+    explicit Ticket(Entry *entry) : entry{entry} {}
+    Ticket(Ticket &&other) noexcept : entry{other.entry} {
+      other.entry = nullptr;
+    }
+    Ticket &operator=(Ticket &&other) noexcept;
+    ~Ticket() { release(); }
+
+    // Takes a token for one request, always true without --client-rps
+    bool take_request();
+    // Takes `n` bytes of the client's bandwidth, or says how long until it
+    // has them (taking nothing). Zero without --client-bandwidth.
+    std::chrono::milliseconds take_bytes(size_t n);
+    void release();
+
+   private:
+    Entry *entry = nullptr;
+  };
+
+  // Only call before the workers start, 0 leaves that limit off
+  static void configure(uint32_t max_connections,
+                        uint32_t requests_per_second,
+                        uint32_t bytes_per_second);
+  static bool enabled();
+  static bool limits_bandwidth();
+  // false when the client already has as many connections as it may
+  static bool admit(const boost::asio::ip::address &address, Ticket &ticket);
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+// How a cluster spreads new upstream connections over its endpoints
+enum class LbPolicy {
+  ROUND_ROBIN,
+  LEAST_REQUEST,  // fewest requests in flight, scanning every endpoint
+  P2C,            // the less loaded of two random endpoints
+  EWMA            // two random endpoints, by latency EWMA x load
+};
+
+// Parses "round_robin", "least_request", "p2c" or "ewma"
+bool parse_lb_policy(const std::string &name, LbPolicy &policy);
+
+// A named group of interchangeable origins for reverse-proxy listeners,
+// shared by every worker.
+//
+// Per-endpoint state is kept as arrays of atomics, one per statistic, so a
+// pick scans contiguous memory and every update is a single relaxed RMW. The
+// arrays are packed rather than padded, picks read far more often than
+// requests write.
+//
+// Endpoints drop out of picks while an active health check fails (see
+// HealthChecker) or while they are ejected as outliers: too many 5xx or
+// connect failures in a row, or a latency far above the cluster's median.
+// Ejections last longer each time an endpoint is ejected again and never
+// cover more than half the cluster. If nothing is left, every endpoint is
+// picked from again rather than failing outright.
+class Cluster {
+ public:
+  static constexpr uint32_t CONSECUTIVE_5XX = 5;
+  static constexpr uint32_t CONSECUTIVE_CONNECT_FAILURES = 3;
+  static constexpr uint32_t UNHEALTHY_THRESHOLD = 2;
+  // EWMA this many times the median makes an endpoint a latency outlier
+  static constexpr uint32_t LATENCY_OUTLIER_FACTOR = 3;
+  static constexpr std::chrono::seconds BASE_EJECTION{30};
+  static constexpr uint32_t MAX_EJECTION_MULTIPLIER = 10;
+  // TTFB percentile a request waits before it's hedged
+  static constexpr double HEDGE_PERCENTILE = 95;
+  static constexpr uint32_t MIN_HEDGE_SAMPLES = 20;
+
+  Cluster(std::string name, LbPolicy policy,
+          std::vector<boost::asio::ip::tcp::endpoint> endpoints);
+
+  // Probes GET `path` on every endpoint each `interval`, before the workers
+  // start
+  void set_health_check(std::string path, std::chrono::milliseconds interval);
+  const std::string &health_path() const { return health_check_path; }
+  std::chrono::milliseconds health_interval() const {
+    return health_check_interval;
+  }
+  // Sends slow GETs to a second endpoint too, see Hedge.h
+  void set_hedging(bool enabled) { hedging = enabled; }
+  // How long a GET waits for its header before it's hedged, zero while
+  // hedging is off or there are too few samples
+  std::chrono::microseconds hedge_delay() const {
+    return std::chrono::microseconds{
+        hedge_delay_us.load(std::memory_order_relaxed)};
+  }
+  // Recomputes hedge_delay() from the TTFBs since the last call, and decays
+  // them, called periodically
+  void refresh_hedge_delay();
+
+  const std::string &name() const { return cluster_name; }
+  size_t size() const { return endpoints.size(); }
+  const boost::asio::ip::tcp::endpoint &endpoint(size_t i) const {
+    return endpoints[i];
+  }
+
+  // Index of the endpoint the next upstream connection should go to
+  size_t pick();
+  // An available endpoint other than `skip` for a hedge, size() if there's
+  // none
+  size_t pick_other(size_t skip);
+
+  // Request accounting, see EndpointLease
+  void start(size_t i);
+  void finish(size_t i);
+  void record_response(size_t i, int status,
+                       std::chrono::steady_clock::duration latency);
+
+  void record_connect(size_t i, bool connected);
+  void record_probe(size_t i, bool healthy);
+  // Ejects endpoints whose latency stands out, called periodically
+  void detect_latency_outliers();
+
+ private:
+  size_t cost(size_t i) const;
+  bool available(size_t i, int64_t now) const;
+  // A random available endpoint other than `skip`, size() if there's none
+  size_t random_available(int64_t now, size_t skip) const;
+  void eject(size_t i, const char *reason);
+
+  std::string cluster_name;
+  LbPolicy policy;
+  std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+  std::atomic<size_t> next{0};
+  std::unique_ptr<std::atomic<uint32_t>[]> outstanding;
+  // Microseconds, 0 until the first response
+  std::unique_ptr<std::atomic<uint32_t>[]> latency_ewma;
+  std::unique_ptr<std::atomic<uint32_t>[]> consecutive_5xx;
+  std::unique_ptr<std::atomic<uint32_t>[]> connect_failures;
+  std::unique_ptr<std::atomic<uint32_t>[]> probe_failures;
+  std::unique_ptr<std::atomic<uint32_t>[]> ejections;
+  // steady_clock ticks, ejected while in the future
+  std::unique_ptr<std::atomic<int64_t>[]> ejected_until;
+
+  std::string health_check_path;
+  std::chrono::milliseconds health_check_interval{0};
+
+  bool hedging = false;
+  // Counts per Histogram bucket, bumped by every worker, unlike a Histogram
+  std::unique_ptr<std::atomic<uint32_t>[]> ttfb_counts;
+  std::atomic<uint32_t> hedge_delay_us{0};
+};
+
+// Counts one request against an endpoint for as long as it's held
+class EndpointLease {
+ public:
+  EndpointLease() = default;
+  EndpointLease(Cluster *cluster, size_t endpoint);
+  EndpointLease(EndpointLease &&other) noexcept;
+  EndpointLease &operator=(EndpointLease &&other) noexcept;
+  ~EndpointLease() { release(); }
+
+  // The response came back after `latency`
+  void finish(int status, std::chrono::steady_clock::duration latency);
+  // The request is abandoned or will be sent again
+  void release();
+
+ private:
+  Cluster *cluster = nullptr;
+  size_t endpoint = 0;
+};
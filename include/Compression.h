@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+// Content codings the proxy can apply to responses on the way to the client.
+// Only IDENTITY exists in builds without COMPRESS=1, zstd needs ZSTD=1 too.
+enum class Encoding { IDENTITY, GZIP, BROTLI, ZSTD };
+
+// The coding to use for a request's Accept-Encoding value: br, then zstd,
+// then gzip, whichever the client takes first
+Encoding negotiate(std::string accept_encoding);
+// The Content-Encoding token, "br" for BROTLI
+const char *encoding_name(Encoding encoding);
+
+// Compresses a complete 200 response in place, unless it's small, already
+// encoded, of a type that doesn't compress (images, video, archives...) or
+// marked no-transform. The body is fed to the encoder in fixed slices with a
+// capped window, so each encoder stays within a few hundred KiB whatever the
+// body's size. Returns false if the response was left alone.
+//
+// The result has no Vary header yet, the cache won't take varied responses,
+// see add_vary().
+bool compress_response(std::string &response, Encoding encoding);
+// Adds "Vary: Accept-Encoding" to a compressed response
+void add_vary(std::string &response);
+// Cache key of the `encoding` variant of the response stored under `key`
+std::string variant_key(const std::string &key, Encoding encoding);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Breaker.h"
+#include "Cluster.h"
+
+// What `--config FILE` sets up. One directive per line, `#` starts a
+// comment:
+//
+//   cluster NAME [round_robin|least_request|p2c|ewma]
+//   endpoint HOST:PORT         # belongs to the cluster above it
+//   health_check PATH [MS]     # probe its endpoints every MS (default 5000)
+//   hedge                      # hedge GETs slower than the cluster's p95
+//   listen PORT [CLUSTER]      # reverse proxy to CLUSTER, forward without
+//   timeout SECONDS            # idle client connections (default 15)
+//   threads N                  # workers (default one per CPU)
+//   cache MB                   # instead of --cache
+//   upstream_connections N     # open to one upstream at once (default 1024)
+//
+// Endpoints are resolved once, when the file is loaded.
+//
+// The file is read again on SIGHUP. The new Config is published as a whole
+// and never modified after that: connections already open keep the one
+// they started with, new ones get the new one. Listening ports and the
+// thread count can't change without a restart (or `--upgrade`), a reload
+// that changes the ports is refused. Clusters start over with no health or
+// latency history.
+struct Listener {
+  unsigned short port;
+  // nullptr for a forward-proxy listener
+  Cluster *cluster;
+};
+
+struct Config {
+  std::vector<std::unique_ptr<Cluster>> clusters;
+  std::vector<Listener> listeners;
+  std::chrono::seconds timeout{15};
+  // 0 for one per CPU
+  size_t threads = 0;
+  // bytes, --cache stays in effect when unset
+  std::optional<size_t> cache_bytes;
+  uint32_t upstream_connections = CircuitBreaker::MAX_CONNECTIONS;
+
+  // Cluster of the listener on `port`, nullptr for forward proxying
+  Cluster *route(unsigned short port) const;
+};
+
+// Throws std::runtime_error naming the line it couldn't make sense of
+Config load_config(const std::string &path);
+
+// The Config in effect. Reading it takes no lock: every thread keeps the
+// last snapshot it saw and only fetches the new one after a publish.
+std::shared_ptr<const Config> current_config();
+void publish_config(std::shared_ptr<const Config> config);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Proxy nodes that shard one cache between them. Every node is started with
+// the same `--peer HOST:PORT` list, in the same order, plus `--self` naming
+// its own entry. A URL is owned by the peer jump hash maps it to; other
+// nodes pass requests for it on to the owner instead of caching it
+// themselves, so the fleet's cache capacity adds up. Growing the list at the
+// end only moves 1/n of the URLs.
+class Fleet {
+ public:
+  // Marks a request passed on by a peer, the owner never passes it again
+  static constexpr const char *HOP_HEADER = "X-Fleet-Hop";
+
+  // Only call before the workers start
+  static void add_peer(const std::string &host_port);
+  static void set_self(const std::string &host_port);
+  // true with at least two peers, one of them this node
+  static bool enabled();
+  // The peer that owns `url`, nullptr if this node does
+  static const std::string *owner(std::string_view url);
+
+  static void mark_hop(std::string &request);
+  // Removes the hop header, false if the request didn't have one
+  static bool take_hop(std::string &request);
+};
+
+// Lamping and Veach's jump consistent hash, a bucket in [0, buckets)
+int32_t jump_hash(uint64_t key, int32_t buckets);
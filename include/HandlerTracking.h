@@ -0,0 +1,59 @@
+#pragma once
+
+// Asio handler tracking hooks for `make TRACK_HANDLERS=1`, which passes this
+// header as BOOST_ASIO_CUSTOM_HANDLER_TRACKING. Only completions are
+// tracked: each times the handler it invokes and records the duration
+// against the handler's call site, see handler_site() in Metrics.h. The
+// site is looked up once per operation type, the type embeds the handler's.
+
+#include <chrono>
+#include <cstddef>
+#include <typeinfo>
+
+#include "Metrics.h"
+
+class HandlerTracking {
+ public:
+  class completion {
+   public:
+    template <typename Operation>
+    explicit completion(const Operation &) : site{site_of<Operation>()} {}
+
+    template <typename... Args>
+    void invocation_begin(Args &&...) {
+      start = std::chrono::steady_clock::now();
+    }
+    void invocation_end() {
+      record_handler(site, std::chrono::steady_clock::now() - start);
+    }
+
+   private:
+    template <typename Operation>
+    static size_t site_of() {
+      static const size_t site = handler_site(typeid(Operation).name());
+      return site;
+    }
+
+    size_t site;
+    std::chrono::steady_clock::time_point start;
+  };
+};
+
+#define BOOST_ASIO_INHERIT_TRACKED_HANDLER
+#define BOOST_ASIO_ALSO_INHERIT_TRACKED_HANDLER
+#define BOOST_ASIO_HANDLER_TRACKING_INIT (void)0
+#define BOOST_ASIO_HANDLER_LOCATION(args) (void)0
+#define BOOST_ASIO_HANDLER_CREATION(args) (void)0
+#define BOOST_ASIO_HANDLER_COMPLETION(args) \
+  ::HandlerTracking::completion tracked_completion args
+#define BOOST_ASIO_HANDLER_INVOCATION_BEGIN(args) \
+  tracked_completion.invocation_begin args
+#define BOOST_ASIO_HANDLER_INVOCATION_END tracked_completion.invocation_end()
+#define BOOST_ASIO_HANDLER_OPERATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_REGISTRATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_DEREGISTRATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_READ_EVENT 0
+#define BOOST_ASIO_HANDLER_REACTOR_WRITE_EVENT 0
+#define BOOST_ASIO_HANDLER_REACTOR_ERROR_EVENT 0
+#define BOOST_ASIO_HANDLER_REACTOR_EVENTS(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_OPERATION(args) (void)0
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// RFC 8305 connection racing. Addresses are interleaved by family and a new
+// attempt starts every ATTEMPT_DELAY, or as soon as the previous one fails,
+// while the earlier ones keep going. The first connection to succeed wins
+// and every other attempt is cancelled. One blackholed address then costs
+// ATTEMPT_DELAY instead of a full TCP timeout.
+//
+// All handlers run on the executor passed in, which must be a strand.
+class HappyEyeballs : public std::enable_shared_from_this<HappyEyeballs> {
+ public:
+  using Handler = std::function<void(const boost::system::error_code &,
+                                     boost::asio::ip::tcp::socket &&)>;
+
+  static constexpr std::chrono::milliseconds ATTEMPT_DELAY{250};
+
+  explicit HappyEyeballs(const boost::asio::any_io_executor &executor);
+
+  void start(const boost::asio::ip::tcp::resolver::results_type &endpoints,
+             Handler handler);
+  // Races `endpoints` in the order given
+  void start(std::vector<boost::asio::ip::tcp::endpoint> endpoints,
+             Handler handler);
+  // Abandons the race, the handler gets operation_aborted
+  void cancel();
+
+  // Alternates address families, starting with the family of the first
+  // endpoint so the resolver's (RFC 6724) preference is kept
+  static std::vector<boost::asio::ip::tcp::endpoint> interleave(
+      const boost::asio::ip::tcp::resolver::results_type &endpoints);
+
+ private:
+  void start_next();
+  void on_attempt(size_t attempt, const boost::system::error_code &ec);
+  void finish(const boost::system::error_code &ec,
+              boost::asio::ip::tcp::socket &&socket);
+
+  boost::asio::any_io_executor executor;
+  boost::asio::steady_timer timer;
+  std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+  std::vector<std::unique_ptr<boost::asio::ip::tcp::socket>> attempts;
+  size_t failed = 0;
+  boost::system::error_code last_error;
+  Handler handler;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+
+#include "Cluster.h"
+#include "Config.h"
+
+// Background checks for one cluster. Every sweep looks for latency outliers,
+// updates the hedge delay and, if the cluster has a `health_check` path, sends each endpoint a
+// `GET path` on a connection of its own. Anything but a 2xx within
+// PROBE_TIMEOUT counts as a failed probe, see Cluster::record_probe.
+// Checks stop once the Config the cluster belongs to is gone.
+class HealthChecker : public std::enable_shared_from_this<HealthChecker> {
+ public:
+  static constexpr std::chrono::milliseconds PROBE_TIMEOUT{1000};
+  // Sweep interval of a cluster without active checks
+  static constexpr std::chrono::milliseconds OUTLIER_INTERVAL{10000};
+
+  HealthChecker(boost::asio::io_context &io_context, Cluster &cluster,
+                std::weak_ptr<const Config> config);
+
+  void start();
+
+ private:
+  void sweep();
+  void probe(size_t i, std::shared_ptr<const Config> config);
+
+  boost::asio::any_io_executor strand;
+  boost::asio::steady_timer timer;
+  Cluster &cluster;
+  std::weak_ptr<const Config> config;
+};
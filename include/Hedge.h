@@ -0,0 +1,39 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+
+// A second copy of a request, sent on a connection of its own when the first
+// copy's endpoint is slow to answer. It reads one whole response and hands it
+// to the callback. Emitting the cancellation slot it was created with
+// abandons whatever it's waiting on, the callback then gets
+// operation_aborted.
+//
+// Everything runs on the executor passed in, which must be a strand.
+class Hedge : public std::enable_shared_from_this<Hedge> {
+ public:
+  using Callback = std::function<void(const boost::system::error_code &,
+                                      std::string &&response)>;
+
+  Hedge(const boost::asio::any_io_executor &executor,
+        boost::asio::cancellation_slot slot);
+
+  // `head` when the request is a HEAD, its response has no body
+  void start(const boost::asio::ip::tcp::endpoint &endpoint,
+             std::string request, bool head, Callback callback);
+
+ private:
+  void read_header();
+  // Reads until the message that starts `in` is complete
+  void read_body(size_t header_len, int status);
+  void finish(const boost::system::error_code &ec);
+
+  boost::asio::ip::tcp::socket socket;
+  boost::asio::cancellation_slot slot;
+  std::string request;
+  std::string in;
+  bool head = false;
+  Callback callback;
+};
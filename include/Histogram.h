@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram in the spirit of HdrHistogram. Values below
+// 2^SUB_BUCKET_BITS are counted exactly, bigger ones keep their top
+// SUB_BUCKET_BITS bits, so the relative error stays under ~3% for the whole
+// range. A histogram has a single writer (its owning thread) but can be read
+// and merged from any thread at any time.
+class Histogram {
+ public:
+  static constexpr unsigned SUB_BUCKET_BITS = 6;
+  static constexpr unsigned MAX_VALUE_BITS = 40;
+  static constexpr uint64_t MAX_VALUE = (uint64_t{1} << MAX_VALUE_BITS) - 1;
+  static constexpr size_t BUCKETS =
+      (MAX_VALUE_BITS - SUB_BUCKET_BITS) * (1 << (SUB_BUCKET_BITS - 1)) +
+      (1 << SUB_BUCKET_BITS);
+
+  Histogram() = default;
+  Histogram(const Histogram &other);
+  Histogram &operator=(const Histogram &other);
+
+  void record(uint64_t value);
+  void merge(const Histogram &other);
+  void reset();
+
+  uint64_t count() const;
+  uint64_t sum() const;
+  uint64_t max() const;
+  // p in [0, 100]. Returns the highest value equivalent to the bucket the
+  // percentile falls in, capped by the largest value recorded.
+  uint64_t percentile(double p) const;
+
+  static size_t bucket_index(uint64_t value);
+  static uint64_t bucket_upper_bound(size_t index);
+
+ private:
+  std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+  std::atomic<uint64_t> total{0};
+  std::atomic<uint64_t> total_sum{0};
+  std::atomic<uint64_t> max_value{0};
+};
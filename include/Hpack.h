@@ -0,0 +1,102 @@
+#pragma once
+
+// HPACK header compression (RFC 7541) for the HTTP/2 connections.
+//
+// The decoder hands out views into the input, the table or its own scratch
+// buffers. Once those buffers have grown to the largest header seen,
+// decoding a header block allocates nothing.
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The static table followed by a dynamic table, indices are 1-based
+class HpackTable {
+ public:
+  static constexpr size_t STATIC_ENTRIES = 61;
+  static constexpr size_t DEFAULT_SIZE = 4096;
+  // Per-entry overhead in the table's size accounting
+  static constexpr size_t ENTRY_OVERHEAD = 32;
+
+  // `capacity` is the largest size the table may ever be set to
+  explicit HpackTable(size_t capacity = DEFAULT_SIZE);
+
+  bool get(size_t index, std::string_view &name,
+           std::string_view &value) const;
+  // Adds an entry, evicting the oldest ones to make room. The views must not
+  // point into the table itself.
+  void add(std::string_view name, std::string_view value);
+  // Evicts down to `size`, which must not exceed the capacity
+  void set_max_size(size_t size);
+  size_t max_size() const { return max; }
+  size_t capacity() const { return limit; }
+  // Index of an entry matching both name and value, otherwise of one with
+  // the same name (`name_only` is set), otherwise 0
+  size_t find(std::string_view name, std::string_view value,
+              bool &name_only) const;
+
+ private:
+  struct Entry {
+    size_t offset;
+    uint32_t name_len;
+    uint32_t value_len;
+  };
+  // Dynamic entry `i`, 0 being the newest
+  const Entry &dynamic(size_t i) const;
+  void evict_to(size_t target);
+
+  // Entry bytes are appended in insertion order and compacted to the front
+  // when the end is reached, so live entries never straddle a wrap
+  std::vector<char> storage;
+  size_t storage_end = 0;
+  // Ring of entries, oldest at `first`
+  std::vector<Entry> entries;
+  size_t first = 0;
+  size_t count = 0;
+  size_t size = 0;
+  size_t max;
+  size_t limit;
+};
+
+class HpackDecoder {
+ public:
+  using Emit = std::function<void(std::string_view name,
+                                  std::string_view value)>;
+
+  // `max_table_size` is the SETTINGS_HEADER_TABLE_SIZE we advertise
+  explicit HpackDecoder(size_t max_table_size = HpackTable::DEFAULT_SIZE);
+
+  // Decodes a complete header block (HEADERS plus CONTINUATIONs). The views
+  // are only valid during the call. false is a compression error, which is
+  // fatal for the whole connection.
+  bool decode(const uint8_t *data, size_t len, const Emit &emit);
+
+ private:
+  // Reads a string literal, Huffman coded ones are decoded into `scratch`
+  bool read_string(const uint8_t *&p, const uint8_t *end, std::string &scratch,
+                   std::string_view &out);
+
+  HpackTable table;
+  std::string name_scratch;
+  std::string value_scratch;
+};
+
+class HpackEncoder {
+ public:
+  // The peer's SETTINGS_HEADER_TABLE_SIZE, announced in the next block
+  void set_max_table_size(size_t size);
+  // Appends one header field (lowercase name) to a header block
+  void encode(std::string_view name, std::string_view value, std::string &out);
+
+ private:
+  HpackTable table;
+  bool size_update_pending = false;
+};
+
+// Huffman coding with the code from RFC 7541 Appendix B
+size_t huffman_encoded_length(std::string_view in);
+void huffman_encode(std::string_view in, std::string &out);
+// Appends to `out`, false on invalid input or padding
+bool huffman_decode(const uint8_t *data, size_t len, std::string &out);
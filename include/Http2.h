@@ -0,0 +1,109 @@
+#pragma once
+
+// HTTP/2 framing (RFC 9113) and the mapping between HTTP/2 header lists and
+// the HTTP/1.1 messages the rest of the proxy passes around
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "Hpack.h"
+
+constexpr std::string_view CONNECTION_PREFACE =
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr size_t FRAME_HEADER_SIZE = 9;
+constexpr uint32_t DEFAULT_WINDOW = 65535;
+constexpr uint32_t DEFAULT_MAX_FRAME_SIZE = 16384;
+constexpr uint32_t MAX_FRAME_SIZE_LIMIT = 16777215;
+// Largest a flow control window may grow, RFC 9113 6.9.1
+constexpr int64_t MAX_WINDOW = 0x7fffffff;
+constexpr uint32_t MAX_STREAM_ID = 0x7fffffff;
+
+enum class FrameType : uint8_t {
+  DATA,
+  HEADERS,
+  PRIORITY,
+  RST_STREAM,
+  SETTINGS,
+  PUSH_PROMISE,
+  PING,
+  GOAWAY,
+  WINDOW_UPDATE,
+  CONTINUATION
+};
+
+constexpr uint8_t FLAG_END_STREAM = 0x1;
+constexpr uint8_t FLAG_ACK = 0x1;
+constexpr uint8_t FLAG_END_HEADERS = 0x4;
+constexpr uint8_t FLAG_PADDED = 0x8;
+constexpr uint8_t FLAG_PRIORITY = 0x20;
+
+enum class Setting : uint16_t {
+  HEADER_TABLE_SIZE = 1,
+  ENABLE_PUSH,
+  MAX_CONCURRENT_STREAMS,
+  INITIAL_WINDOW_SIZE,
+  MAX_FRAME_SIZE,
+  MAX_HEADER_LIST_SIZE
+};
+
+enum class H2Error : uint32_t {
+  NO_ERROR,
+  PROTOCOL_ERROR,
+  INTERNAL_ERROR,
+  FLOW_CONTROL_ERROR,
+  SETTINGS_TIMEOUT,
+  STREAM_CLOSED,
+  FRAME_SIZE_ERROR,
+  REFUSED_STREAM,
+  CANCEL,
+  COMPRESSION_ERROR,
+  CONNECT_ERROR,
+  ENHANCE_YOUR_CALM
+};
+
+struct FrameHeader {
+  uint32_t length;
+  FrameType type;
+  uint8_t flags;
+  uint32_t stream_id;
+};
+
+FrameHeader parse_frame_header(const uint8_t *p);
+uint32_t read_u32(const uint8_t *p);
+void append_frame_header(std::string &out, uint32_t length, FrameType type,
+                         uint8_t flags, uint32_t stream_id);
+void append_settings(
+    std::string &out,
+    std::initializer_list<std::pair<Setting, uint32_t>> settings);
+void append_window_update(std::string &out, uint32_t stream_id,
+                          uint32_t increment);
+void append_rst_stream(std::string &out, uint32_t stream_id, H2Error error);
+void append_goaway(std::string &out, uint32_t last_stream_id, H2Error error);
+// HEADERS followed by as many CONTINUATIONs as `max_frame_size` requires
+void append_headers(std::string &out, uint32_t stream_id,
+                    const std::string &block, bool end_stream,
+                    uint32_t max_frame_size);
+// DATA frames of at most `max_frame_size`
+void append_data(std::string &out, uint32_t stream_id, std::string_view data,
+                 bool end_stream, uint32_t max_frame_size);
+// NO_ERROR if a peer may send `value` for `id`, otherwise the connection
+// error it calls for (RFC 9113 6.5.2)
+H2Error check_setting(Setting id, uint32_t value);
+// Narrows a DATA or HEADERS payload to its content, skipping the padding
+// and the priority fields. false when the padding doesn't fit the frame.
+bool strip_padding(const FrameHeader &header, const uint8_t *&payload,
+                   size_t &len);
+
+// Encodes an HTTP/1.1 request as a header block plus its body, with the
+// chunked coding removed. Connection-specific fields are dropped. false if
+// the request line can't be mapped.
+bool encode_request(const std::string &request, HpackEncoder &encoder,
+                    std::string &block, std::string &body, bool &head);
+// Encodes an HTTP/1.1 response the same way, the body comes out unchunked.
+// Interim responses in front of the final one are skipped.
+bool encode_response(const std::string &response, HpackEncoder &encoder,
+                     std::string &block, std::string &body);
+const char *reason_phrase(int status);
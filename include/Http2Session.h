@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+#include "Hpack.h"
+#include "Http2.h"
+
+// The server side of an HTTP/2 client connection, without any I/O. Socket
+// feeds it what it reads and writes out what piles up in output(). Every
+// complete request stream comes out as an HTTP/1.1 request, so it goes
+// through the same forwarding as HTTP/1.1 clients, and its response goes
+// back in as an HTTP/1.1 response.
+class Http2Session {
+ public:
+  using RequestHandler =
+      std::function<void(uint32_t stream_id, std::string &&request)>;
+
+  static constexpr uint32_t MAX_STREAMS = 100;
+  // Request bytes a client may have in flight per stream and in total
+  static constexpr uint32_t WINDOW = 1024 * 1024;
+  static constexpr uint32_t CONNECTION_WINDOW = 16 * WINDOW;
+  // Request bodies are buffered whole before they're forwarded, and hold on
+  // to the connection window until then. A stream whose body grows past
+  // this, or fills the connection window, is reset.
+  static constexpr size_t MAX_REQUEST_BODY = CONNECTION_WINDOW / 2;
+  // Bytes of a header block, compressed and decoded (RFC 9113 6.5.2
+  // counts 32 more per field). A client going past it is cut off.
+  static constexpr uint32_t MAX_HEADER_LIST = 64 * 1024;
+
+  explicit Http2Session(RequestHandler on_request);
+
+  // Consumes the complete frames at the front of `in`, the connection
+  // preface included. false on a connection error, the caller should write
+  // what's in output() (a GOAWAY) and close.
+  bool receive(std::string &in);
+  // Sends the response, unless the client has reset the stream meanwhile
+  void respond(uint32_t stream_id, const std::string &response);
+  std::string &output() { return out; }
+  // Streams that haven't been answered completely yet
+  size_t open_streams() const { return streams.size(); }
+  // Sends GOAWAY, the streams already open are still answered
+  void go_away();
+  // Either side sent GOAWAY, no new streams
+  bool going_away() const { return goaway_received || goaway_sent; }
+
+ private:
+  struct H2Stream {
+    std::string method;
+    std::string scheme;
+    std::string authority;
+    std::string path;
+    // HTTP/1.1 header lines, cookie crumbs are joined separately
+    std::string fields;
+    std::string cookie;
+    bool has_content_length = false;
+    std::string body;
+    bool request_done = false;
+    int64_t recv_window = WINDOW;
+    uint32_t recv_unacked = 0;
+    int64_t send_window = 0;
+    std::string response_body;
+    size_t body_sent = 0;
+    bool responding = false;
+  };
+
+  bool handle_frame(const FrameHeader &header, const uint8_t *payload);
+  bool finish_header_block(uint32_t stream_id, bool end_stream);
+  void finish_request(uint32_t stream_id, H2Stream &stream);
+  void reset_stream(std::map<uint32_t, H2Stream>::iterator it, H2Error error);
+  // Gives `len` bytes of the connection window back to the client
+  void release(size_t len);
+  // Sends response bodies as far as the flow control windows allow
+  void send_data();
+  bool connection_error(H2Error error);
+  // Makes receive() fail the connection with `error`, returns false
+  bool fail(H2Error error);
+
+  RequestHandler on_request;
+  HpackDecoder decoder;
+  HpackEncoder encoder;
+  std::map<uint32_t, H2Stream> streams;
+  uint32_t last_stream_id = 0;
+  bool preface_received = false;
+  bool goaway_received = false;
+  bool goaway_sent = false;
+
+  // The client's settings
+  int64_t initial_window = DEFAULT_WINDOW;
+  uint32_t max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+  int64_t send_window = DEFAULT_WINDOW;
+  // What the client may still send, and what it can be given back
+  int64_t recv_window = CONNECTION_WINDOW;
+  uint32_t recv_unacked = 0;
+  H2Error failure = H2Error::PROTOCOL_ERROR;
+
+  std::string out;
+  std::string header_block;
+  uint32_t header_block_stream = 0;
+  bool header_block_end_stream = false;
+};
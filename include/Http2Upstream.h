@@ -0,0 +1,119 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "HappyEyeballs.h"
+#include "Hpack.h"
+#include "Http2.h"
+
+// One HTTP/2 connection per origin, shared by every client connection that
+// talks to that origin, with each request on its own stream. Origins opt in
+// with `--h2c HOST[:PORT]` (cleartext with prior knowledge).
+//
+// Requests go in and responses come out as complete HTTP/1.1 messages, so
+// Socket's exchange queue works the same for both protocols. Everything runs
+// on the connection's strand, callbacks are posted to the executor passed to
+// submit().
+class Http2Upstream : public std::enable_shared_from_this<Http2Upstream> {
+ public:
+  using Callback = std::function<void(const boost::system::error_code &,
+                                      std::string &&response)>;
+
+  // Concurrent streams when the origin doesn't set a limit
+  static constexpr uint32_t DEFAULT_MAX_STREAMS = 100;
+  // What we let every stream, and the connection, have in flight
+  static constexpr uint32_t WINDOW = 16 * 1024 * 1024;
+  // Connections a refused or unprocessed request is handed on to before
+  // it's answered with a 502
+  static constexpr unsigned MAX_RESUBMITS = 3;
+
+  // `host` as it appears in the Host header. Only call before the workers
+  // start, the set is read without a lock.
+  static void add_h2c_origin(const std::string &host);
+  static bool speaks_h2c(const std::string &host);
+  // The shared connection to `host`, a new one if there is none or it's
+  // going away
+  static std::shared_ptr<Http2Upstream> get(boost::asio::io_context &io_context,
+                                            const std::string &host);
+
+  Http2Upstream(boost::asio::io_context &io_context, const std::string &host);
+
+  void submit(std::string request, const boost::asio::any_io_executor &executor,
+              Callback callback);
+
+ private:
+  struct Pending {
+    std::string request;
+    boost::asio::any_io_executor executor;
+    Callback callback;
+    unsigned resubmits = 0;
+  };
+  struct H2Stream {
+    Pending pending;
+    bool head = false;
+    std::string body;
+    size_t body_sent = 0;
+    int64_t send_window = 0;
+    uint32_t recv_unacked = 0;
+    int status = 0;
+    // HTTP/1.1 header lines of the final response, without the status line
+    std::string header;
+    std::string content_length;
+    std::string response_body;
+  };
+
+  void enqueue(Pending &&pending);
+  void connect();
+  // Opens streams for waiting requests while the concurrency limit allows
+  void start_streams();
+  void open_stream(Pending &&pending);
+  // Sends request bodies as far as the flow control windows allow
+  void send_data();
+  void flush();
+  void read();
+  bool handle_frame(const FrameHeader &header, const uint8_t *payload);
+  bool finish_header_block(uint32_t stream_id, bool end_stream);
+  void complete(uint32_t stream_id);
+  // Hands requests the origin never processed to a fresh connection
+  void resubmit(Pending &&pending);
+  void fail(const boost::system::error_code &ec);
+  void go_away();
+  // Stops new requests from picking this connection
+  void unregister();
+
+  boost::asio::io_context &io_context;
+  boost::asio::strand<boost::asio::io_context::executor_type> strand;
+  std::string host;
+  boost::asio::ip::tcp::resolver resolver;
+  std::shared_ptr<HappyEyeballs> connecting;
+  boost::asio::ip::tcp::socket socket;
+  HpackEncoder encoder;
+  HpackDecoder decoder;
+  std::map<uint32_t, H2Stream> streams;
+  std::deque<Pending> waiting;
+  uint32_t next_stream_id = 1;
+  bool connected = false;
+  bool going_away = false;
+  bool closed = false;
+
+  // The origin's settings
+  uint32_t max_streams = DEFAULT_MAX_STREAMS;
+  int64_t initial_window = DEFAULT_WINDOW;
+  uint32_t max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+  int64_t send_window = DEFAULT_WINDOW;
+  uint32_t recv_unacked = 0;
+
+  std::string in;
+  std::string out;
+  std::string writing_buffer;
+  bool writing = false;
+  // A header block spread over HEADERS and CONTINUATION frames
+  std::string header_block;
+  uint32_t header_block_stream = 0;
+  bool header_block_end_stream = false;
+};
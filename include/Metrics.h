@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace boost::asio {
+class io_context;
+}
+
+// Phases of a proxied transaction, in the order Socket goes through them
+enum class Phase {
+  HANDSHAKE,  // TLS handshake with the client, TLS builds only
+  DNS,        // resolver.async_resolve
+  CONNECT,    // async_connect to the origin
+  TTFB,       // request written -> response header received
+  TRANSFER,   // response header received -> response fully written to client
+  COUNT
+};
+
+const char *phase_name(Phase phase);
+
+// Cheap enough for the hot path: it only touches the calling thread's own
+// histograms, they get merged when the metrics are rendered.
+void record_phase(Phase phase, std::chrono::steady_clock::duration elapsed);
+
+// Arms `probes` timers on `io_context`, each firing every LOOP_PROBE_INTERVAL.
+// How late a timer runs is how long handlers queued behind others at that
+// moment, and is recorded for the thread that ran it. Start as many as there
+// are workers so every thread gets samples.
+constexpr std::chrono::milliseconds LOOP_PROBE_INTERVAL{10};
+void start_loop_probe(boost::asio::io_context &io_context, size_t probes);
+
+// Handler durations by call site, fed by HandlerTracking.h in
+// `make TRACK_HANDLERS=1` builds. A site is registered once per mangled
+// operation type, several types can share one.
+constexpr size_t MAX_HANDLER_SITES = 256;
+size_t handler_site(const char *mangled_type);
+void record_handler(size_t site, std::chrono::steady_clock::duration elapsed);
+
+// Prometheus-style text exposition of everything recorded so far
+std::string render_metrics();
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstddef>
+
+// Admission control for new connections. Three live signals are sampled
+// every SAMPLE_INTERVAL: open connections, how late the event loop runs a
+// timer, and resident memory. Connections already accepted are never cut
+// off, the point is to let them finish while new ones wait or leave.
+//
+//   SHED   the event loop lags SHED_LAG or memory is over `--max-rss`: new
+//          connections get a canned 503 and are closed without a Socket
+//   PAUSE  `--max-conns` are open or the loop lags PAUSE_LAG: accepting
+//          stops for ACCEPT_PAUSE and new connections wait in the backlog
+class Overload {
+ public:
+  enum class Level { NORMAL, SHED, PAUSE };
+
+  static constexpr std::chrono::milliseconds SAMPLE_INTERVAL{100};
+  static constexpr std::chrono::milliseconds SHED_LAG{50};
+  static constexpr std::chrono::milliseconds PAUSE_LAG{200};
+  static constexpr std::chrono::milliseconds ACCEPT_PAUSE{50};
+
+  // Only call before the workers start. 0 connections means half the file
+  // descriptor limit (every client may need an upstream connection too), 0
+  // bytes means no memory limit.
+  static void configure(size_t max_connections, size_t max_rss_bytes);
+  // Samples on `io_context` until it stops
+  static void start_monitor(boost::asio::io_context &io_context);
+  static Level level();
+
+  // Socket counts itself for as long as it lives
+  static void connection_opened();
+  static void connection_closed();
+  static size_t open_connections();
+
+  // Writes the 503 to an accepted connection without blocking, the caller
+  // closes it
+  static void reject(int fd);
+};
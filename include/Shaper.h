@@ -0,0 +1,34 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <functional>
+
+// Shares `--bandwidth KB` per second of writes to clients between
+// connections. Responses go out in slices of at most QUANTUM bytes and each
+// slice waits for the global token bucket (and first for its client's own
+// bucket, see ClientLimits).
+//
+// Waiting slices are served in start-time fair queueing order: a slice is
+// tagged to finish QUANTUM-sized steps after the connection's previous
+// slice, or after the current virtual time if the connection has been idle.
+// A bulk download piles its tags up far ahead, so a connection with a short
+// response to write goes next instead of behind it.
+class Shaper {
+ public:
+  static constexpr size_t QUANTUM = 16 * 1024;
+
+  // A connection's place in the queue, only touched under the queue's lock
+  struct Flow {
+    double finish = 0;
+  };
+
+  // Only call before the workers start, 0 leaves bandwidth unlimited
+  static void configure(size_t bytes_per_second);
+  static bool enabled();
+  // Serves the queue on `io_context` until it stops
+  static void start(boost::asio::io_context &io_context);
+  // Calls `grant` once `bytes` may be written, right away while nobody is
+  // waiting and the bucket has them, otherwise later from any worker
+  static void request(Flow &flow, size_t bytes, std::function<void()> grant);
+};
@@ -1,43 +1,243 @@
 #include <boost/asio.hpp>
+#include <deque>
+#include <memory>
 
+#include "Breaker.h"
+#include "ClientLimits.h"
+#include "Cluster.h"
+#include "Compression.h"
+#include "Config.h"
+#include "HappyEyeballs.h"
+#include "Http2Session.h"
+#include "Http2Upstream.h"
+#include "Shaper.h"
+#include "Trace.h"
+#include "utils.h"
+
+#if defined(PROXY_WITH_URING) && defined(PROXY_WITH_TLS)
+#error "TLS=1 needs the epoll build, TlsStream waits on the socket with asio"
+#elif defined(PROXY_WITH_URING)
+#include "Uring.h"
+
+using Stream = UringStream;
+#elif defined(PROXY_WITH_TLS)
+#include "Tls.h"
+
+using Stream = TlsStream;
+#else
+using Stream = boost::asio::ip::tcp::socket;
+
+// Hands a socket connected on the side over to a Stream
+inline void adopt(Stream &stream, boost::asio::ip::tcp::socket &&connected) {
+  stream = std::move(connected);
+}
+#endif
+
+// One request/response pair on a client connection
+struct Exchange {
+  enum class Stage {
+    QUEUED,  // parsed, waiting to be forwarded
+    SENT,    // forwarded, waiting for the response
+    DONE     // response complete, waiting to be written to the client
+  };
+  Stage stage = Stage::QUEUED;
+  // Goes over a shared HTTP/2 connection instead of server_socket
+  bool multiplexed = false;
+  // Stream the request came in on when the client speaks HTTP/2
+  uint32_t stream_id = 0;
+  std::string method;
+  std::string host;
+  std::string request;
+  std::string response;
+  // Counts the request against the cluster endpoint it went to, reverse
+  // proxy only
+  EndpointLease lease;
+  // Held against the upstream's circuit breaker while the request is sent,
+  // and while it's being retried
+  CircuitBreaker::Slot pending;
+  CircuitBreaker::Slot retry;
+  unsigned retries = 0;
+  // When the breaker first held the request back
+  std::chrono::steady_clock::time_point held_since;
+  // Set when the response may go into the cache under this key
+  std::string cache_key;
+  // What the response gets compressed with on its way to the client
+  Encoding encoding = Encoding::IDENTITY;
+  // When the request was written upstream and when the response header came
+  // back, see Metrics.h
+  std::chrono::steady_clock::time_point sent_at;
+  std::chrono::steady_clock::time_point header_at;
+};
+
+// The client side is full duplex: requests keep being parsed into
+// `exchanges` while earlier ones are forwarded and answered, and responses are
+// relayed strictly in request order. Requests for the same host are written
+// upstream back to back without waiting for the responses.
+//
+// A client that opens with the HTTP/2 preface gets an Http2Session instead.
+// Its streams become exchanges like pipelined requests do, but they are
+// answered as soon as they are done, in any order.
+//
+// On a reverse-proxy listener every request goes to the listener's cluster
+// instead of its Host, over a connection to the endpoint the cluster picks.
 struct Socket : public std::enable_shared_from_this<Socket> {
-  Socket(boost::asio::io_context &io_context,
-         boost::asio::ip::tcp::socket &&socket);
+  // `socket` must already be on its own strand, Socket runs all its
+  // handlers on it. `cluster` is set on reverse-proxy listeners and belongs
+  // to `config`, which the connection keeps using until it closes.
+  Socket(boost::asio::io_context &io_context, Stream &&socket,
+         std::shared_ptr<const Config> config, Cluster *cluster = nullptr,
+         ClientLimits::Ticket client = {});
+  ~Socket();
 
   void start();
 
-  void resolve_server(size_t msg_id);
+  // Starts whatever the current state allows: reading the next request,
+  // forwarding queued ones, reading responses and writing finished ones
+  void pump();
+
+  void resolve_server(const std::string &host);
+
+  void connect_to_cluster();
 
   void connect_to_endpoints(
-      size_t msg_id, boost::asio::ip::tcp::resolver::results_type &endpoints);
+      boost::asio::ip::tcp::resolver::results_type &endpoints);
 
   void handle_wait(const boost::system::error_code &ec,
                    std::shared_ptr<Socket> self);
 
-  void read_body(boost::asio::ip::tcp::socket &socket,
-                 std::string &http_header_plus, const std::string &http_header,
-                 std::function<void()> callback);
+  // Reads until `in` holds the whole message whose header is the first
+  // `header_len` bytes, then calls back with the message's length. Bytes
+  // past it belong to the next message and stay in `in`.
+  void read_body(Stream &socket, std::string &in, size_t header_len,
+                 Body body_type, std::function<void(size_t)> callback);
 
   void get_message_from_client();
 
-  void send_message_to_server(size_t msg_id);
+  void send_message_to_server();
+
+  // Sends an exchange for an h2c origin as a stream on the shared connection
+  void send_message_multiplexed(std::shared_ptr<Exchange> exchange);
+
+  void get_message_from_server();
+
+  void send_message_to_client();
 
-  void get_message_from_server(size_t msg_id);
+  // Takes the connection over to HTTP/2 once the preface shows up
+  void start_http2();
 
-  void send_message_to_client(size_t msg_id);
+  void get_frames_from_client();
+
+  void send_frames_to_client();
+
+  // Answers an origin-form "GET /metrics" aimed at the proxy itself
+  void serve_metrics(Exchange &exchange);
+  // Same for "GET /trace", see Trace.h
+  void serve_trace(Exchange &exchange);
 
   void close();
 
  private:
-  boost::asio::strand<boost::asio::io_context::executor_type> strand;
+  void read_chunks(Stream &socket, std::string &in, size_t pos,
+                   std::function<void(size_t)> callback);
+  // Queues a 400 for a request that can't be framed and stops reading
+  void bad_request();
+  // Records a span from `begin` to now if this connection is traced
+  void trace(const char *name, std::chrono::steady_clock::time_point begin,
+             std::string_view detail = {}) {
+    if (trace_id) {
+      Trace::record(trace_id, name, begin, std::chrono::steady_clock::now(),
+                    detail);
+    }
+  }
+  // Writes `buffers` to the client, a slice at a time while bandwidth is
+  // shaped, and calls `written` once everything is out
+  void write_to_client(std::vector<boost::asio::const_buffer> buffers,
+                       std::function<void()> written);
+  void write_slice(
+      std::shared_ptr<std::vector<boost::asio::const_buffer>> buffers,
+      std::function<void()> written);
+  // Connects server_socket to the first of `endpoints` to answer
+  void dial(std::vector<boost::asio::ip::tcp::endpoint> endpoints);
+  // Reads until `in` holds at least `n` bytes
+  void fill(Stream &socket, std::string &in, size_t n,
+            std::function<void()> callback);
+  // First HTTP/1.1 exchange in `stage`, nullptr if there is none
+  std::shared_ptr<Exchange> find_exchange(Exchange::Stage stage) const;
+  void queue_stream(uint32_t stream_id, std::string &&request);
+  // Answers a forward-proxy GET from the cache or hands it to the fleet
+  // peer that owns it, before it's queued
+  void route(Exchange &exchange);
+  // After the upstream connection failed, queues the requests sent on it
+  // again. false if one of them can't be retried safely or the breaker
+  // won't allow it.
+  bool retry_sent();
+  // Answers with a 503, for requests the circuit breaker turned away
+  void reject(Exchange &exchange);
+  // Rejects everything queued for curr_host
+  void reject_queued();
+  // Answers with a 429, the client is over its request rate
+  void throttle(Exchange &exchange);
+  // Applies the negotiated Content-Encoding to a finished response, and
+  // caches the result next to the identity response
+  void compress(Exchange &exchange);
+  // Pumps again shortly, the breaker may let the next request through then
+  void wait_for_breaker();
+  // Sends a copy of `exchange` to another endpoint of the cluster if it's
+  // still waiting for its header after the cluster's hedge_delay()
+  void arm_hedge(const std::shared_ptr<Exchange> &exchange);
+  void send_hedge(const std::shared_ptr<Exchange> &exchange);
+  // The hedge answered first, server_socket is dropped
+  void use_hedge(Exchange &exchange, std::string &&response);
+
+  boost::asio::io_context &io_context;
+  boost::asio::any_io_executor strand;
   boost::asio::ip::tcp::resolver resolver;
-  boost::asio::ip::tcp::socket client_socket;
-  boost::asio::ip::tcp::socket server_socket;
+  std::shared_ptr<const Config> config;
+  Cluster *cluster;
+  // The client's slot in ClientLimits, its connection counted until we close
+  ClientLimits::Ticket client;
+  // Endpoint of `cluster` server_socket is connected to
+  size_t upstream_endpoint = 0;
+  // Failed connects in a row, each tries whatever the cluster picks next
+  size_t connect_attempts = 0;
+  // Breaker of curr_host and the connection counted against it
+  std::shared_ptr<CircuitBreaker> breaker;
+  CircuitBreaker::Slot upstream_connection;
+  std::shared_ptr<HappyEyeballs> connecting;
+  Stream client_socket;
+  Stream server_socket;
   std::chrono::duration<long> timeout;
+  // When the DNS or connect phase in flight started, see Metrics.h
+  std::chrono::steady_clock::time_point phase_start;
   boost::asio::steady_timer timer;
-  std::string prev_host;
+  // Exchange with a hedge pending or in flight, at most one at a time
+  std::shared_ptr<Exchange> hedged;
+  boost::asio::steady_timer hedge_timer;
+  boost::asio::cancellation_signal hedge_cancel;
+  // Bound to the header read on server_socket
+  boost::asio::cancellation_signal server_cancel;
+  boost::asio::steady_timer breaker_timer;
+  bool waiting_for_breaker = false;
+  // Writes to the client waiting on its ClientLimits bandwidth
+  boost::asio::steady_timer shape_timer;
+  Shaper::Flow flow;
+  // Nonzero when sampled by Trace
+  uint64_t trace_id;
+  std::chrono::steady_clock::time_point created_at;
+  // Host server_socket is connected (or connecting) to
   std::string curr_host;
-  std::vector<std::pair<std::string, std::string>> messages;
+  // Bytes read past the last complete message
+  std::string client_in;
+  std::string server_in;
+  std::deque<std::shared_ptr<Exchange>> exchanges;
+  // Set once the client turns out to speak HTTP/2
+  std::unique_ptr<Http2Session> session;
+  bool reading_client = false;
+  bool client_eof = false;
+  bool writing_client = false;
+  bool writing_server = false;
+  bool reading_server = false;
+  bool dialing = false;
   bool stopped;
   std::mutex mutex;
 };
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// CPUs this process may run on, from sched_getaffinity
+std::vector<int> allowed_cpus();
+
+// How many CPUs worth of time we can actually use: the affinity mask capped
+// by the cgroup CPU quota (cpu.max on v2, cpu.cfs_quota_us on v1). Unlike
+// std::thread::hardware_concurrency this doesn't report the host's CPUs
+// inside a container limited to a few of them.
+std::size_t available_cpus();
+
+// Pins the calling thread to `cpu`. Memory the thread touches first after
+// that (its metrics, its malloc arena) is then allocated on the local NUMA
+// node by the kernel's default first-touch policy.
+bool pin_current_thread(int cpu);
@@ -0,0 +1,117 @@
+#pragma once
+
+// TLS termination on the listener, built with `make TLS=1`.
+//
+// The handshake runs on the raw socket fd rather than through asio's BIO
+// pair so OpenSSL can move the record layer into the kernel (kTLS) once the
+// keys are known. When both directions are offloaded the connection goes on
+// as a plain TCP socket and the kernel does the crypto, otherwise TlsStream
+// keeps doing it in userspace. One SSL_CTX serves every worker, so the
+// session ID cache and the ticket keys are shared by all of them.
+
+#include <openssl/ssl.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+
+// Drop-in replacement for the parts of asio::ip::tcp::socket Socket uses,
+// with SSL_read/SSL_write in between when the kernel couldn't take the
+// records. Without an SSL it's the socket and nothing else.
+class TlsStream {
+ public:
+  using executor_type = boost::asio::any_io_executor;
+  using Handler = boost::asio::any_completion_handler<void(
+      boost::system::error_code, std::size_t)>;
+
+  explicit TlsStream(const executor_type &executor) : socket{executor} {}
+  // Takes ownership of `ssl`, which must be attached to `socket`'s fd
+  explicit TlsStream(boost::asio::ip::tcp::socket &&socket,
+                     SSL *ssl = nullptr)
+      : socket{std::move(socket)}, ssl{ssl} {}
+
+  executor_type get_executor() noexcept { return socket.get_executor(); }
+  bool is_open() const { return socket.is_open(); }
+  void cancel() { socket.cancel(); }
+  void close() { socket.close(); }
+  boost::asio::ip::tcp::endpoint remote_endpoint() const {
+    return socket.remote_endpoint();
+  }
+  boost::asio::ip::tcp::endpoint remote_endpoint(
+      boost::system::error_code &ec) const {
+    return socket.remote_endpoint(ec);
+  }
+
+  template <typename MutableBufferSequence, typename ReadToken>
+  auto async_read_some(const MutableBufferSequence &buffers,
+                       ReadToken &&token) {
+    return boost::asio::async_initiate<ReadToken,
+                                       void(boost::system::error_code,
+                                            std::size_t)>(
+        [this](auto handler, const MutableBufferSequence &buffers) {
+          if (!ssl) {
+            socket.async_read_some(buffers, std::move(handler));
+            return;
+          }
+          start_read(*boost::asio::buffer_sequence_begin(buffers),
+                     Handler{std::move(handler)});
+        },
+        token, buffers);
+  }
+
+  template <typename ConstBufferSequence, typename WriteToken>
+  auto async_write_some(const ConstBufferSequence &buffers,
+                        WriteToken &&token) {
+    return boost::asio::async_initiate<WriteToken,
+                                       void(boost::system::error_code,
+                                            std::size_t)>(
+        [this](auto handler, const ConstBufferSequence &buffers) {
+          if (!ssl) {
+            socket.async_write_some(buffers, std::move(handler));
+            return;
+          }
+          start_write(*boost::asio::buffer_sequence_begin(buffers),
+                      Handler{std::move(handler)});
+        },
+        token, buffers);
+  }
+
+ private:
+  struct SslFree {
+    void operator()(SSL *ssl) const {
+      // OpenSSL evicts sessions that end without close_notify, this keeps
+      // them resumable
+      SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      SSL_free(ssl);
+    }
+  };
+
+  void start_read(boost::asio::mutable_buffer buffer, Handler handler);
+  void start_write(boost::asio::const_buffer buffer, Handler handler);
+  // SSL_read or SSL_write, retried whenever the socket is ready for what
+  // OpenSSL wants
+  void transfer(bool reading, void *data, std::size_t size, Handler handler);
+
+  boost::asio::ip::tcp::socket socket;
+  std::unique_ptr<SSL, SslFree> ssl;
+};
+
+// Hands a socket connected on the side over to a Stream
+inline void adopt(TlsStream &stream,
+                  boost::asio::ip::tcp::socket &&connected) {
+  stream = TlsStream{std::move(connected)};
+}
+
+// The listener's context: certificate chain and key from PEM files, TLS 1.2
+// and up, ALPN h2 or http/1.1. Throws if the files don't load.
+boost::asio::ssl::context make_tls_context(const std::string &cert_file,
+                                           const std::string &key_file);
+
+// Handshakes on a freshly accepted socket and calls back with the stream
+// Socket should use from then on
+void tls_handshake(
+    boost::asio::ssl::context &context, boost::asio::ip::tcp::socket &&socket,
+    std::function<void(const boost::system::error_code &, TlsStream &&)>
+        callback);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Timelines of sampled connections, enabled with `--trace N` (one
+// connection in N) and served as Chrome trace-event JSON on GET /trace, to
+// open in chrome://tracing or Perfetto. Each connection is its own row, the
+// spans on it are the steps Socket goes through: dns, connect,
+// write_request, ttfb, body, write_response...
+//
+// Spans go into a ring buffer of the thread that records them, the last
+// RING_EVENTS per thread are kept. Connections that aren't sampled cost a
+// branch per step.
+class Trace {
+ public:
+  static constexpr size_t RING_EVENTS = 4096;
+  // Bytes of detail kept per span, like a request line
+  static constexpr size_t DETAIL = 48;
+
+  // Only call before the workers start, 0 turns tracing off
+  static void configure(uint32_t every);
+  // Id for a new connection, 0 unless it's sampled
+  static uint64_t sample();
+  static void record(uint64_t id, const char *name,
+                     std::chrono::steady_clock::time_point begin,
+                     std::chrono::steady_clock::time_point end,
+                     std::string_view detail = {});
+  static std::string render();
+};
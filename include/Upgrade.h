@@ -0,0 +1,44 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Binary upgrades without closing the listening sockets, with `--upgrade
+// PATH` given to both the running process and its replacement:
+//
+//   1. the new process connects to the Unix socket at PATH and the old one
+//      sends it every listening socket (SCM_RIGHTS), with their ports
+//   2. the new process accepts on them, takes PATH over for the next
+//      upgrade and acknowledges
+//   3. only then the old process stops accepting, serves the connections
+//      it has until they close and exits
+//
+// Connections that arrive in between wait in the listen backlog both
+// processes share, none is refused. If the new process dies before
+// acknowledging, the old one carries on as if nothing happened.
+class Upgrade {
+ public:
+  // How often a draining process checks whether its connections are gone
+  static constexpr std::chrono::milliseconds DRAIN_CHECK{100};
+
+  // Listening sockets the process serving `path` hands over, by port. Empty
+  // when no process is there. Throws std::runtime_error if one is but the
+  // handoff fails.
+  static std::map<unsigned short, int> inherit(const std::string &path);
+  // Serves `path` so the next process can take `listeners` (port and fd)
+  // over. `stop_accepting` runs once it has, after which the io_context is
+  // stopped when the last client connection closes.
+  static void serve(boost::asio::io_context &io_context,
+                    const std::string &path,
+                    std::vector<std::pair<unsigned short, int>> listeners,
+                    std::function<void()> stop_accepting);
+  // Tells the previous process the inherited sockets are being accepted on
+  static void ready();
+  // Whether the listeners were handed over and accepting should stop
+  static bool draining();
+};
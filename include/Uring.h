@@ -0,0 +1,195 @@
+#pragma once
+
+// io_uring execution mode, built with `make URING=1`.
+//
+// One ring per io_context carries every accept, recv and send. Receives are
+// multishot and land in a ring of kernel-provided buffers shared by all
+// connections, so an idle connection pins no read buffer and a busy one
+// needs no syscall per read. SQEs queued while handlers run are submitted
+// together by a single io_uring_enter once the current batch of handlers is
+// done. Completions are reaped from the shared CQ ring after asio's reactor
+// reports the ring fd readable, which costs nothing extra because that
+// epoll_wait happens anyway.
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// An in-flight ring operation, its address is the SQE's user_data
+struct UringOp {
+  virtual ~UringOp() = default;
+  // Runs without the ring lock held. Multishot operations are called once
+  // per CQE and deleted after the last one (no IORING_CQE_F_MORE).
+  virtual void complete(int res, unsigned flags) = 0;
+};
+
+// Thin wrapper over the raw ring, not thread safe
+class Uring {
+ public:
+  Uring(unsigned entries);
+  ~Uring();
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  // Zeroed SQE, nullptr when the submission queue is full
+  io_uring_sqe *get_sqe();
+  // Hands every queued SQE to the kernel with one io_uring_enter
+  int submit();
+  bool cq_ready() const;
+  // Moves every available CQE into `out`
+  void reap(std::vector<io_uring_cqe> &out);
+
+  // Registers `count` buffers of `size` bytes as provided buffer group `bgid`
+  void register_buffers(uint16_t bgid, unsigned count, unsigned size);
+  char *buffer(uint16_t bid) { return buffers + size_t{bid} * buffer_size; }
+  // Gives a provided buffer back to the kernel
+  void recycle(uint16_t bid);
+
+  int fd = -1;
+
+ private:
+  io_uring_params params{};
+  void *sq_ring = nullptr;
+  void *cq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  size_t cq_ring_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+  unsigned sqe_tail = 0;
+
+  io_uring_buf_ring *buf_ring = nullptr;
+  size_t buf_ring_size = 0;
+  char *buffers = nullptr;
+  unsigned buffer_count = 0;
+  unsigned buffer_size = 0;
+  uint16_t buf_tail = 0;
+};
+
+class UringService : public boost::asio::io_context::service {
+ public:
+  static boost::asio::io_context::id id;
+
+  static constexpr unsigned ENTRIES = 4096;
+  static constexpr uint16_t BUFFER_GROUP = 0;
+  static constexpr unsigned BUFFER_COUNT = 4096;
+  static constexpr unsigned BUFFER_SIZE = 16 * 1024;
+
+  explicit UringService(boost::asio::io_context &io_context);
+
+  // Queues an SQE for `op`. Submission is deferred until the handlers that
+  // are currently runnable have run, so it's batched across connections.
+  void queue(UringOp *op, const std::function<void(io_uring_sqe &)> &prep);
+  // Copies a received buffer and hands it straight back to the kernel
+  void consume_buffer(uint16_t bid, size_t len, std::string &into);
+
+ private:
+  void shutdown() override;
+  void flush();
+  // Moves SQEs that didn't fit earlier into the ring, mutex held
+  void refill();
+  void wait_for_completions();
+  // Runs on one thread at a time, so an op's CQEs complete in order and an
+  // op isn't deleted while another thread still completes it
+  void handle_completions();
+
+  boost::asio::io_context &io_context;
+  std::mutex mutex;
+  Uring ring;
+  // Prepared while the submission queue was full and the kernel wouldn't
+  // take any more, in order
+  std::deque<io_uring_sqe> overflow;
+  boost::asio::posix::stream_descriptor notifier;
+  bool flush_scheduled = false;
+  std::atomic<bool> draining{false};
+};
+
+// Drop-in replacement for the parts of asio::ip::tcp::socket Socket uses
+class UringStream {
+ public:
+  using executor_type = boost::asio::any_io_executor;
+  using Handler = boost::asio::any_completion_handler<void(
+      boost::system::error_code, std::size_t)>;
+
+  explicit UringStream(const executor_type &executor);
+  UringStream(const executor_type &executor, int fd);
+  UringStream(UringStream &&other) = default;
+  UringStream &operator=(UringStream &&other);
+  ~UringStream();
+
+  executor_type get_executor() noexcept;
+  bool is_open() const;
+  // Takes ownership of an already connected socket
+  void assign(int fd);
+  void cancel();
+  void close();
+  boost::asio::ip::tcp::endpoint remote_endpoint() const;
+  // Doesn't throw, a peer that reset right after connecting has none
+  boost::asio::ip::tcp::endpoint remote_endpoint(
+      boost::system::error_code &ec) const;
+
+  template <typename MutableBufferSequence, typename ReadToken>
+  auto async_read_some(const MutableBufferSequence &buffers,
+                       ReadToken &&token) {
+    return boost::asio::async_initiate<ReadToken,
+                                       void(boost::system::error_code,
+                                            std::size_t)>(
+        [this](auto handler, const MutableBufferSequence &buffers) {
+          start_read(*boost::asio::buffer_sequence_begin(buffers),
+                     Handler{std::move(handler)});
+        },
+        token, buffers);
+  }
+
+  template <typename ConstBufferSequence, typename WriteToken>
+  auto async_write_some(const ConstBufferSequence &buffers,
+                        WriteToken &&token) {
+    return boost::asio::async_initiate<WriteToken,
+                                       void(boost::system::error_code,
+                                            std::size_t)>(
+        [this](auto handler, const ConstBufferSequence &buffers) {
+          start_write(*boost::asio::buffer_sequence_begin(buffers),
+                      Handler{std::move(handler)});
+        },
+        token, buffers);
+  }
+
+  struct State;
+
+ private:
+  void start_read(boost::asio::mutable_buffer buffer, Handler handler);
+  void start_write(boost::asio::const_buffer buffer, Handler handler);
+
+  std::shared_ptr<State> state;
+};
+
+// Hands a socket connected with asio over to the ring
+inline void adopt(UringStream &stream,
+                  boost::asio::ip::tcp::socket &&connected) {
+  stream.assign(connected.release());
+}
+
+// Multishot accept: one SQE keeps producing connections
+class UringAcceptor {
+ public:
+  using Callback = std::function<void(const boost::system::error_code &, int)>;
+
+  UringAcceptor(boost::asio::io_context &io_context, int listen_fd);
+  // `callback` runs on the io_context for every accepted fd
+  void start(Callback callback);
+  // Cancels the accept, `callback` gets operation_aborted one last time
+  void stop();
+
+ private:
+  boost::asio::io_context &io_context;
+  UringService &service;
+  int listen_fd;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+
+// USDT probes in the SystemTap format, for perf, bpftrace and friends:
+//
+//   bpftrace -e 'usdt:./boost:proxy:response { @[arg1] = count(); }'
+//
+// A probe is a nop at the probe site plus an ELF note (.note.stapsdt)
+// saying where the nop is and where each argument lives at that point, so
+// a tracer can put a breakpoint there and read them. Nothing runs when no
+// tracer is attached; the arguments are only computed into a register or
+// stack slot. Arguments are passed as 64-bit values, pass pointers for
+// strings. This writes the same note <sys/sdt.h> would, without needing
+// systemtap's headers to build.
+//
+//   PROXY_PROBE2(accept, fd, port);
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define PROXY_PROBE_NOTE(name, args)                                      \
+  "990: nop\n"                                                            \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                           \
+  ".balign 4\n"                                                           \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+  "991: .asciz \"stapsdt\"\n"                                             \
+  "992: .balign 4\n"                                                      \
+  "993: .8byte 990b\n"                                                    \
+  ".8byte _.stapsdt.base\n"                                               \
+  ".8byte 0\n"                                                            \
+  ".asciz \"proxy\"\n"                                                    \
+  ".asciz \"" #name "\"\n"                                                \
+  ".asciz \"" args "\"\n"                                                 \
+  "994: .balign 4\n"                                                      \
+  ".popsection\n"                                                         \
+  ".ifndef _.stapsdt.base\n"                                              \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+  ".weak _.stapsdt.base\n"                                                \
+  ".hidden _.stapsdt.base\n"                                              \
+  "_.stapsdt.base: .space 1\n"                                            \
+  ".size _.stapsdt.base, 1\n"                                             \
+  ".popsection\n"                                                         \
+  ".endif\n"
+
+#define PROXY_PROBE_ARG(value) "nor"((uint64_t)(value))
+
+#define PROXY_PROBE0(name) __asm__ __volatile__(PROXY_PROBE_NOTE(name, "") ::)
+#define PROXY_PROBE1(name, a)                                   \
+  __asm__ __volatile__(PROXY_PROBE_NOTE(name, "8@%0")::PROXY_PROBE_ARG(a))
+#define PROXY_PROBE2(name, a, b)                                \
+  __asm__ __volatile__(PROXY_PROBE_NOTE(name, "8@%0 8@%1")::    \
+                           PROXY_PROBE_ARG(a), PROXY_PROBE_ARG(b))
+#define PROXY_PROBE3(name, a, b, c)                                        \
+  __asm__ __volatile__(PROXY_PROBE_NOTE(name, "8@%0 8@%1 8@%2")::          \
+                           PROXY_PROBE_ARG(a), PROXY_PROBE_ARG(b),         \
+                           PROXY_PROBE_ARG(c))
+
+#else
+
+#define PROXY_PROBE0(name) (void)0
+#define PROXY_PROBE1(name, a) (void)0
+#define PROXY_PROBE2(name, a, b) (void)0
+#define PROXY_PROBE3(name, a, b, c) (void)0
+
+#endif
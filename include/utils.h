@@ -12,9 +12,30 @@ constexpr const char *CYN = "\x1B[36m";
 constexpr const char *WHT = "\x1B[37m";
 constexpr const char *RESET = "\x1B[0m";
 
-enum class Body { CONTENT_LENGTH, CHUNKED, NONE };
+enum class Body { CONTENT_LENGTH, CHUNKED, NONE, INVALID };
 
 void to_lowercase(std::string &str);
 bool find_ci(const std::string &haystack, const std::string &needle);
 std::string parse_field(std::string header_copy, std::string &&field_name);
+// How a message's body is framed. INVALID with both Content-Length and
+// Transfer-Encoding (RFC 9112 6.3, what request smuggling relies on), with a
+// Transfer-Encoding other than chunked, or a Content-Length that
+// content_length() can't read.
 Body identify_body(const std::string &http_header);
+// The Content-Length field, false unless it's all digits and fits a size_t
+bool content_length(const std::string &http_header, size_t &len);
+// Methods that may be sent twice with the same effect (RFC 9110 9.2.2)
+bool idempotent(const std::string &method);
+// Splits a Host header value into the host and the port (or "http")
+std::pair<std::string, std::string> split_host_port(const std::string &host);
+enum class Chunks { COMPLETE, INCOMPLETE, MALFORMED };
+// Walks a chunked body from `pos`, the start of a chunk size line. COMPLETE
+// once the last chunk and the trailers are in `buf`, with `pos` just past
+// the end of the message. INCOMPLETE leaves `pos` on the first incomplete
+// chunk so the walk can resume when more data arrives. MALFORMED when a size
+// line isn't 1 to 16 hex digits or the size can't fit in memory, the
+// message's end can't be found then.
+Chunks skip_chunks(const std::string &buf, size_t &pos);
+// The body of a chunked message starting at `pos`, without the chunk framing.
+// Stops at the first incomplete or malformed chunk.
+std::string unchunk(const std::string &buf, size_t pos);
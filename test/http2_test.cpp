@@ -0,0 +1,283 @@
+// Checks for the HPACK decoder, the Huffman code and the SETTINGS bounds in
+// Hpack.h and Http2.h, which see every byte an HTTP/2 peer sends.
+//
+// Usage: test_http2, exits non-zero on the first failure.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Hpack.h"
+#include "Http2.h"
+
+#define CHECK(condition)                                                   \
+  do {                                                                     \
+    if (!(condition)) {                                                    \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition          \
+                << std::endl;                                              \
+      std::exit(1);                                                        \
+    }                                                                      \
+  } while (0)
+
+using Fields = std::vector<std::pair<std::string, std::string>>;
+
+static std::string unhex(const std::string &hex) {
+  std::string out;
+  int high = -1;
+  for (char c : hex) {
+    if (c == ' ') {
+      continue;
+    }
+    int nibble = c <= '9' ? c - '0' : c - 'a' + 10;
+    if (high < 0) {
+      high = nibble;
+    } else {
+      out += char(high << 4 | nibble);
+      high = -1;
+    }
+  }
+  return out;
+}
+
+static bool decode(HpackDecoder &decoder, const std::string &hex,
+                   Fields &fields) {
+  std::string block = unhex(hex);
+  fields.clear();
+  return decoder.decode(
+      reinterpret_cast<const uint8_t *>(block.data()), block.size(),
+      [&](std::string_view name, std::string_view value) {
+        fields.emplace_back(name, value);
+      });
+}
+
+static bool huffman(const std::string &hex, std::string &out) {
+  std::string data = unhex(hex);
+  out.clear();
+  return huffman_decode(reinterpret_cast<const uint8_t *>(data.data()),
+                        data.size(), out);
+}
+
+static const Fields FIRST_REQUEST = {{":method", "GET"},
+                                     {":scheme", "http"},
+                                     {":path", "/"},
+                                     {":authority", "www.example.com"}};
+static const Fields SECOND_REQUEST = {{":method", "GET"},
+                                      {":scheme", "http"},
+                                      {":path", "/"},
+                                      {":authority", "www.example.com"},
+                                      {"cache-control", "no-cache"}};
+static const Fields THIRD_REQUEST = {{":method", "GET"},
+                                     {":scheme", "https"},
+                                     {":path", "/index.html"},
+                                     {":authority", "www.example.com"},
+                                     {"custom-key", "custom-value"}};
+
+static const Fields FIRST_RESPONSE = {
+    {":status", "302"},
+    {"cache-control", "private"},
+    {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+    {"location", "https://www.example.com"}};
+static const Fields SECOND_RESPONSE = {
+    {":status", "307"},
+    {"cache-control", "private"},
+    {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+    {"location", "https://www.example.com"}};
+static const Fields THIRD_RESPONSE = {
+    {":status", "200"},
+    {"cache-control", "private"},
+    {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+    {"location", "https://www.example.com"},
+    {"content-encoding", "gzip"},
+    {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}};
+
+// RFC 7541 C.3, requests on one connection without Huffman coding
+static void requests() {
+  HpackDecoder decoder;
+  Fields fields;
+  CHECK(decode(decoder, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+               fields));
+  CHECK(fields == FIRST_REQUEST);
+  CHECK(decode(decoder, "8286 84be 5808 6e6f 2d63 6163 6865", fields));
+  CHECK(fields == SECOND_REQUEST);
+  CHECK(decode(decoder,
+               "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d "
+               "7661 6c75 65",
+               fields));
+  CHECK(fields == THIRD_REQUEST);
+}
+
+// RFC 7541 C.4, the same requests Huffman coded
+static void huffman_requests() {
+  HpackDecoder decoder;
+  Fields fields;
+  CHECK(decode(decoder, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", fields));
+  CHECK(fields == FIRST_REQUEST);
+  CHECK(decode(decoder, "8286 84be 5886 a8eb 1064 9cbf", fields));
+  CHECK(fields == SECOND_REQUEST);
+  CHECK(decode(decoder,
+               "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+               fields));
+  CHECK(fields == THIRD_REQUEST);
+}
+
+// RFC 7541 C.5, responses filling a 256 byte table so entries get evicted
+static void responses() {
+  HpackDecoder decoder(256);
+  Fields fields;
+  CHECK(decode(decoder,
+               "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 "
+               "4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 "
+               "7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+               fields));
+  CHECK(fields == FIRST_RESPONSE);
+  CHECK(decode(decoder, "4803 3330 37c1 c0bf", fields));
+  CHECK(fields == SECOND_RESPONSE);
+  CHECK(decode(decoder,
+               "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a "
+               "3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 "
+               "444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 "
+               "553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e "
+               "3d31",
+               fields));
+  CHECK(fields == THIRD_RESPONSE);
+}
+
+// RFC 7541 C.6, the same responses Huffman coded
+static void huffman_responses() {
+  HpackDecoder decoder(256);
+  Fields fields;
+  CHECK(decode(decoder,
+               "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 "
+               "9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 "
+               "e9ae 82ae 43d3",
+               fields));
+  CHECK(fields == FIRST_RESPONSE);
+  CHECK(decode(decoder, "4883 640e ffc1 c0bf", fields));
+  CHECK(fields == SECOND_RESPONSE);
+  CHECK(decode(decoder,
+               "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d "
+               "1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b "
+               "3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed "
+               "4ee5 b106 3d50 07",
+               fields));
+  CHECK(fields == THIRD_RESPONSE);
+}
+
+static void huffman_round_trip() {
+  std::string text = "custom-value, with Spaces & \"quotes\" ~\x01\xff";
+  std::string coded;
+  huffman_encode(text, coded);
+  CHECK(coded.size() == huffman_encoded_length(text));
+  std::string decoded;
+  CHECK(huffman_decode(reinterpret_cast<const uint8_t *>(coded.data()),
+                       coded.size(), decoded));
+  CHECK(decoded == text);
+}
+
+static void bad_huffman() {
+  std::string out;
+  // "a" is 00011, padded with ones
+  CHECK(huffman("1f", out) && out == "a");
+  // padding that isn't all ones
+  CHECK(!huffman("18", out));
+  // more than 7 bits of padding
+  CHECK(!huffman("1fff", out));
+  // EOS coded as a symbol
+  CHECK(!huffman("ffff ffff", out));
+  // the same in a header block
+  HpackDecoder decoder;
+  Fields fields;
+  CHECK(!decode(decoder, "0081 1f81 18", fields));
+}
+
+static void bad_index() {
+  HpackDecoder decoder;
+  Fields fields;
+  CHECK(decode(decoder, "bd", fields));
+  CHECK((fields == Fields{{"www-authenticate", ""}}));
+  // index 0, and 62 with an empty dynamic table
+  CHECK(!decode(decoder, "80", fields));
+  CHECK(!decode(decoder, "be", fields));
+  // a literal naming a missing entry
+  CHECK(!decode(decoder, "7f00 0161", fields));
+  // one past the only dynamic entry
+  CHECK(decode(decoder, "4001 6101 62be", fields));
+  CHECK(!decode(decoder, "bf", fields));
+}
+
+static void table_size_update() {
+  HpackDecoder decoder;
+  Fields fields;
+  // 4096, the size we advertise, then 0 and back
+  CHECK(decode(decoder, "3fe1 1f", fields));
+  CHECK(decode(decoder, "20 3fe1 1f", fields));
+  CHECK(!decode(decoder, "3fe2 1f", fields));
+  // an integer that never ends
+  CHECK(!decode(decoder, "3fff ffff ffff ff", fields));
+}
+
+static void settings_bounds() {
+  CHECK(check_setting(Setting::MAX_FRAME_SIZE, 16383) ==
+        H2Error::PROTOCOL_ERROR);
+  CHECK(check_setting(Setting::MAX_FRAME_SIZE, 16384) == H2Error::NO_ERROR);
+  CHECK(check_setting(Setting::MAX_FRAME_SIZE, 16777215) ==
+        H2Error::NO_ERROR);
+  CHECK(check_setting(Setting::MAX_FRAME_SIZE, 16777216) ==
+        H2Error::PROTOCOL_ERROR);
+  CHECK(check_setting(Setting::ENABLE_PUSH, 1) == H2Error::NO_ERROR);
+  CHECK(check_setting(Setting::ENABLE_PUSH, 2) == H2Error::PROTOCOL_ERROR);
+  CHECK(check_setting(Setting::INITIAL_WINDOW_SIZE, 0x7fffffff) ==
+        H2Error::NO_ERROR);
+  CHECK(check_setting(Setting::INITIAL_WINDOW_SIZE, 0x80000000) ==
+        H2Error::FLOW_CONTROL_ERROR);
+  CHECK(check_setting(Setting::HEADER_TABLE_SIZE, UINT32_MAX) ==
+        H2Error::NO_ERROR);
+}
+
+static void frame_header() {
+  std::string out;
+  append_frame_header(out, 0x123456, FrameType::HEADERS, FLAG_PADDED, 7);
+  out[5] |= 0x80;
+  FrameHeader header =
+      parse_frame_header(reinterpret_cast<const uint8_t *>(out.data()));
+  CHECK(header.length == 0x123456);
+  CHECK(header.type == FrameType::HEADERS);
+  CHECK(header.flags == FLAG_PADDED);
+  // the reserved bit is ignored
+  CHECK(header.stream_id == 7);
+}
+
+static void padding() {
+  FrameHeader header{4, FrameType::DATA, FLAG_PADDED, 1};
+  std::string payload = unhex("02 61 0000");
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(payload.data());
+  size_t len = payload.size();
+  CHECK(strip_padding(header, p, len) && len == 1 && *p == 'a');
+  // padding longer than the rest of the frame
+  payload = unhex("04 61 0000");
+  p = reinterpret_cast<const uint8_t *>(payload.data());
+  len = payload.size();
+  CHECK(!strip_padding(header, p, len));
+  // no room for the pad length
+  header.length = 0;
+  len = 0;
+  CHECK(!strip_padding(header, p, len));
+}
+
+int main() {
+  requests();
+  huffman_requests();
+  responses();
+  huffman_responses();
+  huffman_round_trip();
+  bad_huffman();
+  bad_index();
+  table_size_update();
+  settings_bounds();
+  frame_header();
+  padding();
+  std::cout << "http2: ok" << std::endl;
+}
@@ -0,0 +1,121 @@
+// Checks for the message framing helpers in utils.h, which parse bytes
+// straight off client and origin connections.
+//
+// Usage: test_utils, exits non-zero on the first failure. A walk that never
+// ends is killed by an alarm.
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "utils.h"
+
+#define CHECK(condition)                                                   \
+  do {                                                                     \
+    if (!(condition)) {                                                    \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition          \
+                << std::endl;                                              \
+      std::exit(1);                                                        \
+    }                                                                      \
+  } while (0)
+
+static const std::string HEADER =
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+
+static void complete_message() {
+  std::string message =
+      HEADER + "5;ext=1\r\nhello\r\nA\r\n0123456789\r\n0\r\n\r\n";
+  size_t pos = HEADER.size();
+  CHECK(skip_chunks(message, pos) == Chunks::COMPLETE);
+  CHECK(pos == message.size());
+  CHECK(unchunk(message, HEADER.size()) == "hello0123456789");
+}
+
+static void incomplete_message() {
+  std::string message = HEADER + "5\r\nhello\r\nA\r\n0123";
+  size_t pos = HEADER.size();
+  CHECK(skip_chunks(message, pos) == Chunks::INCOMPLETE);
+  // left on the chunk that isn't all there yet
+  CHECK(message.compare(pos, 3, "A\r\n") == 0);
+}
+
+// A size that wrapped `line_end + 2 + size + 2` around to the size line
+// itself had the walk spin forever
+static void size_overflow() {
+  std::string message = HEADER + "FFFFFFFFFFFFFFEC\r\nxx\r\n";
+  size_t pos = HEADER.size();
+  CHECK(skip_chunks(message, pos) == Chunks::MALFORMED);
+  CHECK(unchunk(message, HEADER.size()).empty());
+}
+
+static void size_too_long() {
+  std::string message = HEADER + "00000000000000005\r\nhello\r\n0\r\n\r\n";
+  size_t pos = HEADER.size();
+  CHECK(skip_chunks(message, pos) == Chunks::MALFORMED);
+}
+
+static void huge_size_waits() {
+  // fits in memory in principle, just not here yet
+  std::string message = HEADER + "FFFFFFFFFFFF\r\nxx";
+  size_t pos = HEADER.size();
+  CHECK(skip_chunks(message, pos) == Chunks::INCOMPLETE);
+  CHECK(pos == HEADER.size());
+}
+
+static void no_digits() {
+  std::string message = HEADER + ";ext\r\n\r\n";
+  size_t pos = HEADER.size();
+  CHECK(skip_chunks(message, pos) == Chunks::MALFORMED);
+  message = HEADER + "-5\r\nhello\r\n0\r\n\r\n";
+  pos = HEADER.size();
+  CHECK(skip_chunks(message, pos) == Chunks::MALFORMED);
+}
+
+// Content-Length and Transfer-Encoding together is how a request gets
+// framed one way here and another way by the origin
+static void framing() {
+  CHECK(identify_body("GET / HTTP/1.1\r\nHost: a\r\n\r\n") == Body::NONE);
+  CHECK(identify_body(HEADER) == Body::CHUNKED);
+  CHECK(identify_body("POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\n") ==
+        Body::CONTENT_LENGTH);
+  CHECK(identify_body("POST / HTTP/1.1\r\nContent-Length: 5\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n") ==
+        Body::INVALID);
+  CHECK(identify_body("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                      "Content-Length: 5\r\n\r\n") == Body::INVALID);
+  CHECK(identify_body("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n") ==
+        Body::INVALID);
+}
+
+static std::string with_length(const std::string &value) {
+  return "POST / HTTP/1.1\r\nContent-Length: " + value + "\r\n\r\n";
+}
+
+static void content_lengths() {
+  size_t len = 1;
+  CHECK(content_length(with_length("0"), len) && len == 0);
+  CHECK(content_length(with_length("18446744073709551615"), len) &&
+        len == SIZE_MAX);
+  CHECK(!content_length(with_length("18446744073709551616"), len));
+  CHECK(!content_length(with_length("abc"), len));
+  CHECK(!content_length(with_length("-1"), len));
+  CHECK(!content_length(with_length("5, 5"), len));
+  CHECK(!content_length(with_length(""), len));
+  CHECK(identify_body(with_length("1x")) == Body::INVALID);
+}
+
+int main() {
+  alarm(5);
+  complete_message();
+  incomplete_message();
+  size_overflow();
+  size_too_long();
+  huge_size_waits();
+  no_digits();
+  framing();
+  content_lengths();
+  std::cout << "utils: ok" << std::endl;
+}
@@ -1,5 +1,8 @@
 #include "utils.h"
 
+#include <cctype>
+#include <cstdint>
+
 void to_lowercase(std::string &str) {
   std::transform(str.begin(), str.end(), str.begin(),
                  [](auto c) { return std::tolower(c); });
@@ -15,30 +18,144 @@ bool find_ci(const std::string &haystack, const std::string &needle) {
 }
 
 Body identify_body(const std::string &http_header) {
-  if (find_ci(http_header, "content-length")) {
-    return Body::CONTENT_LENGTH;
+  // Only look at field names, a URL can contain these words as well
+  bool has_length = find_ci(http_header, "\r\ncontent-length:");
+  if (find_ci(http_header, "\r\ntransfer-encoding:")) {
+    // the origin could frame it differently than we do
+    return !has_length &&
+                   find_ci(parse_field(http_header, "transfer-encoding"),
+                           "chunked")
+               ? Body::CHUNKED
+               : Body::INVALID;
   }
-  if (find_ci(http_header, "chunked")) {
-    return Body::CHUNKED;
+  if (has_length) {
+    size_t len;
+    return content_length(http_header, len) ? Body::CONTENT_LENGTH
+                                            : Body::INVALID;
   }
   return Body::NONE;
 }
 
+bool content_length(const std::string &http_header, size_t &len) {
+  std::string value = parse_field(http_header, "content-length");
+  len = 0;
+  for (char c : value) {
+    if (c < '0' || c > '9' || len > (SIZE_MAX - (c - '0')) / 10) {
+      return false;
+    }
+    len = len * 10 + (c - '0');
+  }
+  return !value.empty();
+}
+
 std::string parse_field(std::string http_header, std::string &&field) {
   to_lowercase(http_header);
   to_lowercase(field);
-  // There's a colon at the end of field names
-  auto len_field_beg = http_header.find(field) + field.size() + strlen(":");
+  // Field names start a line and end with a colon. Searching for the bare
+  // name would also match the request line, e.g. "GET http://localhost/".
+  auto field_pos = http_header.find("\r\n" + field + ":");
+  if (field_pos == std::string::npos) {
+    return "";
+  }
+  auto len_field_beg =
+      field_pos + strlen("\r\n") + field.size() + strlen(":");
   auto len_field_end = http_header.find("\r\n", len_field_beg);
   std::string result =
       http_header.substr(len_field_beg, len_field_end - len_field_beg);
   // trim both sides
-  if (result.find(" ") != std::string::npos) {
-    result.erase(result.find(" "), result.find_first_not_of(" "));
+  auto first = result.find_first_not_of(" \t");
+  if (first == std::string::npos) {
+    return "";
+  }
+  auto last = result.find_last_not_of(" \t");
+  return result.substr(first, last - first + 1);
+}
+
+bool idempotent(const std::string &method) {
+  return method == "GET" || method == "HEAD" || method == "OPTIONS" ||
+         method == "TRACE" || method == "PUT" || method == "DELETE";
+}
+
+std::pair<std::string, std::string> split_host_port(const std::string &host) {
+  // "[::1]:8080" or "[::1]"
+  if (!host.empty() && host.front() == '[') {
+    auto bracket = host.find(']');
+    if (bracket != std::string::npos) {
+      std::string port = "http";
+      if (bracket + 1 < host.size() && host[bracket + 1] == ':') {
+        port = host.substr(bracket + 2);
+      }
+      return {host.substr(1, bracket - 1), port};
+    }
   }
-  if (result.find(" ") != std::string::npos) {
-    result.erase(result.begin() + result.find(" "),
-                 result.begin() + result.find_first_not_of(" "));
+  auto colon = host.find(':');
+  // more than one colon is a bare IPv6 address
+  if (colon == std::string::npos ||
+      host.find(':', colon + 1) != std::string::npos) {
+    return {host, "http"};
+  }
+  return {host.substr(0, colon), host.substr(colon + 1)};
+}
+
+// The hex size at the start of a chunk size line ending at `line_end`, up to
+// a chunk extension (";name=value"). False unless it's 1 to 16 hex digits
+// and the chunk, its CRLF and the next line's CRLF fit in a size_t.
+static bool parse_chunk_size(const std::string &buf, size_t pos,
+                             size_t line_end, size_t &chunk_len) {
+  chunk_len = 0;
+  size_t digits = 0;
+  for (; pos < line_end && std::isxdigit(static_cast<unsigned char>(buf[pos]));
+       ++pos, ++digits) {
+    if (digits == 16) {
+      return false;
+    }
+    char c = buf[pos];
+    unsigned digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    chunk_len = chunk_len << 4 | digit;
+  }
+  return digits > 0 && chunk_len <= SIZE_MAX - line_end - 6;
+}
+
+Chunks skip_chunks(const std::string &buf, size_t &pos) {
+  while (true) {
+    auto line_end = buf.find("\r\n", pos);
+    if (line_end == std::string::npos) {
+      return Chunks::INCOMPLETE;
+    }
+    size_t chunk_len = 0;
+    if (!parse_chunk_size(buf, pos, line_end, chunk_len)) {
+      return Chunks::MALFORMED;
+    }
+    if (!chunk_len) {
+      // the last chunk, then optional trailers and an empty line
+      auto end = buf.find("\r\n\r\n", line_end);
+      if (end == std::string::npos) {
+        return Chunks::INCOMPLETE;
+      }
+      pos = end + 4;
+      return Chunks::COMPLETE;
+    }
+    // compared before adding, a huge size can't wrap around
+    if (chunk_len + 4 > buf.size() - line_end) {
+      return Chunks::INCOMPLETE;
+    }
+    pos = line_end + 2 + chunk_len + 2;
+  }
+}
+
+std::string unchunk(const std::string &buf, size_t pos) {
+  std::string body;
+  while (true) {
+    auto line_end = buf.find("\r\n", pos);
+    if (line_end == std::string::npos) {
+      return body;
+    }
+    size_t chunk_len = 0;
+    if (!parse_chunk_size(buf, pos, line_end, chunk_len) || !chunk_len ||
+        chunk_len + 2 > buf.size() - line_end) {
+      return body;
+    }
+    body.append(buf, line_end + 2, chunk_len);
+    pos = line_end + 2 + chunk_len + 2;
   }
-  return result;
 }